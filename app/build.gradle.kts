@@ -51,6 +51,11 @@ android {
         compose = true
     }
 
+    testOptions {
+        // JVM unit tests run against a stub android.jar; let android.util.Log no-op
+        unitTests.isReturnDefaultValues = true
+    }
+
     composeOptions {
         kotlinCompilerExtensionVersion = "1.5.6"
     }
@@ -102,6 +107,7 @@ dependencies {
 
     // Testing
     testImplementation("junit:junit:4.13.2")
+    testImplementation("org.json:json:20231013")  // Real org.json for the JVM tests; android.jar only stubs it
     androidTestImplementation("androidx.test.ext:junit:1.1.5")
     androidTestImplementation("androidx.test.espresso:espresso-core:3.5.1")
 }
@@ -0,0 +1,602 @@
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "decode_worker.h"
+#include "engine.h"
+
+/**
+ * mathagent-bench: reproducible performance report for the native engine
+ *
+ * Loads a model through the same load_model / create_engine / warm_prompt
+ * path as LlamaEngine, then replays fixed ReAct transcripts through the
+ * decode worker exactly as ReActAgent drives it: the system prompt warmed
+ * into the default session, then one generation per step with the ReAct
+ * grammar and stop strings, each prompt extending the previous one. The
+ * report is a single JSON object on stdout; logs go to logcat (or stderr
+ * on a host build).
+ *
+ * Build the target for the device ABI and run it over adb:
+ *
+ *   adb push mathagent-bench /data/local/tmp/
+ *   adb shell /data/local/tmp/mathagent-bench -m /data/local/tmp/model.gguf > report.json
+ *
+ * Greedy sampling (the default -temp 0) keeps runs comparable; each
+ * transcript is replayed -r times from the warmed prefix.
+ */
+
+// --------------------------------------------------------------------------
+// Fixed workload
+// --------------------------------------------------------------------------
+
+// Same text as ReActAgent's system prompt, so prefix length and warm-up
+// cost match the app
+static const char *SYSTEM_PROMPT = R"PROMPT(You are a Socratic Math Tutor aligned with Common Core Math Practices.
+
+## Your Role
+Guide students to discover mathematical answers through questioning,
+not by providing solutions directly.
+
+## Teaching Approach (Socratic Method)
+- Ask thought-provoking questions that lead to insight
+- Provide hints that advance understanding without giving the answer
+- Celebrate productive mistakes as learning opportunities
+- Build confidence through incremental challenges
+
+## Common Core Alignment
+MP1: Make sense of problems and persevere
+MP2: Reason abstractly and quantitatively
+MP3: Construct viable arguments and critique reasoning
+MP4: Model with mathematics
+MP5: Use appropriate tools strategically
+MP6: Attend to precision
+MP7: Look for and make use of structure
+MP8: Look for and express regularity in repeated reasoning
+
+## Tools Available
+
+### Calculation Tools
+- calculate: Evaluate numeric expressions (e.g., "2 + 2", "3.5 * 4")
+
+### Algebra Tools
+- solve_equation: Solve equations (e.g., "2x + 5 = 15", "x^2 - 4 = 0")
+- simplify_expression: Simplify algebraic expressions (e.g., "2x + 3x", "(x+1)^2")
+- expand_expression: Expand expressions (e.g., "(x+1)^2", "2(x+3)")
+- factor_expression: Factor expressions (e.g., "x^2 - 4", "2x + 4")
+
+### Teaching Tools
+- get_hint: Generate a pedagogical hint for a problem
+- verify_worked_example: Check student's step-by-step work
+- check_answer: Verify if a student's answer is correct
+
+## Response Format
+Think step by step. Use tools when needed. Always explain your reasoning.
+
+When you need to use a tool, output:
+{"action": "tool_name", "input": "parameter"}
+
+When you need several tools that do not depend on each other, output a list:
+[{"action": "tool_name", "input": "parameter"}, {"action": "tool_name", "input": "parameter"}]
+
+When you have the final answer, output:
+{"answer": "your response"}
+
+Remember: Your goal is to guide the student to understanding,
+not to do the work for them.)PROMPT";
+
+// ReActAgent.REACT_JSON_GRAMMAR
+static const char *REACT_JSON_GRAMMAR = R"GBNF(
+root ::= tool_calls | final_answer | text
+
+tool_calls ::= tool_call | "[" ws tool_call (ws "," ws tool_call)* ws "]"
+
+tool_call ::= "{" ws quote "action" quote ws ":" ws quote action quote ws "," ws quote "input" quote ws ":" ws quote input quote ws "}"
+final_answer ::= "{" ws quote "answer" quote ws ":" ws quote text quote ws "}"
+
+action ::= "calculate" | "solve_equation" | "simplify_expression" | "expand_expression" | "factor_expression" | "get_hint" | "verify_worked_example" | "check_answer"
+input ::= string_content
+string_content ::= ([^"\\] | escape)*
+escape ::= "\\" (["\\nrt/])
+text ::= [^"\n]*
+
+ws ::= " "*
+quote ::= "\""
+)GBNF";
+
+// LlamaEngine.DEFAULT_STOP_STRINGS
+static const std::vector<std::string> STOP_STRINGS = { "<|im_end|>", "\nObservation:" };
+
+// A user question and the tool steps of a recorded answer. Step i is
+// generated after the user turn plus steps [0, i), as in ReActAgent.
+struct Transcript {
+    const char *name;
+    const char *user;
+    std::vector<std::string> steps;     // "response\nObservation: ...\n"
+};
+
+static const std::vector<Transcript> TRANSCRIPTS = {
+    {
+        "solve_quadratic",
+        "How do I solve x^2 - 5x + 6 = 0?",
+        {
+            "{\"action\": \"factor_expression\", \"input\": \"x^2 - 5x + 6\"}\n"
+            "Observation: Tool factor_expression returned: (x - 2)*(x - 3)\n"
+            "The expression factors into two linear terms.\n",
+            "{\"action\": \"solve_equation\", \"input\": \"x^2 - 5x + 6 = 0\"}\n"
+            "Observation: Tool solve_equation returned: [2, 3]\n"
+            "The equation has two real solutions.\n",
+        },
+    },
+    {
+        "check_arithmetic",
+        "I got 3.5 * 4 + 12 / 3 = 18. Is that right?",
+        {
+            "{\"action\": \"calculate\", \"input\": \"3.5 * 4 + 12 / 3\"}\n"
+            "Observation: Tool calculate returned: 18\n"
+            "Multiplication and division are done before addition.\n",
+        },
+    },
+    {
+        "expand_and_simplify",
+        "Can you help me simplify (x + 1)^2 - (x - 1)^2?",
+        {
+            "{\"action\": \"expand_expression\", \"input\": \"(x + 1)^2\"}\n"
+            "Observation: Tool expand_expression returned: x**2 + 2*x + 1\n"
+            "Squaring a binomial gives three terms.\n",
+            "{\"action\": \"expand_expression\", \"input\": \"(x - 1)^2\"}\n"
+            "Observation: Tool expand_expression returned: x**2 - 2*x + 1\n"
+            "Squaring a binomial gives three terms.\n",
+            "{\"action\": \"simplify_expression\", \"input\": \"(x + 1)^2 - (x - 1)^2\"}\n"
+            "Observation: Tool simplify_expression returned: 4*x\n"
+            "The squared and constant terms cancel.\n",
+        },
+    },
+};
+
+// --------------------------------------------------------------------------
+// Process metrics
+// --------------------------------------------------------------------------
+
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * User + system CPU time of the whole process, in microseconds
+ */
+static int64_t cpu_time_us() {
+    struct rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    return (int64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000
+         + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+/**
+ * A "Vm..:  1234 kB" field of /proc/self/status, in kB, or -1
+ */
+static long proc_status_kb(const char *field) {
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f) {
+        return -1;
+    }
+    char line[256];
+    long kb = -1;
+    const size_t n = strlen(field);
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, field, n) == 0 && line[n] == ':') {
+            kb = strtol(line + n + 1, nullptr, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+/**
+ * Peak resident set size in kB: VmHWM, or ru_maxrss where /proc is hidden
+ */
+static long peak_rss_kb() {
+    const long hwm = proc_status_kb("VmHWM");
+    if (hwm >= 0) {
+        return hwm;
+    }
+    struct rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;     // kB on Linux
+}
+
+// --------------------------------------------------------------------------
+// Runs
+// --------------------------------------------------------------------------
+
+struct Options {
+    std::string model_path;
+    std::string draft_path;
+    std::string state_path;
+    ModelParams model;
+    EngineParams engine;
+    int max_tokens = 128;
+    int repeats = 3;
+};
+
+// One generation: timings split at the first streamed byte, which ends
+// the prefill (and the first sampled token)
+struct RunResult {
+    std::string transcript;
+    int step = 0;
+    int repeat = 0;
+    int prompt_tokens = 0;
+    int prefill_tokens = 0;     // Not already in the KV cache
+    double prefill_ms = 0;
+    double ttft_ms = 0;
+    int generated_tokens = 0;
+    double decode_ms = 0;
+    double total_ms = 0;
+    double prefill_cpu_ms = 0;
+    double decode_cpu_ms = 0;
+};
+
+/**
+ * Back to just the warmed system prompt, so every repeat starts alike
+ */
+static void rewind_to_prefix(Engine &engine) {
+    std::lock_guard<std::mutex> lock(engine.mutex);
+    Session *session = find_session(engine, DEFAULT_SESSION);
+    if (session->tokens.size() > session->n_keep) {
+        llama_kv_cache_seq_rm(engine.context, session->seq_id, (llama_pos)session->n_keep, -1);
+        session->tokens.resize(session->n_keep);
+    }
+    session->evicted.clear();
+}
+
+/**
+ * Submit one generation to the decode worker and drain it as Kotlin does
+ *
+ * Polls the stream instead of waiting on the job, so the time to the first
+ * streamed byte is what a user would see.
+ */
+static bool run_once(DecodeWorker &worker, std::shared_ptr<Engine> engine,
+                     const std::vector<llama_token> &prompt, int max_tokens, RunResult &run) {
+    auto job = std::make_shared<GenerateJob>(STREAM_RING_BYTES);
+    job->engine = engine;
+    job->session_id = DEFAULT_SESSION;
+    job->prompt_tokens.assign(prompt.begin(), prompt.end());
+    job->grammar = REACT_JSON_GRAMMAR;
+    job->stop_strings = STOP_STRINGS;
+    job->max_tokens = max_tokens;
+    job->sampling.temperature = engine->sampling_params.temp;
+
+    std::vector<char> buffer(4096);
+    const int64_t t_start = now_us();
+    const int64_t cpu_start = cpu_time_us();
+    int64_t t_first = 0;
+    int64_t cpu_first = 0;
+
+    worker.submit(job);
+    while (true) {
+        // Read the state first so a final drain follows completion
+        const bool done = job->state.load(std::memory_order_acquire) == GenerateJob::DONE;
+        if (job->stream.read_utf8(buffer.data(), buffer.size()) > 0 && t_first == 0) {
+            t_first = now_us();
+            cpu_first = cpu_time_us();
+        }
+        if (done) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    const int64_t t_end = now_us();
+    const int64_t cpu_end = cpu_time_us();
+    if (t_first == 0) {
+        t_first = t_end;
+        cpu_first = cpu_end;
+    }
+
+    std::lock_guard<std::mutex> lock(engine->mutex);
+    run.prompt_tokens = (int)prompt.size();
+    for (const auto &timing : engine->prefill_timings) {
+        run.prefill_tokens += timing.first;
+        run.prefill_ms += timing.second;
+    }
+    run.generated_tokens = engine->spec_stats.n_generated;
+    run.ttft_ms = (t_first - t_start) / 1000.0;
+    run.decode_ms = (t_end - t_first) / 1000.0;
+    run.total_ms = (t_end - t_start) / 1000.0;
+    run.prefill_cpu_ms = (cpu_first - cpu_start) / 1000.0;
+    run.decode_cpu_ms = (cpu_end - cpu_first) / 1000.0;
+    return run.generated_tokens > 0;
+}
+
+// --------------------------------------------------------------------------
+// Report
+// --------------------------------------------------------------------------
+
+static double rate(double tokens, double ms) {
+    return ms > 0 ? tokens * 1000.0 / ms : 0.0;
+}
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    const size_t i = std::min(values.size() - 1, (size_t)(p * (double)(values.size() - 1) + 0.5));
+    return values[i];
+}
+
+static std::string json_string(const std::string &text) {
+    std::string out = "\"";
+    for (char c : text) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    char hex[8];
+                    snprintf(hex, sizeof(hex), "\\u%04x", c);
+                    out += hex;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out + "\"";
+}
+
+/**
+ * CPU time over wall time per available thread, in [0, 1] give or take
+ * the polling thread and llama.cpp's spinning workers
+ */
+static double utilisation(double cpu_ms, double wall_ms, int n_threads) {
+    return wall_ms > 0 && n_threads > 0 ? cpu_ms / (wall_ms * n_threads) : 0.0;
+}
+
+static void print_report(const Options &options, const Engine &engine, double load_ms, int warm_tokens,
+                         double warm_ms, const std::vector<RunResult> &runs) {
+    const int n_threads = llama_n_threads(engine.context);
+    const int n_threads_batch = llama_n_threads_batch(engine.context);
+
+    std::vector<double> prefill_rates, decode_rates, ttfts, prefill_utils, decode_utils;
+    for (const RunResult &run : runs) {
+        if (run.prefill_tokens > 0) {
+            prefill_rates.push_back(rate(run.prefill_tokens, run.prefill_ms));
+            prefill_utils.push_back(utilisation(run.prefill_cpu_ms, run.ttft_ms, n_threads_batch));
+        }
+        decode_rates.push_back(rate(run.generated_tokens - 1, run.decode_ms));
+        decode_utils.push_back(utilisation(run.decode_cpu_ms, run.decode_ms, n_threads));
+        ttfts.push_back(run.ttft_ms);
+    }
+
+    printf("{\n");
+    printf("  \"model\": %s,\n", json_string(options.model_path).c_str());
+    printf("  \"model_bytes\": %llu,\n", (unsigned long long)llama_model_size(engine.model->model));
+    printf("  \"draft_model\": %s,\n", json_string(options.draft_path).c_str());
+    printf("  \"cpu\": %s,\n", json_string(g_cpu.describe()).c_str());
+    printf("  \"n_ctx\": %u,\n", llama_n_ctx(engine.context));
+    printf("  \"n_batch\": %u,\n", llama_n_batch(engine.context));
+    printf("  \"n_ubatch\": %u,\n", llama_n_ubatch(engine.context));
+    printf("  \"n_threads\": %d,\n", n_threads);
+    printf("  \"n_threads_batch\": %d,\n", n_threads_batch);
+    printf("  \"pinned\": %s,\n", engine.threadpool ? "true" : "false");
+    printf("  \"n_gpu_layers\": %d,\n", options.model.n_gpu_layers);
+    printf("  \"kv_type\": %s,\n", json_string(ggml_type_name(engine.type_k)).c_str());
+    printf("  \"flash_attn\": %s,\n", engine.flash_attn ? "true" : "false");
+    printf("  \"temperature\": %.2f,\n", engine.sampling_params.temp);
+    printf("  \"max_tokens\": %d,\n", options.max_tokens);
+    printf("  \"repeats\": %d,\n", options.repeats);
+    printf("  \"load_ms\": %.1f,\n", load_ms);
+    printf("  \"warm_tokens\": %d,\n", warm_tokens);
+    printf("  \"warm_ms\": %.1f,\n", warm_ms);
+    printf("  \"peak_rss_kb\": %ld,\n", peak_rss_kb());
+    printf("  \"summary\": {\n");
+    printf("    \"prefill_tok_s_median\": %.2f,\n", percentile(prefill_rates, 0.5));
+    printf("    \"decode_tok_s_median\": %.2f,\n", percentile(decode_rates, 0.5));
+    printf("    \"ttft_ms_median\": %.1f,\n", percentile(ttfts, 0.5));
+    printf("    \"ttft_ms_p90\": %.1f,\n", percentile(ttfts, 0.9));
+    printf("    \"prefill_thread_util_median\": %.3f,\n", percentile(prefill_utils, 0.5));
+    printf("    \"decode_thread_util_median\": %.3f\n", percentile(decode_utils, 0.5));
+    printf("  },\n");
+    printf("  \"runs\": [\n");
+    for (size_t i = 0; i < runs.size(); i++) {
+        const RunResult &run = runs[i];
+        printf("    {\"transcript\": %s, \"step\": %d, \"repeat\": %d, \"prompt_tokens\": %d, "
+               "\"prefill_tokens\": %d, \"prefill_tok_s\": %.2f, \"ttft_ms\": %.1f, "
+               "\"generated_tokens\": %d, \"decode_tok_s\": %.2f, \"total_ms\": %.1f, "
+               "\"prefill_thread_util\": %.3f, \"decode_thread_util\": %.3f}%s\n",
+               json_string(run.transcript).c_str(), run.step, run.repeat, run.prompt_tokens,
+               run.prefill_tokens, rate(run.prefill_tokens, run.prefill_ms), run.ttft_ms,
+               run.generated_tokens, rate(run.generated_tokens - 1, run.decode_ms), run.total_ms,
+               utilisation(run.prefill_cpu_ms, run.ttft_ms, n_threads_batch),
+               utilisation(run.decode_cpu_ms, run.decode_ms, n_threads),
+               i + 1 < runs.size() ? "," : "");
+    }
+    printf("  ]\n");
+    printf("}\n");
+}
+
+// --------------------------------------------------------------------------
+// Main
+// --------------------------------------------------------------------------
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s -m MODEL [options]\n"
+            "  -m PATH       GGUF model\n"
+            "  -md PATH      draft model for speculative decoding\n"
+            "  -c N          context size (default %d)\n"
+            "  -t N          decode threads (default: performance cores, capped)\n"
+            "  -tb N         prefill threads (default: performance cores)\n"
+            "  -b N          n_batch (default %d)\n"
+            "  -ub N         n_ubatch (default n_batch)\n"
+            "  -ngl N        layers offloaded to the GPU (default 0)\n"
+            "  -ctk N        KV cache type: 0 f16, 1 q8_0, 2 q4_0 (default 0)\n"
+            "  -fa           flash attention\n"
+            "  -n N          max tokens per generation (default 128)\n"
+            "  -r N          repeats per transcript (default 3)\n"
+            "  -temp F       sampling temperature (default 0, greedy)\n"
+            "  -s PATH       prompt state file (default $TMPDIR/mathagent-bench.kvstate)\n"
+            "  --no-mmap     read the model into memory\n"
+            "  --mlock       lock the weights in RAM\n"
+            "  --page-in     fault the mapped model in on a background thread\n",
+            argv0, DEFAULT_N_CTX, DEFAULT_N_BATCH);
+}
+
+static bool parse_args(int argc, char **argv, Options &options) {
+    options.engine.temperature = 0.0f;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        auto next = [&]() -> const char * {
+            return i + 1 < argc ? argv[++i] : nullptr;
+        };
+        const char *value = nullptr;
+        if (arg == "-fa") {
+            options.engine.flash_attn = true;
+        } else if (arg == "--no-mmap") {
+            options.model.use_mmap = false;
+        } else if (arg == "--mlock") {
+            options.model.use_mlock = true;
+        } else if (arg == "--page-in") {
+            options.model.page_in = true;
+        } else if (!(value = next())) {
+            return false;
+        } else if (arg == "-m") {
+            options.model_path = value;
+        } else if (arg == "-md") {
+            options.draft_path = value;
+        } else if (arg == "-s") {
+            options.state_path = value;
+        } else if (arg == "-c") {
+            options.engine.n_ctx = atoi(value);
+        } else if (arg == "-t") {
+            options.engine.n_threads = atoi(value);
+        } else if (arg == "-tb") {
+            options.engine.n_threads_batch = atoi(value);
+        } else if (arg == "-b") {
+            options.engine.n_batch = atoi(value);
+        } else if (arg == "-ub") {
+            options.engine.n_ubatch = atoi(value);
+        } else if (arg == "-ngl") {
+            options.model.n_gpu_layers = atoi(value);
+        } else if (arg == "-ctk") {
+            options.engine.kv_type = atoi(value);
+        } else if (arg == "-n") {
+            options.max_tokens = std::max(1, atoi(value));
+        } else if (arg == "-r") {
+            options.repeats = std::max(1, atoi(value));
+        } else if (arg == "-temp") {
+            options.engine.temperature = (float)atof(value);
+        } else {
+            return false;
+        }
+    }
+    if (options.state_path.empty()) {
+        const char *tmp = getenv("TMPDIR");
+        options.state_path = std::string(tmp && *tmp ? tmp : "/data/local/tmp") + "/mathagent-bench.kvstate";
+    }
+    return !options.model_path.empty();
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parse_args(argc, argv, options)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    init_backend();
+
+    int64_t t_start = now_us();
+    std::shared_ptr<LoadedModel> model = load_model(options.model_path, options.model);
+    if (!model) {
+        return 1;
+    }
+    const double load_ms = (now_us() - t_start) / 1000.0;
+
+    std::shared_ptr<Engine> engine = create_engine(std::move(model), options.engine);
+    if (!engine) {
+        return 1;
+    }
+    if (!options.draft_path.empty()
+        && !load_draft_model(*engine, options.draft_path, (int)llama_n_ctx(engine->context), 0,
+                             options.model.n_gpu_layers, 8)) {
+        return 1;
+    }
+
+    // Cold warm-up every time: a state file from another build or model
+    // would make warm_ms meaningless
+    const std::string system_prefix = std::string("<|im_start|>system\n") + SYSTEM_PROMPT + "<|im_end|>\n";
+    unlink(options.state_path.c_str());
+    t_start = now_us();
+    int warm_tokens;
+    {
+        std::lock_guard<std::mutex> lock(engine->mutex);
+        warm_tokens = warm_prompt(*engine, DEFAULT_SESSION, system_prefix, options.state_path);
+    }
+    const double warm_ms = (now_us() - t_start) / 1000.0;
+    unlink(options.state_path.c_str());
+    if (warm_tokens < 0) {
+        return 1;
+    }
+
+    // Tokenized piece by piece like ReActAgent.budgetedPrompt
+    const llama_vocab *vocab = engine->vocab();
+    const std::vector<llama_token> head = common_tokenize(vocab, system_prefix, true, true);
+
+    DecodeWorker worker(run_generation);
+    std::vector<RunResult> runs;
+    for (const Transcript &transcript : TRANSCRIPTS) {
+        for (int repeat = 0; repeat < options.repeats; repeat++) {
+            rewind_to_prefix(*engine);
+
+            std::vector<llama_token> prompt = head;
+            const std::string user_turn = std::string("<|im_start|>user\n") + transcript.user
+                                        + "<|im_end|>\n<|im_start|>assistant\n";
+            const std::vector<llama_token> user_tokens = common_tokenize(vocab, user_turn, false, true);
+            prompt.insert(prompt.end(), user_tokens.begin(), user_tokens.end());
+
+            for (size_t step = 0; step <= transcript.steps.size(); step++) {
+                if (step > 0) {
+                    const std::vector<llama_token> step_tokens =
+                        common_tokenize(vocab, transcript.steps[step - 1], false, true);
+                    prompt.insert(prompt.end(), step_tokens.begin(), step_tokens.end());
+                }
+                if (prompt.size() + (size_t)options.max_tokens >= llama_n_ctx(engine->context)) {
+                    LOGE("Transcript %s does not fit the context", transcript.name);
+                    return 1;
+                }
+
+                RunResult run;
+                run.transcript = transcript.name;
+                run.step = (int)step;
+                run.repeat = repeat;
+                if (!run_once(worker, engine, prompt, options.max_tokens, run)) {
+                    LOGE("Generation failed for %s step %zu", transcript.name, step);
+                    return 1;
+                }
+                LOGI("%s step %zu: ttft %.1f ms, %d tokens in %.1f ms",
+                     transcript.name, step, run.ttft_ms, run.generated_tokens, run.total_ms);
+                runs.push_back(run);
+            }
+        }
+    }
+    worker.stop();
+
+    print_report(options, *engine, load_ms, warm_tokens, warm_ms, runs);
+
+    engine.reset();
+    llama_backend_free();
+    return 0;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/**
+ * Core layout of a heterogeneous (big.LITTLE / DynamIQ) CPU
+ *
+ * Cores are grouped by cpuinfo_max_freq from sysfs. Every core faster than
+ * the slowest cluster counts as a performance core; on Tensor G2 that is
+ * the 2 Cortex-X1 and 2 Cortex-A78, leaving the 4 Cortex-A55 out. When the
+ * frequencies cannot be read or all cores are equal, every core counts.
+ */
+struct CpuTopology {
+    struct Core {
+        int id;
+        long max_khz;   // 0 if unknown
+    };
+
+    std::vector<Core> cores;
+    std::vector<int> performance;   // Core ids, fastest first
+
+    static CpuTopology detect() {
+        CpuTopology topo;
+        const long n_cpus = sysconf(_SC_NPROCESSORS_CONF);
+        for (int id = 0; id < n_cpus; id++) {
+            topo.cores.push_back({ id, read_max_khz(id) });
+        }
+
+        long slowest = 0;
+        for (const Core &core : topo.cores) {
+            if (core.max_khz > 0 && (slowest == 0 || core.max_khz < slowest)) {
+                slowest = core.max_khz;
+            }
+        }
+
+        std::vector<Core> fast;
+        for (const Core &core : topo.cores) {
+            if (core.max_khz > slowest) {
+                fast.push_back(core);
+            }
+        }
+        if (fast.empty()) {
+            fast = topo.cores;
+        }
+        std::stable_sort(fast.begin(), fast.end(),
+                         [](const Core &a, const Core &b) { return a.max_khz > b.max_khz; });
+        for (const Core &core : fast) {
+            topo.performance.push_back(core.id);
+        }
+        return topo;
+    }
+
+    /**
+     * e.g. "8 cores (4x1800 MHz, 2x2350 MHz, 2x2850 MHz), performance cores 6,7,4,5"
+     */
+    std::string describe() const {
+        std::vector<long> freqs;
+        for (const Core &core : cores) {
+            freqs.push_back(core.max_khz);
+        }
+        std::sort(freqs.begin(), freqs.end());
+
+        std::string out = std::to_string(cores.size()) + " cores (";
+        for (size_t i = 0; i < freqs.size();) {
+            size_t j = i;
+            while (j < freqs.size() && freqs[j] == freqs[i]) {
+                j++;
+            }
+            if (i > 0) {
+                out += ", ";
+            }
+            out += std::to_string(j - i) + "x"
+                 + (freqs[i] > 0 ? std::to_string(freqs[i] / 1000) + " MHz" : "unknown MHz");
+            i = j;
+        }
+        out += "), performance cores ";
+        for (size_t i = 0; i < performance.size(); i++) {
+            out += (i > 0 ? "," : "") + std::to_string(performance[i]);
+        }
+        return out;
+    }
+
+private:
+    static long read_max_khz(int cpu) {
+        char path[96];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq", cpu);
+        FILE *f = fopen(path, "r");
+        if (!f) {
+            return 0;
+        }
+        long khz = 0;
+        if (fscanf(f, "%ld", &khz) != 1) {
+            khz = 0;
+        }
+        fclose(f);
+        return khz;
+    }
+};
+
+/**
+ * Restrict the calling thread to the given cores
+ *
+ * @return false if the kernel refused (cores offline or not permitted)
+ */
+inline bool pin_current_thread(const std::vector<int> &cores) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int id : cores) {
+        CPU_SET(id, &set);
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "token_ring.h"
+
+// Context, sessions and samplers a job runs against (defined in engine.h)
+struct Engine;
+
+/**
+ * Sampling parameters of one generation
+ *
+ * A temperature <= 0 samples greedily. Samplers are cached per session by
+ * grammar and config, so switching between a few configs costs nothing.
+ */
+struct SamplingConfig {
+    float temperature = 0.7f;
+    int top_k = 40;
+    float top_p = 0.95f;
+    float min_p = 0.05f;
+    float repeat_penalty = 1.0f;    // 1 disables
+    uint32_t seed = 0xFFFFFFFF;     // LLAMA_DEFAULT_SEED: random
+
+    /**
+     * Greedy without penalties: the argmax of the logits, no sampler needed
+     */
+    bool plain_greedy() const {
+        return temperature <= 0.0f && repeat_penalty == 1.0f;
+    }
+
+    bool operator==(const SamplingConfig &other) const {
+        return temperature == other.temperature && top_k == other.top_k && top_p == other.top_p
+            && min_p == other.min_p && repeat_penalty == other.repeat_penalty && seed == other.seed;
+    }
+};
+
+/**
+ * Where the time of one generation went, filled in by the runner
+ *
+ * Complete once the job is DONE. Times are in microseconds; decode_token_us
+ * holds, per decode step, the step time divided by the tokens it committed.
+ */
+struct GenerationMetrics {
+    enum StopReason {
+        STOP_NONE,          // Never ran (cancelled while queued)
+        STOP_EOG,
+        STOP_MAX_TOKENS,
+        STOP_STRING,
+        STOP_GRAMMAR,       // Grammar could only accept EOG
+        STOP_CANCELLED,
+        STOP_ERROR,         // Decode failure or context that could not be shifted
+    };
+
+    StopReason stop_reason = STOP_NONE;
+    int prompt_tokens = 0;
+    int reused_tokens = 0;      // Prompt prefix already in the KV cache
+    int prefill_tokens = 0;
+    int generated_tokens = 0;
+    int64_t tokenize_us = 0;
+    int64_t prefill_us = 0;
+    int64_t decode_us = 0;
+    int64_t sample_us = 0;
+    int64_t grammar_us = 0;     // Fast-forward probes; grammar work inside sampling counts as sampling
+    int64_t stream_us = 0;      // Handing text to the caller, including waits on a full stream
+    int64_t total_us = 0;
+    std::vector<float> decode_token_us;
+};
+
+/**
+ * One generate request and everything the caller reads back from it
+ *
+ * Shared between the JNI side (which polls, drains and cancels it) and the
+ * decode thread (which runs it), so it outlives whichever side drops it
+ * first. It holds a reference to its engine, which therefore outlives the
+ * job too.
+ */
+struct GenerateJob {
+    enum State { QUEUED, RUNNING, DONE };
+
+    explicit GenerateJob(size_t stream_bytes) : stream(stream_bytes) {}
+
+    std::shared_ptr<Engine> engine;
+    int session_id = 0;
+    std::string prompt;
+    std::vector<int32_t> prompt_tokens;     // Used instead of prompt when set
+    std::string grammar;
+    std::vector<std::string> stop_strings;
+    int max_tokens = 0;
+    SamplingConfig sampling;
+
+    std::atomic<int> state{QUEUED};
+    std::atomic<bool> cancelled{false};
+    TokenRing stream;       // Streamed text, drained by the caller
+    std::string result;     // Full text; complete once state is DONE
+    GenerationMetrics metrics;
+};
+
+/**
+ * Dedicated decode thread fed by a FIFO command queue
+ *
+ * The thread is started on the first submit and parks on a condition
+ * variable when the queue is empty. Cancelling a queued job drops it;
+ * cancelling the running job sets its flag, which the runner checks
+ * between decode steps.
+ */
+class DecodeWorker {
+public:
+    using Runner = void (*)(GenerateJob &job);
+
+    explicit DecodeWorker(Runner runner) : runner_(runner) {}
+
+    ~DecodeWorker() {
+        stop();
+    }
+
+    void submit(std::shared_ptr<GenerateJob> job) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!thread_.joinable()) {
+            stopping_ = false;
+            thread_ = std::thread(&DecodeWorker::loop, this);
+        }
+        queue_.push_back(std::move(job));
+        wake_.notify_one();
+    }
+
+    void cancel(GenerateJob &job) {
+        job.cancelled.store(true, std::memory_order_release);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = queue_.begin(); it != queue_.end(); ++it) {
+            if (it->get() == &job) {
+                job.state.store(GenerateJob::DONE, std::memory_order_release);
+                queue_.erase(it);
+                break;
+            }
+        }
+    }
+
+    /**
+     * Cancel everything and join the thread
+     *
+     * Must be called before freeing anything the runner uses.
+     */
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto &job : queue_) {
+                job->cancelled.store(true, std::memory_order_release);
+                job->state.store(GenerateJob::DONE, std::memory_order_release);
+            }
+            queue_.clear();
+            if (running_) {
+                running_->cancelled.store(true, std::memory_order_release);
+            }
+            stopping_ = true;
+            wake_.notify_all();
+        }
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+private:
+    void loop() {
+        while (true) {
+            std::shared_ptr<GenerateJob> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+                if (stopping_) {
+                    return;
+                }
+                job = std::move(queue_.front());
+                queue_.pop_front();
+                running_ = job;
+            }
+
+            job->state.store(GenerateJob::RUNNING, std::memory_order_release);
+            if (!job->cancelled.load(std::memory_order_acquire)) {
+                runner_(*job);
+            }
+            job->state.store(GenerateJob::DONE, std::memory_order_release);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            running_.reset();
+        }
+    }
+
+    Runner runner_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<std::shared_ptr<GenerateJob>> queue_;
+    std::shared_ptr<GenerateJob> running_;
+    bool stopping_ = false;
+};
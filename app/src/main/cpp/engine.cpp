@@ -0,0 +1,1817 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+#include "engine.h"
+#include "forced_prefix.h"
+#include "stop_strings.h"
+#include "token_ring.h"
+#include "utf8_stream.h"
+
+CpuTopology g_cpu;
+std::atomic<float> g_load_progress{0.0f};
+std::atomic<bool> g_load_cancel{false};
+std::atomic<bool> g_fast_forward{true};
+std::atomic<int> g_prefill_chunk{0};
+
+// Several fields updated together, so a mutex rather than atomics
+static PromptLookupParams g_lookup_params = { true, 2, 4, 8 };
+static std::mutex g_lookup_mutex;
+
+PromptLookupParams get_lookup_params() {
+    std::lock_guard<std::mutex> lock(g_lookup_mutex);
+    return g_lookup_params;
+}
+
+void set_lookup_params(const PromptLookupParams &params) {
+    std::lock_guard<std::mutex> lock(g_lookup_mutex);
+    g_lookup_params = params;
+}
+
+// --------------------------------------------------------------------------
+// Helper functions
+// --------------------------------------------------------------------------
+
+/**
+ * Length of the longest common prefix of two token sequences
+ */
+static size_t common_prefix_length(
+    const std::vector<llama_token> &a,
+    const std::vector<llama_token> &b
+) {
+    size_t n = 0;
+    const size_t limit = std::min(a.size(), b.size());
+    while (n < limit && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Drop a session's KV sequence and forget its cached tokens
+ *
+ * Used after a failed decode, where the cache may hold a partial batch.
+ */
+void reset_kv_cache(llama_context *context, Session &session) {
+    llama_kv_cache_seq_rm(context, session.seq_id, -1, -1);
+    session.tokens.clear();
+    session.evicted.clear();
+}
+
+/**
+ * Decode tokens[n_past:] into the session's sequence, requesting logits
+ * for the last one
+ *
+ * The tokens are fed in chunks of g_prefill_chunk so no single llama_batch
+ * exceeds n_batch; each chunk's wall time is recorded in the engine's
+ * prefill_timings. On success the decoded tokens are appended to
+ * session.tokens. If cancel is set between chunks, the chunks decoded so
+ * far stay cached.
+ */
+bool prefill_tokens(
+    Engine &engine,
+    Session &session,
+    const std::vector<llama_token> &tokens,
+    size_t n_past,
+    const std::atomic<bool> *cancel
+) {
+    llama_context *context = engine.context;
+    llama_batch &batch = engine.batch;
+    const size_t n_batch = llama_n_batch(context);
+    const int chunk_setting = g_prefill_chunk.load(std::memory_order_relaxed);
+    const size_t chunk = chunk_setting > 0
+        ? std::min((size_t)chunk_setting, n_batch)
+        : n_batch;
+
+    engine.prefill_timings.clear();
+
+    for (size_t start = n_past; start < tokens.size(); start += chunk) {
+        if (cancel && cancel->load(std::memory_order_acquire)) {
+            return false;
+        }
+        const size_t end = std::min(start + chunk, tokens.size());
+
+        common_batch_clear(batch);
+        for (size_t i = start; i < end; i++) {
+            common_batch_add(batch, tokens[i], (llama_pos)i, { session.seq_id }, false);
+        }
+        if (end == tokens.size()) {
+            batch.logits[batch.n_tokens - 1] = true;
+        }
+
+        const int64_t t_start = llama_time_us();
+        if (llama_decode(context, batch) != 0) {
+            LOGE("Failed to decode prompt chunk [%zu, %zu)", start, end);
+            reset_kv_cache(context, session);
+            return false;
+        }
+        const float ms = (float)(llama_time_us() - t_start) / 1000.0f;
+
+        engine.prefill_timings.emplace_back((int)(end - start), ms);
+        session.tokens.insert(session.tokens.end(), tokens.begin() + start, tokens.begin() + end);
+        LOGD("Prefill chunk of %zu tokens: %.1f ms (%.1f tok/s)",
+             end - start, ms, ms > 0 ? (end - start) * 1000.0f / ms : 0.0f);
+    }
+    return true;
+}
+
+/**
+ * Make room in the shared KV cache for a session to hold n_tokens
+ *
+ * Every session is a sequence in one unified cache of n_ctx cells, so
+ * together they can hold no more than n_ctx tokens. Other sessions are
+ * cleared, least recently used first, until this one fits. Prefixes
+ * shared by forked sessions are counted once per session, so this errs
+ * towards clearing. Marks the session as the most recently used.
+ */
+static void reclaim_cells(Engine &engine, Session &session, size_t n_tokens) {
+    session.last_used = ++engine.use_clock;
+
+    size_t used = n_tokens;
+    std::vector<Session *> others;
+    for (auto &entry : engine.sessions) {
+        Session &other = entry.second;
+        if (&other != &session && !other.tokens.empty()) {
+            used += other.tokens.size();
+            others.push_back(&other);
+        }
+    }
+
+    const size_t n_ctx = llama_n_ctx(engine.context);
+    if (used <= n_ctx) {
+        return;
+    }
+    std::sort(others.begin(), others.end(), [](const Session *a, const Session *b) {
+        return a->last_used < b->last_used;
+    });
+    for (Session *other : others) {
+        if (used <= n_ctx) {
+            break;
+        }
+        LOGI("KV cache full: clearing %zu tokens of session %d", other->tokens.size(), (int)other->seq_id);
+        used -= other->tokens.size();
+        reset_kv_cache(engine.context, *other);
+    }
+}
+
+// --------------------------------------------------------------------------
+// Context shift
+// --------------------------------------------------------------------------
+
+/**
+ * How many tokens after tokens[n_keep] to evict to free at least n_min
+ *
+ * Rounds up to just past the next line break within EVICT_BOUNDARY_SCAN
+ * tokens, so whole lines (a Thought, an Observation) go rather than half
+ * of one.
+ */
+static size_t eviction_length(
+    llama_context *context,
+    const std::vector<llama_token> &tokens,
+    size_t n_keep,
+    size_t n_min
+) {
+    const size_t start = n_keep + n_min;
+    const size_t end = std::min(tokens.size(), start + EVICT_BOUNDARY_SCAN);
+    for (size_t i = start; i < end; i++) {
+        if (common_token_to_piece(context, tokens[i], false).find('\n') != std::string::npos) {
+            return i + 1 - n_keep;
+        }
+    }
+    return n_min;
+}
+
+/**
+ * Evict cached tokens right after the pinned prefix, shifting the rest back
+ *
+ * The KV entries are moved in place (RoPE is re-applied to the shifted
+ * keys), so nothing is decoded again.
+ *
+ * @return Tokens evicted; 0 if the cache cannot shift
+ */
+static size_t evict_after_prefix(llama_context *context, Session &session, size_t n_discard) {
+    const size_t n_keep = std::min(session.n_keep, session.tokens.size());
+    n_discard = std::min(n_discard, session.tokens.size() - n_keep);
+    if (n_discard == 0) {
+        return 0;
+    }
+    if (!llama_kv_cache_can_shift(context)) {
+        LOGE("KV cache cannot be shifted");
+        return 0;
+    }
+
+    const llama_pos p0 = (llama_pos)n_keep;
+    const llama_pos p1 = (llama_pos)(n_keep + n_discard);
+    llama_kv_cache_seq_rm(context, session.seq_id, p0, p1);
+    llama_kv_cache_seq_add(context, session.seq_id, p1, -1, -(llama_pos)n_discard);
+
+    session.evicted.insert(session.evicted.end(), session.tokens.begin() + p0, session.tokens.begin() + p1);
+    session.tokens.erase(session.tokens.begin() + p0, session.tokens.begin() + p1);
+    LOGI("Context shift: evicted %zu tokens after a %zu-token prefix", n_discard, n_keep);
+    return n_discard;
+}
+
+/**
+ * Fit a prompt into n_ctx - reserve tokens, reusing the KV cache
+ *
+ * First drops the tokens already evicted from this session. If the prompt
+ * still does not fit, evicts more right after the pinned prefix: the part
+ * that is cached is shifted in place, the rest is simply never decoded.
+ *
+ * @return false if even the pinned prefix does not fit
+ */
+static bool fit_prompt(
+    llama_context *context,
+    Session &session,
+    std::vector<llama_token> &tokens,
+    size_t reserve
+) {
+    const size_t n_keep = std::min(session.n_keep, tokens.size());
+    const std::vector<llama_token> &evicted = session.evicted;
+
+    if (!evicted.empty()) {
+        if (tokens.size() >= n_keep + evicted.size() &&
+            std::equal(evicted.begin(), evicted.end(), tokens.begin() + n_keep)) {
+            tokens.erase(tokens.begin() + n_keep, tokens.begin() + n_keep + evicted.size());
+        } else {
+            // The history was rewritten; the cache will no longer match
+            session.evicted.clear();
+        }
+    }
+
+    const size_t limit = llama_n_ctx(context) - reserve;
+    if (tokens.size() <= limit) {
+        return true;
+    }
+    if (n_keep + 1 >= limit) {
+        LOGE("Pinned prefix of %zu tokens leaves no room in the context", n_keep);
+        return false;
+    }
+
+    const size_t n_discard = std::min(
+        eviction_length(context, tokens, n_keep, tokens.size() - limit),
+        tokens.size() - n_keep - 1);
+
+    // Shift whatever part of the evicted span is cached, drop the rest
+    const size_t n_past = common_prefix_length(session.tokens, tokens);
+    llama_kv_cache_seq_rm(context, session.seq_id, (llama_pos)n_past, -1);
+    session.tokens.resize(n_past);
+
+    const size_t n_cached = n_past > n_keep ? std::min(n_past - n_keep, n_discard) : 0;
+    if (n_cached > 0 && evict_after_prefix(context, session, n_cached) != n_cached) {
+        reset_kv_cache(context, session);
+    }
+    if (n_cached < n_discard) {
+        session.evicted.insert(session.evicted.end(),
+                               tokens.begin() + n_keep + n_cached, tokens.begin() + n_keep + n_discard);
+    }
+    tokens.erase(tokens.begin() + n_keep, tokens.begin() + n_keep + n_discard);
+    return true;
+}
+
+/**
+ * Free every sampler cached by a session
+ */
+static void free_samplers(Session &session) {
+    for (auto &entry : session.samplers) {
+        if (entry.second.sampler) {
+            common_sampler_free(entry.second.sampler);
+        }
+        if (entry.second.probe) {
+            llama_sampler_free(entry.second.probe);
+        }
+    }
+    session.samplers.clear();
+}
+
+static size_t sampler_key(const std::string &grammar, const SamplingConfig &config) {
+    size_t key = std::hash<std::string>{}(grammar);
+    auto mix = [&key](size_t value) {
+        key ^= value + 0x9e3779b97f4a7c15ULL + (key << 6) + (key >> 2);
+    };
+    mix(std::hash<float>{}(config.temperature));
+    mix(std::hash<int>{}(config.top_k));
+    mix(std::hash<float>{}(config.top_p));
+    mix(std::hash<float>{}(config.min_p));
+    mix(std::hash<float>{}(config.repeat_penalty));
+    mix(std::hash<uint32_t>{}(config.seed));
+    return key;
+}
+
+/**
+ * Sampler (and grammar probe) for a GBNF grammar and sampling config
+ *
+ * Chains are built once per session and cached by grammar and config, so
+ * changing parameters between calls touches neither the context nor the
+ * KV cache; callers reset the returned sampler's state rather than
+ * rebuilding it. An empty or unparseable grammar yields an unconstrained
+ * sampler and no probe. Unconstrained plain greedy needs no chain at all
+ * and yields a null sampler: the caller takes the argmax itself.
+ */
+static CachedSampler sampler_for(Engine &engine, Session &session, const std::string &grammar,
+                                 const SamplingConfig &config) {
+    const CachedSampler greedy{ "", config, nullptr, nullptr };
+    if (grammar.empty() && config.plain_greedy()) {
+        return greedy;
+    }
+
+    const size_t key = sampler_key(grammar, config);
+    auto it = session.samplers.find(key);
+    if (it != session.samplers.end() && it->second.grammar == grammar && it->second.config == config) {
+        if (it->second.sampler) {
+            return it->second;
+        }
+        return grammar.empty() ? greedy : sampler_for(engine, session, "", config);
+    }
+
+    if (session.samplers.size() >= MAX_CACHED_SAMPLERS) {
+        free_samplers(session);
+        it = session.samplers.end();
+    }
+
+    common_params_sampling sparams = engine.sampling_params;
+    sparams.temp = config.temperature;
+    sparams.top_k = config.top_k;
+    sparams.top_p = config.top_p;
+    sparams.min_p = config.min_p;
+    sparams.penalty_repeat = config.repeat_penalty;
+    sparams.seed = config.seed;
+    sparams.grammar = grammar;
+    common_sampler *sampler = common_sampler_init(engine.model->model, sparams);
+    llama_sampler *probe = nullptr;
+    if (!sampler && grammar.empty()) {
+        LOGE("Failed to build sampler, sampling greedily");
+    } else if (!sampler) {
+        LOGE("Failed to compile grammar, sampling unconstrained");
+    } else if (!grammar.empty()) {
+        probe = llama_sampler_init_grammar(engine.vocab(), grammar.c_str(), "root");
+        LOGI("Compiled grammar (%zu bytes)", grammar.size());
+    }
+
+    if (it != session.samplers.end()) {
+        // Hash collision with a different grammar or config: replace the old entry
+        if (it->second.sampler) {
+            common_sampler_free(it->second.sampler);
+        }
+        if (it->second.probe) {
+            llama_sampler_free(it->second.probe);
+        }
+        session.samplers.erase(it);
+    }
+    CachedSampler entry{ grammar, config, sampler, probe };
+    session.samplers.emplace(key, entry);
+    if (sampler) {
+        return entry;
+    }
+    return grammar.empty() ? greedy : sampler_for(engine, session, "", config);
+}
+
+/**
+ * Most likely token at batch index i, straight from the logits
+ *
+ * The greedy fast path: no candidate array over the vocabulary is built.
+ */
+static llama_token argmax_token(Engine &engine, llama_context *context, int32_t i) {
+    const float *logits = llama_get_logits_ith(context, i);
+    const int32_t n_vocab = llama_vocab_n_tokens(engine.vocab());
+    return (llama_token)(std::max_element(logits, logits + n_vocab) - logits);
+}
+
+// --------------------------------------------------------------------------
+// KV cache sizing
+// --------------------------------------------------------------------------
+
+/**
+ * KV cache element type for the ids used by LlamaEngine.KvCacheType
+ */
+ggml_type kv_type_from_id(int id) {
+    switch (id) {
+        case 1: return GGML_TYPE_Q8_0;
+        case 2: return GGML_TYPE_Q4_0;
+        default: return GGML_TYPE_F16;
+    }
+}
+
+/**
+ * V cache type for a requested KV type
+ *
+ * llama.cpp only supports a quantized V cache through flash attention, so
+ * without it only K is quantized.
+ */
+ggml_type v_type_for(ggml_type type_k, bool flash_attn) {
+    return flash_attn ? type_k : GGML_TYPE_F16;
+}
+
+/**
+ * Bytes of KV cache one token occupies across all layers
+ */
+double kv_bytes_per_token(const llama_model *model, ggml_type type_k, ggml_type type_v) {
+    const int n_head = llama_model_n_head(model);
+    const int n_embd_gqa = n_head > 0
+        ? llama_model_n_embd(model) / n_head * llama_model_n_head_kv(model)
+        : llama_model_n_embd(model);
+    const double k = (double)ggml_type_size(type_k) / ggml_blck_size(type_k);
+    const double v = (double)ggml_type_size(type_v) / ggml_blck_size(type_v);
+    return (double)llama_model_n_layer(model) * n_embd_gqa * (k + v);
+}
+
+// --------------------------------------------------------------------------
+// Threads
+// --------------------------------------------------------------------------
+
+/**
+ * Default decode thread count: the performance cores, capped
+ */
+static int auto_decode_threads() {
+    const int n = (int)g_cpu.performance.size();
+    return n > 0 ? std::min(n, MAX_DECODE_THREADS) : DEFAULT_N_THREADS;
+}
+
+/**
+ * Default prefill thread count: every performance core
+ *
+ * Little cores are left out; ggml splits work evenly, so they would hold
+ * every graph barrier back.
+ */
+static int auto_prefill_threads() {
+    const int n = (int)g_cpu.performance.size();
+    return n > 0 ? n : DEFAULT_N_THREADS;
+}
+
+/**
+ * Threadpool whose workers may only run on the performance cores
+ */
+static ggml_threadpool *new_pinned_threadpool(int n_threads) {
+    ggml_threadpool_params params = ggml_threadpool_params_default(n_threads);
+    for (int id : g_cpu.performance) {
+        if (id < GGML_MAX_N_THREADS) {
+            params.cpumask[id] = true;
+        }
+    }
+    params.strict_cpu = false;  // Share the mask; let the scheduler balance
+    return ggml_threadpool_new(&params);
+}
+
+static void free_threadpools(Engine &engine) {
+    if (engine.threadpool) {
+        ggml_threadpool_free(engine.threadpool);
+        engine.threadpool = nullptr;
+    }
+    if (engine.threadpool_batch) {
+        ggml_threadpool_free(engine.threadpool_batch);
+        engine.threadpool_batch = nullptr;
+    }
+}
+
+// --------------------------------------------------------------------------
+// Sessions
+// --------------------------------------------------------------------------
+
+Session *find_session(Engine &engine, int session_id) {
+    auto it = engine.sessions.find(session_id);
+    return it != engine.sessions.end() ? &it->second : nullptr;
+}
+
+/**
+ * Create an empty session on the lowest free sequence id
+ *
+ * @return The new session, or nullptr if all MAX_SESSIONS are in use
+ */
+Session *create_session(Engine &engine) {
+    for (int id = 0; id < MAX_SESSIONS; id++) {
+        if (engine.sessions.count(id)) {
+            continue;
+        }
+
+        Session &session = engine.sessions[id];
+        session.seq_id = (llama_seq_id)id;
+        return &session;
+    }
+    LOGE("All %d sessions are in use", MAX_SESSIONS);
+    return nullptr;
+}
+
+/**
+ * Return a session to its freshly created state, keeping its sequence id
+ *
+ * Drops its KV sequence, samplers (with their grammar state), pinned
+ * prefix, eviction record and transcript.
+ */
+void clear_session(Engine &engine, int session_id) {
+    Session *session = find_session(engine, session_id);
+    if (!session) {
+        return;
+    }
+
+    if (engine.context) {
+        llama_kv_cache_seq_rm(engine.context, session->seq_id, -1, -1);
+    }
+    free_samplers(*session);
+    const llama_seq_id seq_id = session->seq_id;
+    *session = Session();
+    session->seq_id = seq_id;
+    transcript_clear(engine, session_id);
+}
+
+/**
+ * Free a session's samplers and KV sequence
+ */
+void destroy_session(Engine &engine, int session_id) {
+    if (!find_session(engine, session_id)) {
+        return;
+    }
+    clear_session(engine, session_id);
+    engine.sessions.erase(session_id);
+}
+
+// --------------------------------------------------------------------------
+// Transcripts
+// --------------------------------------------------------------------------
+
+/**
+ * Tokenize a segment and append it to a session's transcript
+ *
+ * Only the new segment is tokenized. Segments should end where the
+ * tokenizer splits anyway (a newline or special token), or the transcript
+ * may differ from tokenizing the whole text at once.
+ *
+ * @return Tokens appended, or -1 for a session id out of range
+ */
+int transcript_append(Engine &engine, int session_id, const std::string &text, bool add_special) {
+    if (session_id < 0 || session_id >= MAX_SESSIONS) {
+        return -1;
+    }
+    const std::vector<llama_token> tokens = common_tokenize(engine.vocab(), text, add_special, true);
+
+    std::lock_guard<std::mutex> lock(engine.transcript_mutex);
+    std::vector<llama_token> &transcript = engine.transcripts[session_id];
+    transcript.insert(transcript.end(), tokens.begin(), tokens.end());
+    return (int)tokens.size();
+}
+
+/**
+ * Drop transcript[from, from + count) from the session's KV cache too,
+ * shifting what follows back in place
+ *
+ * Only done while the cache holds exactly the transcript up to the erased
+ * span; otherwise the next prompt simply matches the cache up to from.
+ */
+static void erase_cached_span(
+    llama_context *context,
+    Session &session,
+    const std::vector<llama_token> &transcript,
+    size_t from,
+    size_t count
+) {
+    std::vector<llama_token> &cached = session.tokens;
+    if (count == 0 || from < session.n_keep || !session.evicted.empty() || cached.size() < from + count ||
+        !std::equal(transcript.begin(), transcript.begin() + from + count, cached.begin())) {
+        return;
+    }
+    if (!llama_kv_cache_can_shift(context)) {
+        return;
+    }
+
+    const llama_pos p0 = (llama_pos)from;
+    const llama_pos p1 = (llama_pos)(from + count);
+    llama_kv_cache_seq_rm(context, session.seq_id, p0, p1);
+    llama_kv_cache_seq_add(context, session.seq_id, p1, -1, -(llama_pos)count);
+    cached.erase(cached.begin() + p0, cached.begin() + p1);
+    LOGI("Transcript erase: shifted out %zu cached tokens at %zu", count, from);
+}
+
+/**
+ * Remove count tokens starting at from, e.g. the oldest step when the
+ * transcript outgrows the context
+ *
+ * The session's cached copy of those tokens is shifted out the same way,
+ * so the tokens after them need no prefill. Takes engine.mutex for that,
+ * so it waits for a running generation.
+ *
+ * @return Tokens left in the transcript
+ */
+int transcript_erase(Engine &engine, int session_id, size_t from, size_t count) {
+    std::lock_guard<std::mutex> engine_lock(engine.mutex);
+    std::lock_guard<std::mutex> lock(engine.transcript_mutex);
+    auto it = engine.transcripts.find(session_id);
+    if (it == engine.transcripts.end()) {
+        return 0;
+    }
+    std::vector<llama_token> &transcript = it->second;
+    from = std::min(from, transcript.size());
+    count = std::min(count, transcript.size() - from);
+    if (Session *session = find_session(engine, session_id)) {
+        erase_cached_span(engine.context, *session, transcript, from, count);
+    }
+    transcript.erase(transcript.begin() + from, transcript.begin() + from + count);
+    return (int)transcript.size();
+}
+
+void transcript_clear(Engine &engine, int session_id) {
+    std::lock_guard<std::mutex> lock(engine.transcript_mutex);
+    engine.transcripts.erase(session_id);
+}
+
+/**
+ * Copy of a session's transcript, taken when a generation is queued
+ */
+std::vector<llama_token> transcript_tokens(Engine &engine, int session_id) {
+    std::lock_guard<std::mutex> lock(engine.transcript_mutex);
+    auto it = engine.transcripts.find(session_id);
+    return it != engine.transcripts.end() ? it->second : std::vector<llama_token>();
+}
+
+// --------------------------------------------------------------------------
+// Grammar fast-forward
+// --------------------------------------------------------------------------
+
+/**
+ * Tokens whose text is a single printable ASCII character
+ */
+static const std::vector<llama_token> &canary_tokens(Engine &engine) {
+    if (engine.canary_tokens.empty()) {
+        for (char c = 0x20; c < 0x7F; c++) {
+            std::vector<llama_token> t = common_tokenize(engine.context, std::string(1, c), false, false);
+            if (t.size() == 1) {
+                engine.canary_tokens.push_back(t[0]);
+            }
+        }
+    }
+    return engine.canary_tokens;
+}
+
+/**
+ * Text the grammar forces next, or "" if the model has a real choice
+ *
+ * The forced text is the common prefix of every token the grammar allows
+ * (see forced_prefix). A quick check over single-character tokens rules
+ * out open regions (free text, optional whitespace) before paying for a
+ * probe of the whole vocabulary.
+ */
+static std::string forced_text(Engine &engine, llama_sampler *probe) {
+    const llama_vocab *vocab = engine.vocab();
+    std::vector<llama_token_data> &candidates = engine.probe_candidates;
+
+    // Two different single characters allowed means no text is forced
+    const std::vector<llama_token> &canaries = canary_tokens(engine);
+    std::vector<llama_token_data> canary_data;
+    canary_data.reserve(canaries.size());
+    for (llama_token t : canaries) {
+        canary_data.push_back({ t, 0.0f, 0.0f });
+    }
+    llama_token_data_array canary_arr = { canary_data.data(), canary_data.size(), -1, false };
+    llama_sampler_apply(probe, &canary_arr);
+    int n_canaries_allowed = 0;
+    for (size_t i = 0; i < canary_arr.size; i++) {
+        if (canary_arr.data[i].logit != -INFINITY && ++n_canaries_allowed > 1) {
+            return "";
+        }
+    }
+
+    // Full probe: collect every allowed token
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+    candidates.resize(n_vocab);
+    for (llama_token t = 0; t < n_vocab; t++) {
+        candidates[t] = { t, 0.0f, 0.0f };
+    }
+    llama_token_data_array arr = { candidates.data(), (size_t)n_vocab, -1, false };
+    llama_sampler_apply(probe, &arr);
+
+    std::vector<llama_token> allowed;
+    for (size_t i = 0; i < arr.size; i++) {
+        if (arr.data[i].logit == -INFINITY) {
+            continue;
+        }
+        if (llama_vocab_is_eog(vocab, arr.data[i].id)) {
+            return "";  // Stopping is allowed, so nothing is forced
+        }
+        allowed.push_back(arr.data[i].id);
+    }
+    return forced_prefix(vocab, allowed);
+}
+
+/**
+ * Tokens for the longest grammar-forced continuation
+ *
+ * Each round forces the text every allowed token starts with; the
+ * grammar accepts it before the next round probes for more. The forced
+ * text is tokenized canonically; every sampler and the probe accept the
+ * tokens as if they had been sampled.
+ */
+static std::vector<llama_token> forced_tokens(
+    Engine &engine,
+    common_sampler *sampler,
+    llama_sampler *probe,
+    size_t max_tokens
+) {
+    std::vector<llama_token> run;
+    for (int round = 0; round < MAX_FORCED_RUNS && run.size() < max_tokens; round++) {
+        const std::string text = forced_text(engine, probe);
+        if (text.empty()) {
+            break;
+        }
+
+        std::vector<llama_token> tokens = common_tokenize(engine.context, text, false, false);
+        for (llama_token t : tokens) {
+            if (run.size() >= max_tokens) {
+                break;
+            }
+            common_sampler_accept(sampler, t, true);
+            llama_sampler_accept(probe, t);
+            run.push_back(t);
+        }
+    }
+    return run;
+}
+
+/**
+ * Whether the grammar has reached an accepting state with nothing left to add
+ *
+ * True when every token the grammar still allows is end-of-generation, e.g.
+ * right after the closing brace of a ReAct JSON object. Checked without a
+ * decode, so generation can stop before the model is asked to pick EOG.
+ */
+static bool grammar_complete(Engine &engine, llama_sampler *probe) {
+    const llama_vocab *vocab = engine.vocab();
+    std::vector<llama_token_data> &candidates = engine.probe_candidates;
+
+    // Any single character allowed means the grammar is still open
+    const std::vector<llama_token> &canaries = canary_tokens(engine);
+    std::vector<llama_token_data> canary_data;
+    canary_data.reserve(canaries.size());
+    for (llama_token t : canaries) {
+        canary_data.push_back({ t, 0.0f, 0.0f });
+    }
+    llama_token_data_array canary_arr = { canary_data.data(), canary_data.size(), -1, false };
+    llama_sampler_apply(probe, &canary_arr);
+    for (size_t i = 0; i < canary_arr.size; i++) {
+        if (canary_arr.data[i].logit != -INFINITY) {
+            return false;
+        }
+    }
+
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+    candidates.resize(n_vocab);
+    for (llama_token t = 0; t < n_vocab; t++) {
+        candidates[t] = { t, 0.0f, 0.0f };
+    }
+    llama_token_data_array arr = { candidates.data(), (size_t)n_vocab, -1, false };
+    llama_sampler_apply(probe, &arr);
+    for (size_t i = 0; i < arr.size; i++) {
+        if (arr.data[i].logit != -INFINITY && !llama_vocab_is_eog(vocab, arr.data[i].id)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Draft tokens by prompt lookup
+ *
+ * Finds the most recent earlier occurrence of the context's trailing
+ * n-gram (longest n first) and proposes the tokens that followed it. Tool
+ * observations echoed back in answers make this hit often, with no extra
+ * model memory.
+ *
+ * @param history Tokens in context, ending with the token just sampled
+ * @param p The job's lookup settings
+ */
+static llama_tokens prompt_lookup_draft(const std::vector<llama_token> &history, const PromptLookupParams &p) {
+    const int n_history = (int)history.size();
+
+    for (int n = p.ngram_max; n >= p.ngram_min; n--) {
+        if (n_history <= n) {
+            continue;
+        }
+        const llama_token *pattern = history.data() + n_history - n;
+
+        // Most recent match first; the match must leave tokens to copy
+        for (int i = n_history - n - 1; i >= 0; i--) {
+            if (!std::equal(pattern, pattern + n, history.data() + i)) {
+                continue;
+            }
+            const int start = i + n;
+            const int end = std::min(start + p.n_draft, n_history);
+            return llama_tokens(history.begin() + start, history.begin() + end);
+        }
+    }
+    return {};
+}
+
+/**
+ * Free the draft model and its context, disabling speculative decoding
+ */
+void free_draft_model(Engine &engine) {
+    if (engine.speculative) {
+        common_speculative_free(engine.speculative);
+        engine.speculative = nullptr;
+    }
+    if (engine.draft_context) {
+        llama_free(engine.draft_context);
+        engine.draft_context = nullptr;
+    }
+    if (engine.draft_model) {
+        llama_free_model(engine.draft_model);
+        engine.draft_model = nullptr;
+        LOGI("Draft model freed");
+    }
+}
+
+Engine::~Engine() {
+    free_draft_model(*this);
+    while (!sessions.empty()) {
+        destroy_session(*this, sessions.begin()->first);
+    }
+    if (context) {
+        llama_free(context);
+        LOGI("Context freed");
+    }
+    free_threadpools(*this);
+    if (batch.token) {
+        llama_batch_free(batch);
+    }
+}
+
+// Adds the lifetime of the scope to a microsecond counter
+struct ScopedTimer {
+    explicit ScopedTimer(int64_t &total) : total(total), start(llama_time_us()) {}
+    ~ScopedTimer() {
+        total += llama_time_us() - start;
+    }
+
+    int64_t &total;
+    const int64_t start;
+};
+
+/**
+ * Run one generate job on the decode thread
+ *
+ * Text is written into job.stream as it is produced, where the caller
+ * drains it with nativeDrainStream, and accumulated in job.result. The
+ * cancel flag is checked between prefill chunks and before every decode
+ * step, and a full stream pauses decoding until the caller catches up.
+ *
+ * Generation stops at an end-of-generation token, at max_tokens, once the
+ * grammar can only accept EOG, or when a stop string appears in the text
+ * (the stop string itself is not emitted). Where the time went is recorded
+ * in job.metrics.
+ *
+ * A job with max_tokens 0 only prefills its prompt into the session, so a
+ * later prompt extending it decodes just the extension.
+ */
+void run_generation(GenerateJob &job) {
+    Engine &engine = *job.engine;
+    std::lock_guard<std::mutex> lock(engine.mutex);
+
+    GenerationMetrics &metrics = job.metrics;
+    metrics.stop_reason = GenerationMetrics::STOP_ERROR;
+    ScopedTimer total_timer(metrics.total_us);
+
+    // The decode thread also runs ggml's first compute slice
+    static thread_local bool pinned = false;
+    if (!pinned && !g_cpu.performance.empty()) {
+        pinned = true;
+        if (!pin_current_thread(g_cpu.performance)) {
+            LOGI("Could not pin decode thread to performance cores");
+        }
+    }
+
+    Session *session = find_session(engine, job.session_id);
+    if (!session) {
+        LOGE("Unknown session %d", job.session_id);
+        return;
+    }
+    std::vector<llama_token> &cached = session->tokens;
+    const llama_seq_id seq_id = session->seq_id;
+
+    llama_context *context = engine.context;
+    llama_batch &batch = engine.batch;
+    SpeculativeStats &spec_stats = engine.spec_stats;
+    const int max_tokens = job.max_tokens;
+
+    // Settings other threads may change meanwhile, fixed for this job
+    const PromptLookupParams lookup = get_lookup_params();
+    const bool fast_forward = g_fast_forward.load(std::memory_order_relaxed);
+
+    // Tokenize prompt (parse_special so ChatML markers map to their special tokens)
+    std::vector<llama_token> tokens;
+    if (job.prompt_tokens.empty()) {
+        ScopedTimer timer(metrics.tokenize_us);
+        tokens = common_tokenize(context, job.prompt, true, true);
+    } else {
+        tokens = std::move(job.prompt_tokens);
+    }
+    if (tokens.empty()) {
+        LOGE("Prompt tokenized to zero tokens");
+        return;
+    }
+
+    // Leave room to generate; the loop shifts again if it runs out anyway
+    const size_t n_ctx = llama_n_ctx(context);
+    const size_t reserve = std::min((size_t)std::max(max_tokens, 0), n_ctx / 4);
+    if (!fit_prompt(context, *session, tokens, reserve)) {
+        return;
+    }
+    reclaim_cells(engine, *session, tokens.size() + reserve);
+
+    // Reuse the KV cache for the prefix this prompt shares with the last one.
+    // At least one token is always decoded so the sampler has fresh logits.
+    size_t n_past = common_prefix_length(cached, tokens);
+    if (n_past == tokens.size()) {
+        if (max_tokens <= 0) {
+            metrics.prompt_tokens = metrics.reused_tokens = (int)n_past;
+            metrics.stop_reason = GenerationMetrics::STOP_MAX_TOKENS;
+            return;
+        }
+        n_past--;
+    }
+    llama_kv_cache_seq_rm(context, seq_id, (llama_pos)n_past, -1);
+    cached.resize(n_past);
+
+    LOGI("Tokenized prompt: %zu tokens (%zu reused from KV cache)", tokens.size(), n_past);
+    metrics.prompt_tokens = (int)tokens.size();
+    metrics.reused_tokens = (int)n_past;
+    metrics.prefill_tokens = (int)(tokens.size() - n_past);
+
+    // Process only the prompt tokens that are not already cached
+    bool prefilled;
+    {
+        ScopedTimer timer(metrics.prefill_us);
+        prefilled = prefill_tokens(engine, *session, tokens, n_past, &job.cancelled);
+    }
+    if (!prefilled) {
+        if (job.cancelled.load()) {
+            LOGI("Generation cancelled during prefill");
+            metrics.stop_reason = GenerationMetrics::STOP_CANCELLED;
+        } else {
+            LOGE("Failed to decode prompt");
+        }
+        return;
+    }
+    if (max_tokens <= 0) {
+        metrics.stop_reason = GenerationMetrics::STOP_MAX_TOKENS;
+        return;
+    }
+
+    // Pick the (cached) sampler for this grammar and config and reset its state
+    CachedSampler active = sampler_for(engine, *session, job.grammar, job.sampling);
+    common_sampler *sampler = active.sampler;
+    if (sampler) {
+        common_sampler_reset(sampler);
+    }
+    if (active.probe) {
+        llama_sampler_reset(active.probe);
+    }
+
+    // Generate response
+    const llama_vocab *vocab = engine.vocab();
+    Utf8Detokenizer detokenizer(vocab);
+    StopStringMatcher stops(job.stop_strings);
+    std::string &generated = job.result;
+    generated.reserve((size_t)max_tokens * 4);
+    int n_generated = 0;
+    llama_pos n_cur = (llama_pos)tokens.size();
+
+    std::vector<llama_token> pending;
+    spec_stats = {};
+    const int64_t t_generate_start = llama_time_us();
+
+    auto write = [&](std::string_view text) {
+        if (!text.empty()) {
+            ScopedTimer timer(metrics.stream_us);
+            generated.append(text);
+            job.stream.write(text.data(), text.size(), job.cancelled);
+        }
+    };
+
+    // Decode a generation batch, recording its time per committed token
+    auto decode = [&](size_t n_committed) {
+        const int64_t t_start = llama_time_us();
+        const bool ok = llama_decode(context, batch) == 0;
+        const int64_t t_us = llama_time_us() - t_start;
+        metrics.decode_us += t_us;
+        metrics.decode_token_us.push_back((float)t_us / (float)std::max<size_t>(n_committed, 1));
+        return ok;
+    };
+
+    // Convert a token to text, holding back any unfinished UTF-8 sequence
+    // and any tail that could still become a stop string
+    auto emit = [&](llama_token t) {
+        std::string_view text = detokenizer.push(t);
+        if (!text.empty()) {
+            write(stops.push(text));
+        }
+    };
+
+    // Evict half of the unpinned history if n more tokens would overflow
+    auto make_room = [&](size_t n) {
+        if ((size_t)n_cur + n <= n_ctx) {
+            reclaim_cells(engine, *session, (size_t)n_cur + n);
+            return true;
+        }
+        const size_t n_keep = std::min(session->n_keep, cached.size());
+        const size_t needed = (size_t)n_cur + n - n_ctx;
+        const size_t n_discard = std::max(needed, (cached.size() - n_keep) / 2);
+        if (evict_after_prefix(context, *session, n_discard) < needed) {
+            LOGE("Context full and cannot be shifted");
+            return false;
+        }
+        n_cur = (llama_pos)cached.size();
+        reclaim_cells(engine, *session, (size_t)n_cur + n);
+        return true;
+    };
+
+    // Sample the next token from the logits of the last batch entry
+    auto sample_next = [&]() {
+        ScopedTimer timer(metrics.sample_us);
+        if (!sampler) {
+            return argmax_token(engine, context, batch.n_tokens - 1);
+        }
+        llama_token t = common_sampler_sample(sampler, context, batch.n_tokens - 1);
+        common_sampler_accept(sampler, t, true);
+        if (active.probe) {
+            llama_sampler_accept(active.probe, t);
+        }
+        return t;
+    };
+
+    // Invariant: token has been sampled and accepted but not yet decoded
+    llama_token token = sample_next();
+    bool done = false;
+    metrics.stop_reason = GenerationMetrics::STOP_MAX_TOKENS;
+
+    while (!done) {
+        if (job.cancelled.load(std::memory_order_acquire)) {
+            LOGI("Generation cancelled after %d tokens", n_generated);
+            metrics.stop_reason = GenerationMetrics::STOP_CANCELLED;
+            break;
+        }
+        n_generated++;
+
+        // Check for EOS (and other end-of-generation tokens such as <|im_end|>)
+        if (llama_vocab_is_eog(vocab, token)) {
+            LOGI("EOS token reached");
+            metrics.stop_reason = GenerationMetrics::STOP_EOG;
+            break;
+        }
+
+        pending.assign(1, token);
+        if (n_generated >= max_tokens) {
+            emit(token);
+            break;
+        }
+
+        // Append any run of tokens the grammar leaves no choice about
+        bool complete = false;
+        if (active.probe) {
+            ScopedTimer timer(metrics.grammar_us);
+            if (fast_forward) {
+                std::vector<llama_token> run = forced_tokens(
+                    engine, sampler, active.probe, (size_t)(max_tokens - n_generated));
+                pending.insert(pending.end(), run.begin(), run.end());
+                n_generated += (int)run.size();
+            }
+            complete = grammar_complete(engine, active.probe);
+        }
+
+        // Nothing but EOG can follow, so there is no need to decode these
+        if (complete) {
+            for (llama_token t : pending) {
+                emit(t);
+            }
+            LOGI("Grammar complete after %d tokens", n_generated);
+            metrics.stop_reason = GenerationMetrics::STOP_GRAMMAR;
+            break;
+        }
+
+        // Speculative step: draft a continuation and verify it in one batch.
+        // Prompt lookup is tried first since it costs no decode at all.
+        if ((lookup.enabled || engine.speculative) && pending.size() == 1) {
+            llama_tokens draft;
+            if (lookup.enabled) {
+                cached.push_back(token);
+                draft = prompt_lookup_draft(cached, lookup);
+                cached.pop_back();
+            }
+            if (draft.empty() && engine.speculative) {
+                draft = common_speculative_gen_draft(engine.speculative, engine.spec_params, cached, token);
+            }
+            // Leave room for the token sampled after the accepted drafts,
+            // which the next iteration counts and may emit
+            const size_t max_draft = (size_t)(max_tokens - n_generated - 1);
+            if (draft.size() > max_draft) {
+                draft.resize(max_draft);
+            }
+
+            if (!draft.empty()) {
+                emit(token);
+                if (stops.stopped()) {
+                    break;
+                }
+                if (!make_room(1 + draft.size())) {
+                    metrics.stop_reason = GenerationMetrics::STOP_ERROR;
+                    break;
+                }
+
+                common_batch_clear(batch);
+                common_batch_add(batch, token, n_cur, { seq_id }, true);
+                for (size_t i = 0; i < draft.size(); i++) {
+                    common_batch_add(batch, draft[i], n_cur + 1 + (llama_pos)i, { seq_id }, true);
+                }
+
+                const int64_t t_draft = llama_time_us();
+                if (llama_decode(context, batch) != 0) {
+                    LOGE("Failed to decode draft batch");
+                    reset_kv_cache(context, *session);
+                    metrics.stop_reason = GenerationMetrics::STOP_ERROR;
+                    break;
+                }
+                const int64_t t_draft_us = llama_time_us() - t_draft;
+
+                // ids = accepted draft prefix + one token sampled after it
+                std::vector<llama_token> ids;
+                {
+                    ScopedTimer timer(metrics.sample_us);
+                    if (sampler) {
+                        ids = common_sampler_sample_and_accept_n(sampler, context, draft);
+                    } else {
+                        // Greedy verification: keep drafts while they match the argmax
+                        for (size_t i = 0; i <= draft.size(); i++) {
+                            ids.push_back(argmax_token(engine, context, (int32_t)i));
+                            if (i == draft.size() || ids.back() != draft[i]) {
+                                break;
+                            }
+                        }
+                    }
+                    if (active.probe) {
+                        for (llama_token t : ids) {
+                            llama_sampler_accept(active.probe, t);
+                        }
+                    }
+                }
+                const size_t n_accepted = ids.size() - 1;
+                metrics.decode_us += t_draft_us;
+                metrics.decode_token_us.push_back((float)t_draft_us / (float)(1 + n_accepted));
+
+                cached.push_back(token);
+                cached.insert(cached.end(), draft.begin(), draft.begin() + n_accepted);
+                n_cur += 1 + (llama_pos)n_accepted;
+                llama_kv_cache_seq_rm(context, seq_id, n_cur, -1);
+
+                spec_stats.n_drafted += (int)draft.size();
+                spec_stats.n_accepted += (int)n_accepted;
+
+                for (size_t i = 0; i < n_accepted; i++) {
+                    n_generated++;
+                    if (llama_vocab_is_eog(vocab, ids[i])) {
+                        LOGI("EOS token reached");
+                        metrics.stop_reason = GenerationMetrics::STOP_EOG;
+                        done = true;
+                        break;
+                    }
+                    emit(ids[i]);
+                    if (stops.stopped()) {
+                        done = true;
+                        break;
+                    }
+                }
+
+                token = ids.back();
+                continue;
+            }
+        }
+
+        for (llama_token t : pending) {
+            emit(t);
+        }
+        if (stops.stopped()) {
+            break;
+        }
+        if (!make_room(pending.size())) {
+            metrics.stop_reason = GenerationMetrics::STOP_ERROR;
+            break;
+        }
+
+        // Prepare next batch: the sampled token plus any forced run
+        common_batch_clear(batch);
+        for (size_t i = 0; i < pending.size(); i++) {
+            common_batch_add(batch, pending[i], n_cur + (llama_pos)i, { seq_id }, i + 1 == pending.size());
+        }
+
+        // Decode
+        if (!decode(pending.size())) {
+            LOGE("Failed to decode generation");
+            reset_kv_cache(context, *session);
+            metrics.stop_reason = GenerationMetrics::STOP_ERROR;
+            break;
+        }
+        cached.insert(cached.end(), pending.begin(), pending.end());
+        n_cur += (llama_pos)pending.size();
+
+        if (n_generated >= max_tokens) {
+            break;
+        }
+        token = sample_next();
+    }
+
+    spec_stats.n_generated = n_generated;
+    spec_stats.t_generate_us = llama_time_us() - t_generate_start;
+
+    std::string_view tail = detokenizer.flush();
+    if (!tail.empty()) {
+        write(stops.push(tail));
+    }
+    write(stops.flush());
+    if (stops.stopped()) {
+        LOGI("Stop string reached");
+        metrics.stop_reason = GenerationMetrics::STOP_STRING;
+    }
+
+    metrics.generated_tokens = n_generated;
+    LOGI("Generated %d tokens", n_generated);
+}
+
+// --------------------------------------------------------------------------
+// Batch generation
+// --------------------------------------------------------------------------
+
+// One prompt of a batch generation: its own sequence, sampler and stop
+// matching in a shared scratch context
+struct BatchSequence {
+    BatchSequence(const llama_vocab *vocab, const std::vector<std::string> &stop_strings)
+        : detokenizer(vocab), stops(stop_strings) {}
+
+    std::vector<llama_token> prompt;
+    common_sampler *sampler = nullptr;
+    Utf8Detokenizer detokenizer;
+    StopStringMatcher stops;
+    std::string text;
+    llama_token token = 0;      // Sampled, not yet decoded
+    llama_pos n_past = 0;
+    int32_t i_batch = -1;       // Batch index of this sequence's logits, or -1
+    int n_generated = 0;
+    bool done = false;
+};
+
+/**
+ * Scratch context for decoding several sequences of n_ctx_seq side by side
+ *
+ * Shares the engine's model, KV types and threadpools, so it costs only
+ * its own KV cache.
+ */
+static llama_context *new_batch_context(Engine &engine, int n_seq, uint32_t n_ctx_seq) {
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = n_ctx_seq * (uint32_t)n_seq;
+    ctx_params.n_batch = std::max(llama_n_batch(engine.context), (uint32_t)n_seq);
+    ctx_params.n_ubatch = std::min(llama_n_ubatch(engine.context), ctx_params.n_batch);
+    ctx_params.n_seq_max = (uint32_t)n_seq;
+    ctx_params.n_threads = llama_n_threads(engine.context);
+    ctx_params.n_threads_batch = llama_n_threads_batch(engine.context);
+    ctx_params.type_k = engine.type_k;
+    ctx_params.type_v = engine.type_v;
+    ctx_params.flash_attn = engine.flash_attn;
+
+    llama_context *context = llama_init_from_model(engine.model->model, ctx_params);
+    if (context && engine.threadpool) {
+        llama_attach_threadpool(context, engine.threadpool,
+                                engine.threadpool_batch ? engine.threadpool_batch : engine.threadpool);
+    }
+    return context;
+}
+
+/**
+ * Generate independent completions for several prompts at once
+ *
+ * Each prompt gets its own sequence and sampler in a scratch context.
+ * Prompts are packed into shared prefill batches, then every decode step
+ * puts one token of each unfinished sequence into a single llama_batch,
+ * so the weights are read once per step for all of them. Sequences end
+ * independently at EOG, max_tokens or a stop string.
+ *
+ * @param results Filled with one text per prompt
+ * @param n_generated Filled with the tokens generated per prompt
+ * @return false if the batch could not be decoded
+ */
+bool generate_batch(
+    Engine &engine,
+    const std::vector<std::string> &prompts,
+    int max_tokens,
+    float temperature,
+    const std::string &grammar,
+    const std::vector<std::string> &stop_strings,
+    std::vector<std::string> &results,
+    std::vector<int> &n_generated
+) {
+    const int n_seq = (int)prompts.size();
+    const llama_vocab *vocab = engine.vocab();
+    results.assign(prompts.size(), "");
+    n_generated.assign(prompts.size(), 0);
+
+    std::vector<BatchSequence> seqs;
+    seqs.reserve(prompts.size());
+    size_t max_prompt = 0;
+    for (const std::string &prompt : prompts) {
+        seqs.emplace_back(vocab, stop_strings);
+        seqs.back().prompt = common_tokenize(engine.context, prompt, true, true);
+        if (seqs.back().prompt.empty()) {
+            LOGE("Batch prompt tokenized to zero tokens");
+            return false;
+        }
+        max_prompt = std::max(max_prompt, seqs.back().prompt.size());
+    }
+
+    llama_context *context = new_batch_context(engine, n_seq, (uint32_t)(max_prompt + max_tokens));
+    if (!context) {
+        LOGE("Failed to create batch context for %d sequences", n_seq);
+        return false;
+    }
+
+    common_params_sampling sparams = engine.sampling_params;
+    sparams.temp = temperature;
+    sparams.grammar = grammar;
+    bool ok = true;
+    for (BatchSequence &seq : seqs) {
+        seq.sampler = common_sampler_init(engine.model->model, sparams);
+        ok = ok && seq.sampler;
+    }
+
+    const int32_t n_batch = (int32_t)llama_n_batch(context);
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+    const int64_t t_start = llama_time_us();
+
+    // Sample from the logits at i_batch of every sequence that has them
+    auto sample_ready = [&]() {
+        for (BatchSequence &seq : seqs) {
+            if (seq.i_batch < 0) {
+                continue;
+            }
+            seq.token = common_sampler_sample(seq.sampler, context, seq.i_batch);
+            common_sampler_accept(seq.sampler, seq.token, true);
+            seq.i_batch = -1;
+        }
+    };
+
+    // Prefill: pack the prompts back to back, logits for each prompt's last token
+    for (int s = 0, pos = 0; ok && s < n_seq;) {
+        common_batch_clear(batch);
+        while (s < n_seq && batch.n_tokens < n_batch) {
+            BatchSequence &seq = seqs[s];
+            const bool last = (size_t)pos + 1 == seq.prompt.size();
+            common_batch_add(batch, seq.prompt[pos], (llama_pos)pos, { (llama_seq_id)s }, last);
+            if (last) {
+                seq.i_batch = batch.n_tokens - 1;
+                seq.n_past = (llama_pos)seq.prompt.size();
+                s++;
+                pos = 0;
+            } else {
+                pos++;
+            }
+        }
+        if (llama_decode(context, batch) != 0) {
+            LOGE("Failed to decode batch prompts");
+            ok = false;
+            break;
+        }
+        sample_ready();
+    }
+
+    // Decode one token of every live sequence per step
+    while (ok) {
+        common_batch_clear(batch);
+        for (int s = 0; s < n_seq; s++) {
+            BatchSequence &seq = seqs[s];
+            if (seq.done) {
+                continue;
+            }
+            if (llama_vocab_is_eog(vocab, seq.token)) {
+                seq.done = true;
+                continue;
+            }
+            seq.n_generated++;
+            std::string_view text = seq.detokenizer.push(seq.token);
+            if (!text.empty()) {
+                seq.text.append(seq.stops.push(text));
+            }
+            if (seq.stops.stopped() || seq.n_generated >= max_tokens) {
+                seq.done = true;
+                continue;
+            }
+            common_batch_add(batch, seq.token, seq.n_past++, { (llama_seq_id)s }, true);
+            seq.i_batch = batch.n_tokens - 1;
+        }
+        if (batch.n_tokens == 0) {
+            break;
+        }
+        if (llama_decode(context, batch) != 0) {
+            LOGE("Failed to decode batch step");
+            ok = false;
+            break;
+        }
+        sample_ready();
+    }
+
+    int n_total = 0;
+    for (size_t i = 0; i < seqs.size(); i++) {
+        BatchSequence &seq = seqs[i];
+        std::string_view tail = seq.detokenizer.flush();
+        if (!tail.empty()) {
+            seq.text.append(seq.stops.push(tail));
+        }
+        seq.text.append(seq.stops.flush());
+        results[i] = std::move(seq.text);
+        n_generated[i] = seq.n_generated;
+        n_total += seq.n_generated;
+        if (seq.sampler) {
+            common_sampler_free(seq.sampler);
+        }
+    }
+
+    const int64_t t_us = llama_time_us() - t_start;
+    LOGI("Batch of %d prompts: %d tokens in %.1f s (%.1f tok/s)",
+         n_seq, n_total, t_us / 1e6, t_us > 0 ? n_total * 1e6 / t_us : 0.0);
+
+    llama_batch_free(batch);
+    llama_free(context);
+    return ok;
+}
+
+// --------------------------------------------------------------------------
+// Loading
+// --------------------------------------------------------------------------
+
+/**
+ * Initialize the llama.cpp backend and read the CPU layout
+ */
+void init_backend() {
+    llama_backend_init();
+    llama_log_set([](ggml_log_level level, const char *text, void * /*user_data*/) {
+        if (level >= GGML_LOG_LEVEL_ERROR) {
+            LOGE("%s", text);
+        } else if (level >= GGML_LOG_LEVEL_WARN) {
+            LOGI("%s", text);
+        }
+    }, nullptr);
+    g_cpu = CpuTopology::detect();
+    LOGI("llama.cpp backend initialized, CPU: %s", g_cpu.describe().c_str());
+}
+
+/**
+ * Load a GGUF model from file
+ *
+ * Blocks until loaded, reporting into g_load_progress; setting
+ * g_load_cancel aborts the load.
+ *
+ * @return The model, or nullptr on failure
+ */
+std::shared_ptr<LoadedModel> load_model(const std::string &path, const ModelParams &params) {
+    LOGI("Loading model from: %s", path.c_str());
+    LOGI("GPU layers: %d, mmap %d, mlock %d", params.n_gpu_layers, params.use_mmap, params.use_mlock);
+
+    // Configure model parameters
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = params.n_gpu_layers;
+    model_params.use_mmap = params.use_mmap;
+    model_params.use_mlock = params.use_mlock;
+    model_params.progress_callback = [](float progress, void * /*user_data*/) {
+        g_load_progress.store(progress, std::memory_order_relaxed);
+        return !g_load_cancel.load(std::memory_order_relaxed);
+    };
+
+    g_load_progress.store(0.0f);
+    g_load_cancel.store(false);
+
+    // Read ahead alongside the loader; the pages stay cached for the first decode
+    auto loaded = std::make_shared<LoadedModel>();
+    if (params.use_mmap && params.page_in) {
+        loaded->page_in.start(path);
+    }
+
+    // Load the model
+    loaded->model = llama_load_model_from_file(path.c_str(), model_params);
+
+    if (!loaded->model) {
+        LOGE("%s model from: %s", g_load_cancel.load() ? "Cancelled loading" : "Failed to load", path.c_str());
+        return nullptr;
+    }
+
+    g_load_progress.store(1.0f);
+    LOGI("Model loaded successfully");
+    return loaded;
+}
+
+/**
+ * Create an engine with its own context and default session over a model
+ *
+ * The model stays alive as long as the engine does. n_ctx is capped at the
+ * model's training context; thread counts of 0 use the performance cores.
+ *
+ * @return The engine, or nullptr on failure
+ */
+std::shared_ptr<Engine> create_engine(std::shared_ptr<LoadedModel> loaded, const EngineParams &params) {
+    llama_model *model = loaded->model;
+
+    // Configure context parameters
+    llama_context_params ctx_params = llama_context_default_params();
+    const int n_ctx_train = llama_model_n_ctx_train(model);
+    ctx_params.n_ctx = (uint32_t)(params.n_ctx > 0 ? params.n_ctx : DEFAULT_N_CTX);
+    if (n_ctx_train > 0 && ctx_params.n_ctx > (uint32_t)n_ctx_train) {
+        ctx_params.n_ctx = (uint32_t)n_ctx_train;
+    }
+    ctx_params.flash_attn = params.flash_attn;
+    ctx_params.type_k = kv_type_from_id(params.kv_type);
+    ctx_params.type_v = v_type_for(ctx_params.type_k, ctx_params.flash_attn);
+    ctx_params.n_batch = params.n_batch > 0 ? (uint32_t)params.n_batch : DEFAULT_N_BATCH;
+    ctx_params.n_ubatch = params.n_ubatch > 0
+        ? std::min((uint32_t)params.n_ubatch, ctx_params.n_batch)
+        : ctx_params.n_batch;
+    ctx_params.n_threads = params.n_threads > 0 ? params.n_threads : auto_decode_threads();
+    ctx_params.n_threads_batch = params.n_threads_batch > 0 ? params.n_threads_batch : auto_prefill_threads();
+    ctx_params.n_seq_max = MAX_SESSIONS;
+
+    // Initialize context
+    auto engine = std::make_shared<Engine>();
+    engine->model = std::move(loaded);
+    engine->context = llama_init_from_model(model, ctx_params);
+    if (!engine->context) {
+        LOGE("Failed to initialize context");
+        return nullptr;
+    }
+
+    // Keep ggml's workers on the performance cores
+    engine->threadpool = new_pinned_threadpool(ctx_params.n_threads);
+    engine->threadpool_batch = ctx_params.n_threads_batch != ctx_params.n_threads
+        ? new_pinned_threadpool(ctx_params.n_threads_batch)
+        : nullptr;
+    if (engine->threadpool) {
+        llama_attach_threadpool(engine->context, engine->threadpool,
+                                engine->threadpool_batch ? engine->threadpool_batch : engine->threadpool);
+    } else {
+        LOGE("Failed to create pinned threadpool, using llama.cpp's own");
+    }
+
+    // Default sampler parameters (jobs override the SamplingConfig fields)
+    // and the default session
+    common_params_sampling sparams;
+    sparams.temp = params.temperature;
+    sparams.top_p = 0.95f;
+    sparams.top_k = 40;
+    engine->sampling_params = sparams;
+    if (!create_session(*engine)) {
+        LOGE("Failed to create the default session");
+        return nullptr;
+    }
+
+    // Initialize batch (prefill chunks never exceed n_batch)
+    engine->batch = llama_batch_init((int32_t)ctx_params.n_batch, 0, 1);
+
+    engine->type_k = ctx_params.type_k;
+    engine->type_v = ctx_params.type_v;
+    engine->flash_attn = ctx_params.flash_attn;
+    LOGI("Context initialized with %d decode / %d prefill threads, n_batch %u, n_ubatch %u",
+         ctx_params.n_threads, ctx_params.n_threads_batch, ctx_params.n_batch, ctx_params.n_ubatch);
+    LOGI("n_ctx %u, KV cache %s/%s (%.1f MiB), flash attention %s",
+         ctx_params.n_ctx, ggml_type_name(engine->type_k), ggml_type_name(engine->type_v),
+         kv_bytes_per_token(model, engine->type_k, engine->type_v) * ctx_params.n_ctx / (1024.0 * 1024.0),
+         ctx_params.flash_attn ? "on" : "off");
+    return engine;
+}
+
+/**
+ * Load a small draft model for speculative decoding, replacing any previous one
+ *
+ * The draft must share the target model's vocabulary (e.g. Qwen2.5-0.5B
+ * for Qwen2.5-Math-1.5B).
+ *
+ * @param n_threads Threads for draft decoding, or 0 to match the target's decode threads
+ * @return true if speculative decoding is now active
+ */
+bool load_draft_model(Engine &engine, const std::string &path, int n_ctx, int n_threads, int n_gpu_layers, int n_draft) {
+    free_draft_model(engine);
+    LOGI("Loading draft model from: %s", path.c_str());
+
+    llama_model_params model_params = llama_model_default_params();
+    model_params.n_gpu_layers = n_gpu_layers;
+    llama_model *model = llama_load_model_from_file(path.c_str(), model_params);
+
+    if (!model) {
+        LOGE("Failed to load draft model");
+        return false;
+    }
+
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = (uint32_t)n_ctx;
+    ctx_params.n_batch = DEFAULT_N_BATCH;
+    ctx_params.n_ubatch = DEFAULT_N_BATCH;
+    ctx_params.n_threads = n_threads > 0 ? n_threads : auto_decode_threads();
+    ctx_params.n_threads_batch = ctx_params.n_threads;
+
+    llama_context *context = llama_init_from_model(model, ctx_params);
+    if (!context) {
+        LOGE("Failed to initialize draft context");
+        llama_free_model(model);
+        return false;
+    }
+
+    if (!common_speculative_are_compatible(engine.context, context)) {
+        LOGE("Draft model vocabulary is not compatible with the target model");
+        llama_free(context);
+        llama_free_model(model);
+        return false;
+    }
+
+    engine.draft_model = model;
+    engine.draft_context = context;
+    engine.speculative = common_speculative_init(context);
+    engine.spec_params = common_speculative_params();
+    engine.spec_params.n_draft = n_draft;
+
+    LOGI("Speculative decoding enabled (n_draft %d)", engine.spec_params.n_draft);
+    return true;
+}
+
+// --------------------------------------------------------------------------
+// Prompt warm-up
+// --------------------------------------------------------------------------
+
+/**
+ * Warm a session's KV cache with a fixed prompt prefix, persisted across launches
+ *
+ * If state_path holds a saved sequence for exactly these tokens it is
+ * restored into the session's sequence; otherwise the prefix is decoded
+ * and saved there. The caller keys state_path by model, context params and
+ * prompt, so a file from a different configuration is never found.
+ *
+ * @return Number of tokens now cached, or -1 on failure
+ */
+int warm_prompt(Engine &engine, int session_id, const std::string &prompt, const std::string &state_path) {
+    Session *session = find_session(engine, session_id);
+    if (!session) {
+        LOGE("Unknown session %d", session_id);
+        return -1;
+    }
+
+    llama_context *context = engine.context;
+    std::vector<llama_token> tokens = common_tokenize(context, prompt, true, true);
+    const char *path = state_path.c_str();
+
+    if (tokens.empty() || tokens.size() >= llama_n_ctx(context)) {
+        LOGE("Warm prompt has unusable length: %zu tokens", tokens.size());
+        return -1;
+    }
+
+    // The warmed prefix is pinned through context shifts
+    session->n_keep = tokens.size();
+
+    // Already resident from an earlier call in this process
+    if (common_prefix_length(session->tokens, tokens) == tokens.size()) {
+        return (int)tokens.size();
+    }
+
+    reset_kv_cache(context, *session);
+    reclaim_cells(engine, *session, tokens.size());
+
+    if (access(path, R_OK) == 0) {
+        std::vector<llama_token> saved(tokens.size());
+        size_t n_saved = 0;
+        size_t n_read = llama_state_seq_load_file(
+            context, path, session->seq_id, saved.data(), saved.size(), &n_saved);
+
+        if (n_read > 0 && n_saved == tokens.size() && saved == tokens) {
+            session->tokens = tokens;
+            LOGI("Restored %zu prompt tokens from %s", n_saved, path);
+            return (int)n_saved;
+        }
+
+        LOGI("Prompt state at %s is stale, rebuilding", path);
+        reset_kv_cache(context, *session);
+        unlink(path);
+    }
+
+    if (!prefill_tokens(engine, *session, tokens, 0)) {
+        LOGE("Failed to decode warm prompt");
+        return -1;
+    }
+
+    if (llama_state_seq_save_file(context, path, session->seq_id, tokens.data(), tokens.size()) == 0) {
+        LOGE("Failed to save prompt state to %s", path);
+    } else {
+        LOGI("Saved %zu prompt tokens to %s", tokens.size(), path);
+    }
+
+    return (int)tokens.size();
+}
+
+// --------------------------------------------------------------------------
+// Embeddings
+// --------------------------------------------------------------------------
+
+Embedder::~Embedder() {
+    if (context) {
+        llama_free(context);
+    }
+    if (batch.token) {
+        llama_batch_free(batch);
+    }
+}
+
+/**
+ * Create an embeddings-only context over a model
+ *
+ * Uses the model's own pooling when it has one (embedding GGUFs do); for a
+ * chat model the last hidden states are mean-pooled here. Texts are
+ * decoded in a single batch, so n_ctx is also the longest input.
+ *
+ * @return The embedder, or nullptr on failure
+ */
+std::shared_ptr<Embedder> create_embedder(std::shared_ptr<LoadedModel> loaded, int n_ctx, int n_threads) {
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = (uint32_t)(n_ctx > 0 ? n_ctx : DEFAULT_EMBED_CTX);
+    const int n_ctx_train = llama_model_n_ctx_train(loaded->model);
+    if (n_ctx_train > 0 && ctx_params.n_ctx > (uint32_t)n_ctx_train) {
+        ctx_params.n_ctx = (uint32_t)n_ctx_train;
+    }
+    ctx_params.n_batch = ctx_params.n_ctx;
+    ctx_params.n_ubatch = ctx_params.n_ctx;    // Non-causal models need the whole input in one ubatch
+    ctx_params.n_seq_max = 1;
+    ctx_params.n_threads = n_threads > 0 ? n_threads : DEFAULT_EMBED_THREADS;
+    ctx_params.n_threads_batch = ctx_params.n_threads;
+    ctx_params.embeddings = true;
+
+    auto embedder = std::make_shared<Embedder>();
+    embedder->context = llama_init_from_model(loaded->model, ctx_params);
+    if (!embedder->context) {
+        LOGE("Failed to initialize embedding context");
+        return nullptr;
+    }
+    embedder->n_embd = llama_model_n_embd(loaded->model);
+    embedder->pooled = llama_pooling_type(embedder->context) != LLAMA_POOLING_TYPE_NONE;
+    embedder->batch = llama_batch_init((int32_t)ctx_params.n_ctx, 0, 1);
+    embedder->model = std::move(loaded);
+    LOGI("Embedder initialized: %d dimensions, %s pooling, n_ctx %u",
+         embedder->n_embd, embedder->pooled ? "model" : "mean", ctx_params.n_ctx);
+    return embedder;
+}
+
+/**
+ * Embed a text into an L2-normalized vector of n_embd floats
+ *
+ * Inputs longer than the embedder's context are truncated.
+ */
+bool embed_text(Embedder &embedder, const std::string &text, std::vector<float> &out) {
+    std::lock_guard<std::mutex> lock(embedder.mutex);
+    llama_context *context = embedder.context;
+    const llama_model *model = embedder.model->model;
+
+    std::vector<llama_token> tokens = common_tokenize(llama_model_get_vocab(model), text, true, false);
+    if (tokens.empty()) {
+        return false;
+    }
+    const size_t n_ctx = llama_n_ctx(context);
+    if (tokens.size() > n_ctx) {
+        tokens.resize(n_ctx);
+    }
+
+    // Every position is an output: pooling, ours or the model's, reads them all
+    llama_kv_cache_clear(context);
+    llama_batch &batch = embedder.batch;
+    common_batch_clear(batch);
+    for (size_t i = 0; i < tokens.size(); i++) {
+        common_batch_add(batch, tokens[i], (llama_pos)i, { 0 }, true);
+    }
+    const bool encoder_only = llama_model_has_encoder(model) && !llama_model_has_decoder(model);
+    if ((encoder_only ? llama_encode(context, batch) : llama_decode(context, batch)) != 0) {
+        LOGE("Failed to decode embedding input");
+        return false;
+    }
+
+    const int n_embd = embedder.n_embd;
+    std::vector<float> pooled((size_t)n_embd, 0.0f);
+    if (embedder.pooled) {
+        const float *embd = llama_get_embeddings_seq(context, 0);
+        if (!embd) {
+            LOGE("No pooled embedding");
+            return false;
+        }
+        std::copy(embd, embd + n_embd, pooled.begin());
+    } else {
+        for (int32_t i = 0; i < batch.n_tokens; i++) {
+            const float *embd = llama_get_embeddings_ith(context, i);
+            if (!embd) {
+                LOGE("No embedding for token %d", i);
+                return false;
+            }
+            for (int j = 0; j < n_embd; j++) {
+                pooled[j] += embd[j];
+            }
+        }
+        for (float &v : pooled) {
+            v /= (float)batch.n_tokens;
+        }
+    }
+
+    out.resize((size_t)n_embd);
+    common_embd_normalize(pooled.data(), out.data(), n_embd, 2);
+    return true;
+}
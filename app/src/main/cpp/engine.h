@@ -0,0 +1,303 @@
+#pragma once
+
+#ifdef __ANDROID__
+#include <android/log.h>
+#else
+#include <cstdio>
+#endif
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "ggml-cpu.h"
+#include "llama.h"
+#include "common.h"
+#include "sampling.h"
+#include "speculative.h"
+
+#include "cpu_topology.h"
+#include "decode_worker.h"
+#include "page_in.h"
+
+/**
+ * Inference engine shared by the JNI bindings and the native benchmark
+ *
+ * Everything here is plain C++ over llama.cpp; llama_jni.cpp only maps
+ * handles and Java types onto it, so mathagent-bench measures exactly the
+ * code the app runs. Functions taking an Engine expect the caller to hold
+ * engine.mutex, except run_generation, which takes it itself.
+ */
+
+#define TAG "MathAgent"
+#ifdef __ANDROID__
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
+#define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, TAG, __VA_ARGS__)
+#else
+#define LOGI(...) (fprintf(stderr, "I/" TAG ": " __VA_ARGS__), fputc('\n', stderr))
+#define LOGE(...) (fprintf(stderr, "E/" TAG ": " __VA_ARGS__), fputc('\n', stderr))
+#define LOGD(...) ((void)0)
+#endif
+
+// --------------------------------------------------------------------------
+// Engine state
+// --------------------------------------------------------------------------
+
+// A sampler chain for one grammar (possibly none) and sampling config,
+// cached by hash of both. A null sampler records a grammar that failed to
+// parse so it is not retried. The probe is a second instance of the same
+// grammar, advanced in lockstep, used to ask which tokens the grammar
+// allows next (common_sampler keeps its own grammar private).
+struct CachedSampler {
+    std::string grammar;
+    SamplingConfig config;
+    common_sampler *sampler;
+    llama_sampler *probe;
+};
+
+// One conversation: its own KV sequence in the shared context, the tokens
+// cached there (in position order) and its own samplers. Reusing the cached
+// prefix lets consecutive ReAct turns, and a switch back to an earlier
+// chat, skip re-decoding. The session id is its seq_id.
+//
+// When the context fills up, tokens right after the pinned prefix (the
+// warmed system prompt) are evicted and the rest shifted back in place.
+// Evicted tokens are remembered so the next prompt, which still contains
+// them, is trimmed the same way and keeps matching the cache.
+//
+// Sessions compete for the cache: all of them share its n_ctx cells, so a
+// session about to grow past what the others leave free clears the least
+// recently used of them first, which then re-prefill their next prompt.
+struct Session {
+    llama_seq_id seq_id;
+    std::vector<llama_token> tokens;
+    std::unordered_map<size_t, CachedSampler> samplers;
+    size_t n_keep = 0;                  // Pinned prefix length, never evicted
+    std::vector<llama_token> evicted;   // Prompt tokens dropped after the prefix, in order
+    uint64_t last_used = 0;             // Engine::use_clock of its last prefill or generation
+};
+
+// Speculative decoding counters for the most recent generation
+struct SpeculativeStats {
+    int n_drafted;
+    int n_accepted;
+    int n_generated;
+    int64_t t_generate_us;
+};
+
+// A loaded GGUF, freed when the last handle and the last engine built on it
+// let go. Owns the background page-in of its file.
+struct LoadedModel {
+    llama_model *model = nullptr;
+    PageIn page_in;
+
+    ~LoadedModel() {
+        page_in.stop();
+        if (model) {
+            llama_free_model(model);
+            LOGI("Model freed");
+        }
+    }
+};
+
+// A context over a model and everything that depends on either: sessions,
+// threadpools, the draft model and vocabulary-derived caches.
+//
+// Engines are reference counted. Kotlin holds one reference through its
+// context handle and every queued or running job holds another, so a model
+// swap can build a new engine while the old one finishes its generation,
+// then drop the old handle without waiting.
+struct Engine {
+    std::shared_ptr<LoadedModel> model;
+    llama_context *context = nullptr;
+    llama_batch batch = {};
+    common_params_sampling sampling_params;
+
+    // Pinned to the performance cores; decode (memory bound) and prefill
+    // (compute bound) get separately sized pools
+    ggml_threadpool *threadpool = nullptr;
+    ggml_threadpool *threadpool_batch = nullptr;
+
+    // KV cache element types and attention the context was created with
+    ggml_type type_k = GGML_TYPE_F16;
+    ggml_type type_v = GGML_TYPE_F16;
+    bool flash_attn = false;
+
+    std::unordered_map<int, Session> sessions;
+    uint64_t use_clock = 0;     // Ticks on every session use, for LRU clearing
+
+    // Optional small draft model for speculative decoding
+    llama_model *draft_model = nullptr;
+    llama_context *draft_context = nullptr;
+    common_speculative *speculative = nullptr;
+    common_speculative_params spec_params;
+
+    // Single-character tokens used to cheaply rule out forced text
+    std::vector<llama_token> canary_tokens;
+
+    // Scratch candidate array for full-vocabulary grammar probes
+    std::vector<llama_token_data> probe_candidates;
+
+    // Counters and (tokens, milliseconds) per prefill chunk for the most
+    // recent generation
+    SpeculativeStats spec_stats = {};
+    std::vector<std::pair<int, float>> prefill_timings;
+
+    // Held by the decode thread for a whole job, and by JNI calls that touch
+    // the context, sessions or draft model while a job may be running
+    std::mutex mutex;
+
+    // Prompts assembled segment by segment, by session id. Guarded by
+    // transcript_mutex rather than mutex, so appending (which only needs
+    // the vocabulary) never waits for a running generation.
+    std::unordered_map<int, std::vector<llama_token>> transcripts;
+    std::mutex transcript_mutex;
+
+    const llama_vocab *vocab() const {
+        return llama_model_get_vocab(model->model);
+    }
+
+    ~Engine();
+};
+
+// An embeddings-only context over a model: the chat model itself (whose
+// mmapped weights it shares) or a dedicated embedding GGUF. Separate from
+// any engine, so embedding a question neither waits for a generation nor
+// touches its KV cache. Models without their own pooling are mean-pooled.
+struct Embedder {
+    std::shared_ptr<LoadedModel> model;
+    llama_context *context = nullptr;
+    llama_batch batch = {};
+    int n_embd = 0;
+    bool pooled = false;    // The context pools (model's own pooling type)
+    std::mutex mutex;       // One embedding at a time
+
+    ~Embedder();
+};
+
+// CPU layout, read once in init_backend
+extern CpuTopology g_cpu;
+
+// Model load progress in [0, 1], polled by Kotlin, and a flag to abort it.
+// Shared by all loads; Kotlin runs one at a time.
+extern std::atomic<float> g_load_progress;
+extern std::atomic<bool> g_load_cancel;
+
+// Draft-model-free speculation: propose continuations copied from earlier
+// occurrences of the trailing n-gram in the context
+struct PromptLookupParams {
+    bool enabled;
+    int ngram_min;
+    int ngram_max;
+    int n_draft;
+};
+
+// The settings below are set by JNI calls on any thread; run_generation
+// reads each once per job, so a change applies from the next job on.
+PromptLookupParams get_lookup_params();
+void set_lookup_params(const PromptLookupParams &params);
+
+// Batch-decode grammar-forced token runs instead of sampling them one by one
+extern std::atomic<bool> g_fast_forward;
+
+// Prompt prefill is fed to llama_decode in chunks of at most this many
+// tokens (never more than the context's n_batch).
+extern std::atomic<int> g_prefill_chunk;
+
+// --------------------------------------------------------------------------
+// Configuration constants
+// --------------------------------------------------------------------------
+
+constexpr int DEFAULT_N_CTX = 2048;
+constexpr int DEFAULT_N_THREADS = 4;
+constexpr int MAX_DECODE_THREADS = 4;   // Decode stops scaling once memory bandwidth is saturated
+constexpr int DEFAULT_N_BATCH = 512;
+constexpr float DEFAULT_TEMPERATURE = 0.7f;
+constexpr size_t STREAM_RING_BYTES = 64 * 1024;    // Per job
+constexpr size_t MAX_CACHED_SAMPLERS = 4;   // Per session
+constexpr int MAX_FORCED_RUNS = 8;     // Probe rounds per fast-forward; each forces at least one character
+constexpr int MAX_SESSIONS = 4;
+constexpr int DEFAULT_SESSION = 0;
+constexpr size_t EVICT_BOUNDARY_SCAN = 64;  // Tokens to look ahead for a line break to evict up to
+constexpr int MAX_BATCH_SEQUENCES = 16;     // Prompts decoded side by side by generate_batch
+constexpr int DEFAULT_EMBED_CTX = 512;      // Longer texts are truncated
+constexpr int DEFAULT_EMBED_THREADS = 2;
+
+// --------------------------------------------------------------------------
+// Engine API
+// --------------------------------------------------------------------------
+
+// Model parameters for load_model
+struct ModelParams {
+    int n_gpu_layers = 0;
+    bool use_mmap = true;
+    bool use_mlock = false;
+    bool page_in = false;   // With mmap, fault the file in on a background thread
+};
+
+// Context parameters for create_engine; 0 picks the default. temperature
+// is the default for generate_batch; jobs carry their own SamplingConfig.
+struct EngineParams {
+    int n_ctx = 0;
+    int n_threads = 0;
+    int n_threads_batch = 0;
+    int n_batch = 0;
+    int n_ubatch = 0;
+    float temperature = DEFAULT_TEMPERATURE;
+    int kv_type = 0;        // 0 f16, 1 q8_0, 2 q4_0
+    bool flash_attn = false;
+};
+
+// Lifecycle
+void init_backend();
+std::shared_ptr<LoadedModel> load_model(const std::string &path, const ModelParams &params);
+std::shared_ptr<Engine> create_engine(std::shared_ptr<LoadedModel> model, const EngineParams &params);
+bool load_draft_model(Engine &engine, const std::string &path, int n_ctx, int n_threads, int n_gpu_layers, int n_draft);
+void free_draft_model(Engine &engine);
+
+// Sessions and KV cache
+Session *find_session(Engine &engine, int session_id);
+Session *create_session(Engine &engine);
+void clear_session(Engine &engine, int session_id);
+void destroy_session(Engine &engine, int session_id);
+void reset_kv_cache(llama_context *context, Session &session);
+bool prefill_tokens(
+    Engine &engine,
+    Session &session,
+    const std::vector<llama_token> &tokens,
+    size_t n_past,
+    const std::atomic<bool> *cancel = nullptr);
+int warm_prompt(Engine &engine, int session_id, const std::string &prompt, const std::string &state_path);
+
+// KV cache sizing
+ggml_type kv_type_from_id(int id);
+ggml_type v_type_for(ggml_type type_k, bool flash_attn);
+double kv_bytes_per_token(const llama_model *model, ggml_type type_k, ggml_type type_v);
+
+// Transcripts (lock transcript_mutex themselves; transcript_erase also
+// takes engine.mutex, always before transcript_mutex)
+int transcript_append(Engine &engine, int session_id, const std::string &text, bool add_special);
+int transcript_erase(Engine &engine, int session_id, size_t from, size_t count);
+void transcript_clear(Engine &engine, int session_id);
+std::vector<llama_token> transcript_tokens(Engine &engine, int session_id);
+
+// Embeddings (lock embedder.mutex themselves)
+std::shared_ptr<Embedder> create_embedder(std::shared_ptr<LoadedModel> model, int n_ctx, int n_threads);
+bool embed_text(Embedder &embedder, const std::string &text, std::vector<float> &out);
+
+// Generation
+void run_generation(GenerateJob &job);
+bool generate_batch(
+    Engine &engine,
+    const std::vector<std::string> &prompts,
+    int max_tokens,
+    float temperature,
+    const std::string &grammar,
+    const std::vector<std::string> &stop_strings,
+    std::vector<std::string> &results,
+    std::vector<int> &n_generated);
@@ -0,0 +1,573 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+
+/**
+ * Arithmetic expression evaluator for the calculate tool's fast path
+ *
+ * Handles + - * / ^ (and ** × ÷ · −), unary signs, parentheses, implicit
+ * multiplication ("2(3+4)", "3pi", "2sqrt(2)"), factorials, pi/π/e and
+ * the usual functions. Implicit multiplication needs a name, π, √ or "("
+ * on the right: "2 3" and "1 000" are errors rather than 6 and 0.
+ * Integers and decimals are kept as exact rationals for as long as every
+ * operation allows, so "1/3 + 1/6" is exactly 1/2
+ * and "0.1 + 0.2" exactly 3/10; anything irrational falls back to double.
+ *
+ * Trig takes radians, except for arguments marked with °, deg or degrees
+ * and, as MathTools has always read them, a bare integer literal
+ * ("sin(30)" is sin 30°). Anything it does not understand, including
+ * variables, fails the evaluation so the caller can fall back to SymPy.
+ */
+class ExpressionEvaluator {
+public:
+    struct Result {
+        bool ok = false;
+        double value = 0.0;
+        bool exact = false;         // value is exactly num / den
+        int64_t num = 0;
+        int64_t den = 1;
+        std::string error;
+        size_t error_pos = 0;       // Byte offset into the expression
+    };
+
+    static Result evaluate(std::string_view text) {
+        ExpressionEvaluator evaluator(text);
+        Result result;
+        Number n;
+        if (evaluator.parse_expr(n)) {
+            evaluator.skip_space();
+            if (evaluator.pos_ < text.size()) {
+                evaluator.fail("Unexpected input");
+            } else if (!std::isfinite(n.value)) {
+                evaluator.fail("Result is not a finite real number");
+            }
+        }
+        if (!evaluator.error_.empty()) {
+            result.error = evaluator.error_;
+            result.error_pos = evaluator.error_pos_;
+            return result;
+        }
+        result.ok = true;
+        result.value = n.value;
+        result.exact = n.exact;
+        result.num = n.num;
+        result.den = n.den;
+        return result;
+    }
+
+private:
+    static constexpr int MAX_DEPTH = 64;
+    static constexpr int MAX_EXACT_EXPONENT = 64;
+    static constexpr int MAX_FACTORIAL = 170;      // 171! overflows a double
+
+    // An exact rational (den > 0, lowest terms) or just a double
+    struct Number {
+        bool exact = false;
+        int64_t num = 0;
+        int64_t den = 1;
+        double value = 0.0;
+
+        static Number rational(int64_t num, int64_t den) {
+            if (num == INT64_MIN || den == INT64_MIN) {
+                return real((double)num / (double)den);
+            }
+            if (den < 0) {
+                num = -num;
+                den = -den;
+            }
+            const int64_t g = gcd(num < 0 ? -num : num, den);
+            Number n;
+            n.exact = true;
+            n.num = num / g;
+            n.den = den / g;
+            n.value = (double)n.num / (double)n.den;
+            return n;
+        }
+
+        static Number real(double value) {
+            Number n;
+            n.value = value;
+            return n;
+        }
+
+        bool is_integer() const {
+            return exact && den == 1;
+        }
+    };
+
+    explicit ExpressionEvaluator(std::string_view text) : text_(text) {}
+
+    static int64_t gcd(int64_t a, int64_t b) {
+        while (b != 0) {
+            const int64_t t = a % b;
+            a = b;
+            b = t;
+        }
+        return a == 0 ? 1 : a;
+    }
+
+    // ----------------------------------------------------------------------
+    // Arithmetic (exact while nothing overflows)
+    // ----------------------------------------------------------------------
+
+    static Number add(const Number &a, const Number &b, bool subtract) {
+        if (a.exact && b.exact) {
+            int64_t x, y, num, den;
+            if (!__builtin_mul_overflow(a.num, b.den, &x) && !__builtin_mul_overflow(b.num, a.den, &y)
+                && !(subtract ? __builtin_sub_overflow(x, y, &num) : __builtin_add_overflow(x, y, &num))
+                && !__builtin_mul_overflow(a.den, b.den, &den)) {
+                return Number::rational(num, den);
+            }
+        }
+        return Number::real(subtract ? a.value - b.value : a.value + b.value);
+    }
+
+    static Number multiply(const Number &a, const Number &b) {
+        if (a.exact && b.exact) {
+            // Cross-reduce first so products stay small
+            const int64_t g1 = gcd(a.num < 0 ? -a.num : a.num, b.den);
+            const int64_t g2 = gcd(b.num < 0 ? -b.num : b.num, a.den);
+            int64_t num, den;
+            if (!__builtin_mul_overflow(a.num / g1, b.num / g2, &num)
+                && !__builtin_mul_overflow(a.den / g2, b.den / g1, &den)) {
+                return Number::rational(num, den);
+            }
+        }
+        return Number::real(a.value * b.value);
+    }
+
+    bool divide(const Number &a, const Number &b, Number &out) {
+        if (b.value == 0.0) {
+            return fail("Division by zero");
+        }
+        if (a.exact && b.exact) {
+            out = multiply(a, Number::rational(b.den, b.num));
+        } else {
+            out = Number::real(a.value / b.value);
+        }
+        return true;
+    }
+
+    bool power(const Number &base, const Number &exponent, Number &out) {
+        if (base.exact && exponent.is_integer() && std::llabs(exponent.num) <= MAX_EXACT_EXPONENT) {
+            if (base.num == 0 && exponent.num < 0) {
+                return fail("Division by zero");
+            }
+            Number result = Number::rational(1, 1);
+            for (int64_t i = 0; i < std::llabs(exponent.num) && result.exact; i++) {
+                result = multiply(result, base);
+            }
+            if (result.exact) {
+                out = exponent.num < 0 ? Number::rational(result.den, result.num) : result;
+                return true;
+            }
+        }
+        out = Number::real(std::pow(base.value, exponent.value));
+        return true;
+    }
+
+    bool factorial(Number n, Number &out) {
+        if (!n.is_integer() || n.num < 0) {
+            return fail("Factorial needs a non-negative integer");
+        }
+        if (n.num > MAX_FACTORIAL) {
+            return fail("Factorial too large");
+        }
+        out = Number::rational(1, 1);
+        for (int64_t i = 2; i <= n.num; i++) {
+            out = multiply(out, Number::rational(i, 1));
+        }
+        return true;
+    }
+
+    // ----------------------------------------------------------------------
+    // Lexing
+    // ----------------------------------------------------------------------
+
+    bool fail(const char *message) {
+        if (error_.empty()) {
+            error_ = message;
+            error_pos_ = pos_;
+        }
+        return false;
+    }
+
+    void skip_space() {
+        while (pos_ < text_.size() && (text_[pos_] == ' ' || text_[pos_] == '\t')) {
+            pos_++;
+        }
+    }
+
+    // Consume token (after spaces) if it is next
+    bool accept(std::string_view token) {
+        skip_space();
+        if (text_.substr(pos_, token.size()) == token) {
+            pos_ += token.size();
+            return true;
+        }
+        return false;
+    }
+
+    static bool is_digit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool is_alpha(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+    }
+
+    // A letter, then letters or digits ("log10", "log2")
+    std::string_view peek_identifier() {
+        skip_space();
+        size_t end = pos_;
+        while (end < text_.size() && (is_alpha(text_[end]) || (end > pos_ && is_digit(text_[end])))) {
+            end++;
+        }
+        return text_.substr(pos_, end - pos_);
+    }
+
+    // Whether the next token can start an implicitly multiplied factor. A
+    // number cannot: two literals side by side are a typo, not a product.
+    bool starts_factor() {
+        skip_space();
+        if (pos_ >= text_.size()) {
+            return false;
+        }
+        const char c = text_[pos_];
+        if (c == '(' || is_alpha(c)) {
+            return !is_degree_marker();
+        }
+        return text_.substr(pos_, 2) == "\xCF\x80"          // π
+            || text_.substr(pos_, 3) == "\xE2\x88\x9A";     // √
+    }
+
+    bool is_degree_marker() {
+        const std::string_view id = peek_identifier();
+        return id == "deg" || id == "degree" || id == "degrees" || id == "rad" || id == "radians";
+    }
+
+    // ----------------------------------------------------------------------
+    // Grammar: expr := term (("+" | "-") term)*
+    //          term := unary (("*" | "/") unary | factor)*
+    //          unary := ("-" | "+") unary | power
+    //          power := postfix ("^" unary)?
+    //          postfix := primary ("!" | "°" | "deg" | "rad")*
+    // ----------------------------------------------------------------------
+
+    bool parse_expr(Number &out) {
+        if (++depth_ > MAX_DEPTH) {
+            return fail("Expression nested too deeply");
+        }
+        if (!parse_term(out)) {
+            return false;
+        }
+        while (true) {
+            bool subtract;
+            if (accept("+")) {
+                subtract = false;
+            } else if (accept("-") || accept("\xE2\x88\x92")) {    // − (U+2212)
+                subtract = true;
+            } else {
+                break;
+            }
+            Number rhs;
+            if (!parse_term(rhs)) {
+                return false;
+            }
+            out = add(out, rhs, subtract);
+        }
+        depth_--;
+        return true;
+    }
+
+    bool parse_term(Number &out) {
+        if (!parse_unary(out)) {
+            return false;
+        }
+        while (true) {
+            Number rhs;
+            if (text_.substr(pos_, 2) != "**"
+                && (accept("*") || accept("\xC3\x97") || accept("\xC2\xB7"))) {  // × ·
+                if (!parse_unary(rhs)) {
+                    return false;
+                }
+                out = multiply(out, rhs);
+            } else if (accept("/") || accept("\xC3\xB7")) {                     // ÷
+                if (!parse_unary(rhs) || !divide(out, rhs, out)) {
+                    return false;
+                }
+            } else if (starts_factor()) {
+                if (!parse_power(rhs)) {
+                    return false;
+                }
+                out = multiply(out, rhs);
+            } else {
+                return true;
+            }
+        }
+    }
+
+    bool parse_unary(Number &out) {
+        if (accept("-") || accept("\xE2\x88\x92")) {
+            if (!parse_unary(out)) {
+                return false;
+            }
+            out = multiply(out, Number::rational(-1, 1));
+            return true;
+        }
+        if (accept("+")) {
+            return parse_unary(out);
+        }
+        return parse_power(out);
+    }
+
+    bool parse_power(Number &out) {
+        if (!parse_postfix(out)) {
+            return false;
+        }
+        if (accept("^") || accept("**")) {
+            Number exponent;
+            return parse_unary(exponent) && power(out, exponent, out);
+        }
+        return true;
+    }
+
+    bool parse_postfix(Number &out) {
+        if (!parse_primary(out)) {
+            return false;
+        }
+        while (true) {
+            skip_space();
+            if (accept("!")) {
+                if (!factorial(out, out)) {
+                    return false;
+                }
+            } else if (accept("\xC2\xB0")) {                                    // °
+                out = to_radians(out);
+            } else if (is_degree_marker()) {
+                const std::string_view id = peek_identifier();
+                pos_ += id.size();
+                if (id[0] == 'd') {
+                    out = to_radians(out);
+                }
+            } else {
+                return true;
+            }
+        }
+    }
+
+    bool parse_primary(Number &out) {
+        skip_space();
+        if (pos_ >= text_.size()) {
+            return fail("Unexpected end of expression");
+        }
+        const char c = text_[pos_];
+        if (is_digit(c) || c == '.') {
+            return parse_number(out);
+        }
+        if (accept("(")) {
+            return parse_expr(out) && (accept(")") || fail("Expected ')'"));
+        }
+        if (accept("\xCF\x80")) {                                               // π
+            out = Number::real(M_PI);
+            return true;
+        }
+        if (accept("\xE2\x88\x9A")) {                                           // √
+            Number arg;
+            if (!parse_postfix(arg)) {
+                return false;
+            }
+            return apply("sqrt", arg, out);
+        }
+        if (is_alpha(c)) {
+            const std::string_view name = peek_identifier();
+            const size_t name_pos = pos_;
+            pos_ += name.size();
+            if (name == "pi") {
+                out = Number::real(M_PI);
+                return true;
+            }
+            if (name == "e") {
+                out = Number::real(M_E);
+                return true;
+            }
+            if (!accept("(")) {
+                pos_ = name_pos;
+                return fail("Unknown name");
+            }
+            // Bare integer literals are degrees for sin, cos and tan
+            const bool trig = name == "sin" || name == "cos" || name == "tan";
+            const bool degrees = trig && bare_integer_argument();
+            Number arg;
+            if (!parse_expr(arg) || !(accept(")") || fail("Expected ')'"))) {
+                return false;
+            }
+            if (degrees) {
+                arg = to_radians(arg);
+            }
+            return apply(name, arg, out);
+        }
+        return fail("Unexpected character");
+    }
+
+    // Whether the text from here to the next ')' is only an integer literal
+    bool bare_integer_argument() {
+        size_t i = pos_;
+        while (i < text_.size() && text_[i] == ' ') {
+            i++;
+        }
+        const size_t digits = i;
+        while (i < text_.size() && is_digit(text_[i])) {
+            i++;
+        }
+        if (i == digits) {
+            return false;
+        }
+        while (i < text_.size() && text_[i] == ' ') {
+            i++;
+        }
+        return i < text_.size() && text_[i] == ')';
+    }
+
+    bool parse_number(Number &out) {
+        // Digits go into an exact rational while they fit
+        int64_t num = 0;
+        int64_t den = 1;
+        bool exact = true;
+        bool any_digit = false;
+        bool fraction = false;
+        const size_t start = pos_;
+        for (; pos_ < text_.size(); pos_++) {
+            const char c = text_[pos_];
+            if (c == '.' && !fraction) {
+                fraction = true;
+                continue;
+            }
+            if (!is_digit(c)) {
+                break;
+            }
+            any_digit = true;
+            if (exact && (__builtin_mul_overflow(num, 10, &num) || __builtin_add_overflow(num, c - '0', &num)
+                          || (fraction && __builtin_mul_overflow(den, 10, &den)))) {
+                exact = false;
+            }
+        }
+        if (!any_digit) {
+            pos_ = start;
+            return fail("Malformed number");
+        }
+
+        // Scientific notation, only when a digit follows (so "2e" is 2 * e)
+        int exponent = 0;
+        if (pos_ < text_.size() && (text_[pos_] == 'e' || text_[pos_] == 'E')) {
+            size_t i = pos_ + 1;
+            const bool negative = i < text_.size() && text_[i] == '-';
+            if (i < text_.size() && (text_[i] == '-' || text_[i] == '+')) {
+                i++;
+            }
+            if (i < text_.size() && is_digit(text_[i])) {
+                for (; i < text_.size() && is_digit(text_[i]); i++) {
+                    exponent = std::min(exponent * 10 + (text_[i] - '0'), 1000);
+                }
+                exponent = negative ? -exponent : exponent;
+                pos_ = i;
+            }
+        }
+        if (pos_ < text_.size() && (text_[pos_] == '.' || is_digit(text_[pos_]))) {
+            return fail("Malformed number");    // "1.5.5", "1e5.2"
+        }
+
+        if (exact) {
+            out = Number::rational(num, den);
+            if (exponent != 0) {
+                Number scale;
+                if (!power(Number::rational(10, 1), Number::rational(exponent, 1), scale)) {
+                    return false;
+                }
+                out = multiply(out, scale);
+            }
+        } else {
+            out = Number::real(std::strtod(std::string(text_.substr(start, pos_ - start)).c_str(), nullptr));
+        }
+        return true;
+    }
+
+    static Number to_radians(const Number &n) {
+        return Number::real(n.value * M_PI / 180.0);
+    }
+
+    bool apply(std::string_view name, const Number &arg, Number &out) {
+        const double x = arg.value;
+        double y;
+        if (name == "sin") {
+            y = std::sin(x);
+        } else if (name == "cos") {
+            y = std::cos(x);
+        } else if (name == "tan") {
+            y = std::tan(x);
+        } else if (name == "asin" || name == "arcsin") {
+            y = std::asin(x);
+        } else if (name == "acos" || name == "arccos") {
+            y = std::acos(x);
+        } else if (name == "atan" || name == "arctan") {
+            y = std::atan(x);
+        } else if (name == "sinh") {
+            y = std::sinh(x);
+        } else if (name == "cosh") {
+            y = std::cosh(x);
+        } else if (name == "tanh") {
+            y = std::tanh(x);
+        } else if (name == "sqrt") {
+            if (x < 0) {
+                return fail("Square root of a negative number");
+            }
+            y = std::sqrt(x);
+            // Keep perfect squares exact
+            if (arg.exact) {
+                const int64_t n = std::llround(std::sqrt((double)arg.num));
+                const int64_t d = std::llround(std::sqrt((double)arg.den));
+                if (n * n == arg.num && d * d == arg.den) {
+                    out = Number::rational(n, d);
+                    return true;
+                }
+            }
+        } else if (name == "cbrt") {
+            y = std::cbrt(x);
+        } else if (name == "abs") {
+            out = arg.exact ? Number::rational(arg.num < 0 ? -arg.num : arg.num, arg.den) : Number::real(std::fabs(x));
+            return true;
+        } else if (name == "log" || name == "ln") {
+            // Natural, as in exp4j and SymPy, which this runs in front of
+            y = std::log(x);
+        } else if (name == "log10") {
+            y = std::log10(x);
+        } else if (name == "log2") {
+            y = std::log2(x);
+        } else if (name == "exp") {
+            y = std::exp(x);
+        } else if (name == "floor" || name == "ceil" || name == "round") {
+            y = name == "floor" ? std::floor(x) : name == "ceil" ? std::ceil(x) : std::round(x);
+            if (std::fabs(y) < 9.0e18) {
+                out = Number::rational((int64_t)y, 1);
+                return true;
+            }
+        } else {
+            return fail("Unknown function");
+        }
+        if (std::isnan(y)) {
+            return fail("Argument out of domain");
+        }
+        out = Number::real(y);
+        return true;
+    }
+
+    std::string_view text_;
+    size_t pos_ = 0;
+    int depth_ = 0;
+    std::string error_;
+    size_t error_pos_ = 0;
+};
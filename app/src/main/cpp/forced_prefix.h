@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "llama.h"
+
+/**
+ * Text that every allowed token starts with
+ *
+ * Whichever of the allowed tokens the model picks, its text begins with
+ * this prefix, so the prefix is forced. Nothing past it is: with a grammar
+ * of "ab" | "ac" and only "a" and "ab" in the vocabulary, the prefix is "a",
+ * because "a" followed by "c" is still valid. Text the grammar forces after
+ * the prefix is found by probing again once the prefix has been accepted.
+ */
+inline std::string forced_prefix(const llama_vocab *vocab, const std::vector<llama_token> &allowed) {
+    std::string prefix;
+    std::vector<char> buffer(64);
+    for (size_t i = 0; i < allowed.size(); i++) {
+        int32_t n = llama_token_to_piece(vocab, allowed[i], buffer.data(), (int32_t)buffer.size(), 0, false);
+        if (n < 0) {
+            buffer.resize((size_t)(-n));
+            n = llama_token_to_piece(vocab, allowed[i], buffer.data(), (int32_t)buffer.size(), 0, false);
+        }
+        const size_t len = n > 0 ? (size_t)n : 0;
+        if (i == 0) {
+            prefix.assign(buffer.data(), len);
+            continue;
+        }
+        size_t common = 0;
+        while (common < prefix.size() && common < len && prefix[common] == buffer[common]) {
+            common++;
+        }
+        prefix.resize(common);
+        if (prefix.empty()) {
+            break;
+        }
+    }
+    return prefix;
+}
@@ -1,40 +1,200 @@
-#include <android/log.h>
 #include <jni.h>
+#include <algorithm>
 #include <string>
-#include <cstring>
-#include <unistd.h>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
-#include "llama.h"
-#include "common.h"
-#include "sampling.h"
-
-#define TAG "MathAgent"
-#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
-#define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, TAG, __VA_ARGS__)
+#include "decode_worker.h"
+#include "engine.h"
+#include "expr_eval.h"
 
 // --------------------------------------------------------------------------
-// Global state
+// Handles
 // --------------------------------------------------------------------------
 
-static llama_model *g_model = nullptr;
-static llama_context *g_context = nullptr;
-static llama_batch g_batch = {};
-static common_sampler *g_sampler = nullptr;
-static std::string g_grammar = "";
+// Model and engine handles given to Kotlin. A handle is an id, never a
+// pointer, so a call racing with its free finds nothing instead of freed
+// memory.
+static std::unordered_map<jlong, std::shared_ptr<LoadedModel>> g_models;
+static std::unordered_map<jlong, std::shared_ptr<Engine>> g_engines;
+static std::unordered_map<jlong, std::shared_ptr<Embedder>> g_embedders;
+static std::mutex g_handles_mutex;
+static jlong g_next_handle = 1;
 
-// --------------------------------------------------------------------------
-// Configuration constants
-// --------------------------------------------------------------------------
+template <typename T>
+static jlong add_handle(std::unordered_map<jlong, std::shared_ptr<T>> &handles, std::shared_ptr<T> value) {
+    std::lock_guard<std::mutex> lock(g_handles_mutex);
+    const jlong id = g_next_handle++;
+    handles[id] = std::move(value);
+    return id;
+}
 
-constexpr int DEFAULT_N_CTX = 2048;
-constexpr int DEFAULT_N_THREADS = 4;
-constexpr int DEFAULT_N_BATCH = 512;
-constexpr float DEFAULT_TEMPERATURE = 0.7f;
+template <typename T>
+static std::shared_ptr<T> find_handle(const std::unordered_map<jlong, std::shared_ptr<T>> &handles, jlong id) {
+    std::lock_guard<std::mutex> lock(g_handles_mutex);
+    auto it = handles.find(id);
+    return it != handles.end() ? it->second : nullptr;
+}
 
-// --------------------------------------------------------------------------
-// Helper functions
-// --------------------------------------------------------------------------
+/**
+ * Forget a handle; the object goes once nothing else references it
+ */
+template <typename T>
+static std::shared_ptr<T> release_handle(std::unordered_map<jlong, std::shared_ptr<T>> &handles, jlong id) {
+    std::lock_guard<std::mutex> lock(g_handles_mutex);
+    auto it = handles.find(id);
+    if (it == handles.end()) {
+        return nullptr;
+    }
+    std::shared_ptr<T> value = std::move(it->second);
+    handles.erase(it);
+    return value;
+}
+
+static std::shared_ptr<LoadedModel> find_model(jlong handle) {
+    return find_handle(g_models, handle);
+}
+
+static std::shared_ptr<Engine> find_engine(jlong handle) {
+    return find_handle(g_engines, handle);
+}
+
+static std::shared_ptr<Embedder> find_embedder(jlong handle) {
+    return find_handle(g_embedders, handle);
+}
+
+static DecodeWorker g_worker(run_generation);
+
+// Jobs handed out to Kotlin, by id, until nativeReleaseJob
+static std::unordered_map<jlong, std::shared_ptr<GenerateJob>> g_jobs;
+static std::mutex g_jobs_mutex;
+static jlong g_next_job_id = 1;
+
+static std::shared_ptr<GenerateJob> find_job(jlong job_id) {
+    std::lock_guard<std::mutex> lock(g_jobs_mutex);
+    auto it = g_jobs.find(job_id);
+    return it != g_jobs.end() ? it->second : nullptr;
+}
+
+/**
+ * Cancel every job handed out for an engine
+ *
+ * The jobs stay known until nativeReleaseJob; only their work stops.
+ */
+static void cancel_engine_jobs(const Engine *engine) {
+    std::vector<std::shared_ptr<GenerateJob>> jobs;
+    {
+        std::lock_guard<std::mutex> lock(g_jobs_mutex);
+        for (const auto &entry : g_jobs) {
+            if (entry.second->engine.get() == engine) {
+                jobs.push_back(entry.second);
+            }
+        }
+    }
+    for (const auto &job : jobs) {
+        g_worker.cancel(*job);
+    }
+}
+
+/**
+ * Copy text into a new Java byte[]
+ *
+ * NewStringUTF expects modified UTF-8 and mangles 4-byte sequences, so
+ * generated text crosses JNI as raw bytes and is decoded in Kotlin.
+ */
+static jbyteArray to_utf8_bytes(JNIEnv *env, const std::string &text) {
+    jbyteArray bytes = env->NewByteArray((jsize)text.size());
+    env->SetByteArrayRegion(bytes, 0, (jsize)text.size(), reinterpret_cast<const jbyte *>(text.data()));
+    return bytes;
+}
+
+/**
+ * Standard UTF-8 bytes of a Java string
+ *
+ * GetStringUTFChars returns modified UTF-8: characters outside the BMP
+ * come out as two 3-byte surrogates and NUL as 0xC0 0x80, so text sent
+ * that way tokenizes differently from the same text sent through
+ * DirectUtf8Encoder. This encodes the UTF-16 directly, replacing unpaired
+ * surrogates with '?' as that encoder does.
+ */
+static std::string to_utf8(JNIEnv *env, jstring text) {
+    std::string out;
+    if (!text) {
+        return out;
+    }
+    const jsize n = env->GetStringLength(text);
+    const jchar *chars = env->GetStringChars(text, nullptr);
+    if (!chars) {
+        return out;
+    }
+    out.reserve((size_t)n);
+    for (jsize i = 0; i < n; i++) {
+        uint32_t c = chars[i];
+        if (c >= 0xD800 && c <= 0xDFFF) {
+            if (c <= 0xDBFF && i + 1 < n && chars[i + 1] >= 0xDC00 && chars[i + 1] <= 0xDFFF) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (chars[++i] - 0xDC00u);
+            } else {
+                out += '?';
+                continue;
+            }
+        }
+        if (c < 0x80) {
+            out += (char)c;
+        } else if (c < 0x800) {
+            out += (char)(0xC0 | (c >> 6));
+            out += (char)(0x80 | (c & 0x3F));
+        } else if (c < 0x10000) {
+            out += (char)(0xE0 | (c >> 12));
+            out += (char)(0x80 | ((c >> 6) & 0x3F));
+            out += (char)(0x80 | (c & 0x3F));
+        } else {
+            out += (char)(0xF0 | (c >> 18));
+            out += (char)(0x80 | ((c >> 12) & 0x3F));
+            out += (char)(0x80 | ((c >> 6) & 0x3F));
+            out += (char)(0x80 | (c & 0x3F));
+        }
+    }
+    env->ReleaseStringChars(text, chars);
+    return out;
+}
+
+static SamplingConfig sampling_config(
+    jfloat temperature, jint topK, jfloat topP, jfloat minP, jfloat repeatPenalty, jint seed
+) {
+    SamplingConfig config;
+    config.temperature = (float)temperature;
+    config.top_k = (int)topK;
+    config.top_p = (float)topP;
+    config.min_p = (float)minP;
+    config.repeat_penalty = (float)repeatPenalty;
+    config.seed = (uint32_t)seed;
+    return config;
+}
+
+/**
+ * Copy the grammar and stop strings into a job, queue it and hand out its id
+ */
+static jlong submit_job(JNIEnv *env, std::shared_ptr<GenerateJob> job, jstring grammar, jobjectArray stopStrings) {
+    job->grammar = to_utf8(env, grammar);
+    const jsize n_stops = stopStrings ? env->GetArrayLength(stopStrings) : 0;
+    for (jsize i = 0; i < n_stops; i++) {
+        auto stop = (jstring)env->GetObjectArrayElement(stopStrings, i);
+        job->stop_strings.push_back(to_utf8(env, stop));
+        env->DeleteLocalRef(stop);
+    }
+
+    jlong id;
+    {
+        std::lock_guard<std::mutex> lock(g_jobs_mutex);
+        id = g_next_job_id++;
+        g_jobs[id] = job;
+    }
+    g_worker.submit(std::move(job));
+    return id;
+}
 
 extern "C" {
 
@@ -42,25 +202,24 @@ extern "C" {
  * Initialize the llama.cpp backend
  */
 JNIEXPORT void JNICALL
-Java_com_mathagent_LlamaEngine_nativeInit(JNIEnv *env, jobject /*this*/) {
-    llama_backend_init();
-    llama_log_set([](int level, const char *text, void *user_data) {
-        if (level >= LLAMA_LOG_LEVEL_ERROR) {
-            LOGE("%s", text);
-        } else if (level >= LLAMA_LOG_LEVEL_WARNING) {
-            LOGI("%s", text);
-        }
-    }, nullptr);
-    LOGI("llama.cpp backend initialized");
+Java_com_mathagent_LlamaEngine_nativeInit(JNIEnv * /*env*/, jobject /*this*/) {
+    init_backend();
 }
 
 /**
  * Load a GGUF model from file
  *
+ * Blocks until loaded; progress can be polled meanwhile with
+ * nativeLoadProgress and the load aborted with nativeCancelLoad. Touches
+ * no loaded engine, so a model can be loaded while another one serves.
+ *
  * @param modelPath Path to the GGUF model file
  * @param nCtx Context window size (tokens)
  * @param nGpuLayers Number of layers to offload to GPU (Vulkan)
- * @return Native pointer to model, or 0 on failure
+ * @param useMmap Map the file instead of reading it into memory
+ * @param useMlock Lock the weights in RAM so they are never paged out
+ * @param pageIn With mmap, fault the file in on a background thread
+ * @return Model handle, or 0 on failure
  */
 JNIEXPORT jlong JNICALL
 Java_com_mathagent_LlamaEngine_nativeLoadModel(
@@ -68,32 +227,58 @@ Java_com_mathagent_LlamaEngine_nativeLoadModel(
     jobject /*this*/,
     jstring modelPath,
     jint nCtx,
-    jint nGpuLayers
+    jint nGpuLayers,
+    jboolean useMmap,
+    jboolean useMlock,
+    jboolean pageIn
 ) {
-    const char *model_path_cstr = env->GetStringUTFChars(modelPath, nullptr);
-    LOGI("Loading model from: %s", model_path_cstr);
-    LOGI("Context size: %d, GPU layers: %d", nCtx, nGpuLayers);
+    const std::string path = to_utf8(env, modelPath);
+    LOGI("Context size: %d", nCtx);
 
-    // Configure model parameters
-    llama_model_params model_params = llama_model_default_params();
-    model_params.n_gpu_layers = (int)nGpuLayers;
+    ModelParams params;
+    params.n_gpu_layers = (int)nGpuLayers;
+    params.use_mmap = useMmap == JNI_TRUE;
+    params.use_mlock = useMlock == JNI_TRUE;
+    params.page_in = pageIn == JNI_TRUE;
 
-    // Load the model
-    llama_model *model = llama_load_model_from_file(model_path_cstr, model_params);
-    env->ReleaseStringUTFChars(modelPath, model_path_cstr);
+    std::shared_ptr<LoadedModel> loaded = load_model(path, params);
+    return loaded ? add_handle(g_models, std::move(loaded)) : 0;
+}
 
-    if (!model) {
-        LOGE("Failed to load model from: %s", model_path_cstr);
-        return 0;
-    }
+/**
+ * Progress of the model load in flight (or last finished), in [0, 1]
+ */
+JNIEXPORT jfloat JNICALL
+Java_com_mathagent_LlamaEngine_nativeLoadProgress(
+    JNIEnv * /*env*/,
+    jobject /*this*/
+) {
+    return g_load_progress.load(std::memory_order_relaxed);
+}
 
-    g_model = model;
-    LOGI("Model loaded successfully");
-    return reinterpret_cast<jlong>(model);
+/**
+ * Abort the model load in flight; nativeLoadModel then returns 0
+ */
+JNIEXPORT void JNICALL
+Java_com_mathagent_LlamaEngine_nativeCancelLoad(
+    JNIEnv * /*env*/,
+    jobject /*this*/
+) {
+    g_load_cancel.store(true, std::memory_order_relaxed);
 }
 
 /**
  * Initialize context for generation
+ *
+ * Creates an engine with its own sessions over the model; the model stays
+ * alive as long as the engine does, even after its handle is freed.
+ *
+ * @param nCtx Context size in tokens, capped at the model's training context
+ * @param nThreads Decode threads, or 0 for one per performance core (capped)
+ * @param nThreadsBatch Prefill threads, or 0 for one per performance core
+ * @param kvType KV cache type: 0 f16, 1 q8_0, 2 q4_0
+ * @param flashAttn Use flash attention (also required for a quantized V cache)
+ * @return Context handle, or 0 on failure
  */
 JNIEXPORT jlong JNICALL
 Java_com_mathagent_LlamaEngine_nativeInitContext(
@@ -102,212 +287,951 @@ Java_com_mathagent_LlamaEngine_nativeInitContext(
     jlong modelPtr,
     jint nCtx,
     jint nThreads,
-    jfloat temperature
+    jint nThreadsBatch,
+    jint nBatch,
+    jint nUbatch,
+    jfloat temperature,
+    jint kvType,
+    jboolean flashAttn
 ) {
-    if (!modelPtr) {
-        LOGE("Model pointer is null");
+    std::shared_ptr<LoadedModel> loaded = find_model(modelPtr);
+    if (!loaded) {
+        LOGE("Unknown model handle");
         return 0;
     }
 
-    llama_model *model = reinterpret_cast<llama_model *>(modelPtr);
+    EngineParams params;
+    params.n_ctx = (int)nCtx;
+    params.n_threads = (int)nThreads;
+    params.n_threads_batch = (int)nThreadsBatch;
+    params.n_batch = (int)nBatch;
+    params.n_ubatch = (int)nUbatch;
+    params.temperature = (float)temperature;
+    params.kv_type = (int)kvType;
+    params.flash_attn = flashAttn == JNI_TRUE;
 
-    // Configure context parameters
-    llama_context_params ctx_params = llama_context_default_params();
-    ctx_params.n_ctx = (int32_t)nCtx;
-    ctx_params.n_batch = DEFAULT_N_BATCH;
-    ctx_params.n_ubatch = DEFAULT_N_BATCH;
-    ctx_params.n_threads = (int)nThreads > 0 ? (int)nThreads : DEFAULT_N_THREADS;
-    ctx_params.n_threads_batch = ctx_params.n_threads;
+    std::shared_ptr<Engine> engine = create_engine(std::move(loaded), params);
+    return engine ? add_handle(g_engines, std::move(engine)) : 0;
+}
 
-    // Initialize context
-    llama_context *context = llama_init_from_model(model, ctx_params);
-    if (!context) {
-        LOGE("Failed to initialize context");
+/**
+ * KV cache bytes per context token for a loaded model
+ *
+ * Lets Kotlin size n_ctx to a memory budget before creating the context.
+ *
+ * @param kvType KV cache type: 0 f16, 1 q8_0, 2 q4_0
+ * @param flashAttn Whether flash attention will be on (quantizes V too)
+ */
+JNIEXPORT jlong JNICALL
+Java_com_mathagent_LlamaEngine_nativeKvBytesPerToken(
+    JNIEnv * /*env*/,
+    jobject /*this*/,
+    jlong modelPtr,
+    jint kvType,
+    jboolean flashAttn
+) {
+    std::shared_ptr<LoadedModel> loaded = find_model(modelPtr);
+    if (!loaded) {
         return 0;
     }
+    const ggml_type type_k = kv_type_from_id((int)kvType);
+    return (jlong)std::ceil(kv_bytes_per_token(loaded->model, type_k, v_type_for(type_k, flashAttn == JNI_TRUE)));
+}
 
-    // Initialize sampler
-    common_params_sampling sparams;
-    sparams.temp = temperature;
-    sparams.top_p = 0.95f;
-    sparams.top_k = 40;
-    g_sampler = common_sampler_init(model, sparams);
-    if (!g_sampler) {
-        LOGE("Failed to initialize sampler");
-        llama_free(context);
-        return 0;
+/**
+ * Memory held by the loaded model and context
+ *
+ * @return [model weight bytes, KV cache bytes, n_ctx, training context]
+ */
+JNIEXPORT jlongArray JNICALL
+Java_com_mathagent_LlamaEngine_nativeMemoryUsage(
+    JNIEnv *env,
+    jobject /*this*/,
+    jlong contextPtr
+) {
+    jlong usage[4] = { 0, 0, 0, 0 };
+    if (std::shared_ptr<Engine> engine = find_engine(contextPtr)) {
+        const llama_model *model = engine->model->model;
+        usage[0] = (jlong)llama_model_size(model);
+        usage[1] = (jlong)(kv_bytes_per_token(model, engine->type_k, engine->type_v) * llama_n_ctx(engine->context));
+        usage[2] = (jlong)llama_n_ctx(engine->context);
+        usage[3] = (jlong)llama_model_n_ctx_train(model);
     }
 
-    // Initialize batch
-    g_batch = llama_batch_init(DEFAULT_N_BATCH, 0, 1);
-
-    g_context = context;
-    LOGI("Context initialized with %d threads", ctx_params.n_threads);
-    return reinterpret_cast<jlong>(context);
+    jlongArray result = env->NewLongArray(4);
+    env->SetLongArrayRegion(result, 0, 4, usage);
+    return result;
 }
 
 /**
- * Tokenize a string
+ * Tokenize text with the model's vocabulary
+ *
+ * Needs no context or lock, so it can run alongside a generation.
+ *
+ * @param addSpecial Add BOS (and EOS where the vocabulary wants it)
+ * @param parseSpecial Map special-token text such as <|im_start|> to its token
+ * @return Token ids, empty if the model handle is unknown
  */
-JNIEXPORT jstring JNICALL
+JNIEXPORT jintArray JNICALL
 Java_com_mathagent_LlamaEngine_nativeTokenize(
     JNIEnv *env,
     jobject /*this*/,
     jlong modelPtr,
-    jstring text
+    jstring text,
+    jboolean addSpecial,
+    jboolean parseSpecial
+) {
+    std::shared_ptr<LoadedModel> loaded = find_model(modelPtr);
+    if (!loaded) {
+        return env->NewIntArray(0);
+    }
+
+    std::vector<llama_token> tokens = common_tokenize(
+        llama_model_get_vocab(loaded->model), to_utf8(env, text), addSpecial == JNI_TRUE, parseSpecial == JNI_TRUE);
+
+    static_assert(sizeof(llama_token) == sizeof(jint), "llama_token must match jint");
+    jintArray result = env->NewIntArray((jsize)tokens.size());
+    env->SetIntArrayRegion(result, 0, (jsize)tokens.size(), reinterpret_cast<const jint *>(tokens.data()));
+    return result;
+}
+
+/**
+ * Load a small draft model for speculative decoding
+ *
+ * The draft must share the target model's vocabulary (e.g. Qwen2.5-0.5B
+ * for Qwen2.5-Math-1.5B). Replaces the context's previous draft model.
+ *
+ * @param contextPtr Context the draft speculates for
+ * @param modelPath Path to the draft GGUF
+ * @param nCtx Draft context size (should match the target's)
+ * @param nThreads Threads for draft decoding, or 0 to match the target's decode threads
+ * @param nGpuLayers Draft layers to offload to GPU
+ * @param nDraft Maximum tokens drafted per step
+ * @return true if speculative decoding is now active
+ */
+JNIEXPORT jboolean JNICALL
+Java_com_mathagent_LlamaEngine_nativeLoadDraftModel(
+    JNIEnv *env,
+    jobject /*this*/,
+    jlong contextPtr,
+    jstring modelPath,
+    jint nCtx,
+    jint nThreads,
+    jint nGpuLayers,
+    jint nDraft
 ) {
-    if (!modelPtr) {
-        return env->NewStringUTF("");
+    std::shared_ptr<Engine> engine = find_engine(contextPtr);
+    if (!engine) {
+        LOGE("Load the target model before the draft model");
+        return JNI_FALSE;
     }
 
-    llama_model *model = reinterpret_cast<llama_model *>(modelPtr);
-    const char *text_cstr = env->GetStringUTFChars(text, nullptr);
+    const std::string path = to_utf8(env, modelPath);
 
-    // Tokenize
-    std::vector<llama_token> tokens = common_tokenize(model, text_cstr, true);
+    std::lock_guard<std::mutex> lock(engine->mutex);
+    return load_draft_model(*engine, path, (int)nCtx, (int)nThreads, (int)nGpuLayers, (int)nDraft)
+        ? JNI_TRUE : JNI_FALSE;
+}
+
+/**
+ * Free a context's draft model and disable speculative decoding
+ */
+JNIEXPORT void JNICALL
+Java_com_mathagent_LlamaEngine_nativeFreeDraftModel(
+    JNIEnv * /*env*/,
+    jobject /*this*/,
+    jlong contextPtr
+) {
+    std::shared_ptr<Engine> engine = find_engine(contextPtr);
+    if (!engine) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(engine->mutex);
+    free_draft_model(*engine);
+}
+
+/**
+ * Configure prompt-lookup (n-gram) speculative decoding
+ *
+ * @param enabled Whether to draft from n-grams already in the context
+ * @param ngramMin Shortest trailing n-gram to match
+ * @param ngramMax Longest trailing n-gram to match (tried first)
+ * @param nDraft Maximum tokens proposed per step
+ */
+JNIEXPORT void JNICALL
+Java_com_mathagent_LlamaEngine_nativeSetPromptLookup(
+    JNIEnv * /*env*/,
+    jobject /*this*/,
+    jboolean enabled,
+    jint ngramMin,
+    jint ngramMax,
+    jint nDraft
+) {
+    PromptLookupParams params;
+    params.enabled = enabled == JNI_TRUE;
+    params.ngram_min = std::max(1, (int)ngramMin);
+    params.ngram_max = std::max(params.ngram_min, (int)ngramMax);
+    params.n_draft = std::max(1, (int)nDraft);
+    set_lookup_params(params);
+}
+
+/**
+ * Speculative decoding statistics for the context's most recent generation
+ *
+ * @return [drafted tokens, accepted tokens, acceptance rate, effective tokens/s]
+ */
+JNIEXPORT jfloatArray JNICALL
+Java_com_mathagent_LlamaEngine_nativeSpeculativeStats(
+    JNIEnv *env,
+    jobject /*this*/,
+    jlong contextPtr
+) {
+    SpeculativeStats st = {};
+    if (std::shared_ptr<Engine> engine = find_engine(contextPtr)) {
+        std::lock_guard<std::mutex> lock(engine->mutex);
+        st = engine->spec_stats;
+    }
+    const jfloat stats[4] = {
+        (jfloat)st.n_drafted,
+        (jfloat)st.n_accepted,
+        st.n_drafted > 0 ? (jfloat)st.n_accepted / (jfloat)st.n_drafted : 0.0f,
+        st.t_generate_us > 0 ? (jfloat)st.n_generated * 1e6f / (jfloat)st.t_generate_us : 0.0f,
+    };
+
+    jfloatArray result = env->NewFloatArray(4);
+    env->SetFloatArrayRegion(result, 0, 4, stats);
+    return result;
+}
+
+/**
+ * Set the prompt prefill chunk size
+ *
+ * @param chunkSize Tokens per llama_decode call during prefill; values <= 0
+ *                  or above n_batch fall back to n_batch
+ */
+JNIEXPORT void JNICALL
+Java_com_mathagent_LlamaEngine_nativeSetPrefillChunk(
+    JNIEnv * /*env*/,
+    jobject /*this*/,
+    jint chunkSize
+) {
+    g_prefill_chunk.store((int)chunkSize, std::memory_order_relaxed);
+}
+
+/**
+ * Per-chunk timings of the context's most recent prompt prefill
+ *
+ * @return Flattened pairs of (tokens, milliseconds), one pair per chunk
+ */
+JNIEXPORT jfloatArray JNICALL
+Java_com_mathagent_LlamaEngine_nativePrefillTimings(
+    JNIEnv *env,
+    jobject /*this*/,
+    jlong contextPtr
+) {
+    std::vector<jfloat> flat;
+    if (std::shared_ptr<Engine> engine = find_engine(contextPtr)) {
+        std::lock_guard<std::mutex> lock(engine->mutex);
+        flat.reserve(engine->prefill_timings.size() * 2);
+        for (const auto &timing : engine->prefill_timings) {
+            flat.push_back((jfloat)timing.first);
+            flat.push_back(timing.second);
+        }
+    }
+
+    jfloatArray result = env->NewFloatArray((jsize)flat.size());
+    env->SetFloatArrayRegion(result, 0, (jsize)flat.size(), flat.data());
+    return result;
+}
+
+/**
+ * Time a synthetic prefill and decode on the current context
+ *
+ * Used to compare offload and thread settings. Runs in a scratch session
+ * that is freed afterwards, so no conversation state is touched.
+ *
+ * @param nPrompt Tokens to prefill (at most n_batch)
+ * @param nGen Tokens to decode one at a time after the prefill
+ * @return [prefill tokens/s, decode tokens/s], or empty on failure
+ */
+JNIEXPORT jfloatArray JNICALL
+Java_com_mathagent_LlamaEngine_nativeBenchmark(
+    JNIEnv *env,
+    jobject /*this*/,
+    jlong contextPtr,
+    jint nPrompt,
+    jint nGen
+) {
+    std::shared_ptr<Engine> engine = find_engine(contextPtr);
+    if (!engine || nPrompt <= 0 || nGen <= 0) {
+        return env->NewFloatArray(0);
+    }
 
-    env->ReleaseStringUTFChars(text, text_cstr);
+    std::lock_guard<std::mutex> lock(engine->mutex);
+    llama_context *context = engine->context;
+    llama_batch &batch = engine->batch;
+    if ((uint32_t)(nPrompt + nGen) >= llama_n_ctx(context)) {
+        LOGE("Benchmark of %d tokens does not fit the context", (int)(nPrompt + nGen));
+        return env->NewFloatArray(0);
+    }
+
+    Session *session = create_session(*engine);
+    if (!session) {
+        return env->NewFloatArray(0);
+    }
+    const int session_id = (int)session->seq_id;
 
-    // Return token count for now (can be expanded)
-    char result[64];
-    snprintf(result, sizeof(result), "%zu", tokens.size());
-    return env->NewStringUTF(result);
+    // Ordinary text tokens; the values do not matter for timing
+    const std::vector<llama_token> pattern = common_tokenize(context, "x^2 + 3x - 4 = 0, so ", false, false);
+    if (pattern.empty()) {
+        destroy_session(*engine, session_id);
+        return env->NewFloatArray(0);
+    }
+    std::vector<llama_token> tokens;
+    for (int i = 0; i < nPrompt + nGen; i++) {
+        tokens.push_back(pattern[i % pattern.size()]);
+    }
+    const std::vector<llama_token> prompt(tokens.begin(), tokens.begin() + std::min((uint32_t)nPrompt, llama_n_batch(context)));
+
+    const int64_t t_prefill = llama_time_us();
+    bool ok = prefill_tokens(*engine, *session, prompt, 0);
+    const int64_t t_decode = llama_time_us();
+
+    for (size_t i = prompt.size(); ok && i < prompt.size() + (size_t)nGen; i++) {
+        common_batch_clear(batch);
+        common_batch_add(batch, tokens[i], (llama_pos)i, { session->seq_id }, true);
+        ok = llama_decode(context, batch) == 0;
+    }
+    const int64_t t_end = llama_time_us();
+
+    destroy_session(*engine, session_id);
+    engine->prefill_timings.clear();
+
+    if (!ok) {
+        LOGE("Benchmark decode failed");
+        return env->NewFloatArray(0);
+    }
+
+    const jfloat rates[2] = {
+        (jfloat)(prompt.size() * 1e6 / std::max<int64_t>(t_decode - t_prefill, 1)),
+        (jfloat)(nGen * 1e6 / std::max<int64_t>(t_end - t_decode, 1)),
+    };
+    LOGI("Benchmark: prefill %.1f tok/s, decode %.1f tok/s", rates[0], rates[1]);
+
+    jfloatArray result = env->NewFloatArray(2);
+    env->SetFloatArrayRegion(result, 0, 2, rates);
+    return result;
+}
+
+/**
+ * Enable or disable grammar fast-forward
+ *
+ * When enabled, tokens the grammar forces (e.g. {"action": " once the
+ * object has started) are appended and decoded as one batch without
+ * sampling.
+ */
+JNIEXPORT void JNICALL
+Java_com_mathagent_LlamaEngine_nativeSetFastForward(
+    JNIEnv * /*env*/,
+    jobject /*this*/,
+    jboolean enabled
+) {
+    g_fast_forward.store(enabled == JNI_TRUE, std::memory_order_relaxed);
 }
 
 /**
- * Generate completion with streaming callback
+ * Warm the KV cache with a fixed prompt prefix, persisted across launches
+ *
+ * If statePath holds a saved sequence for exactly these tokens it is
+ * restored into the session's sequence; otherwise the prefix is decoded
+ * and saved there. The caller keys statePath by model, context params and prompt,
+ * so a file from a different configuration is never found.
  *
  * @param contextPtr Context pointer
+ * @param sessionId Session to warm
+ * @param prompt Prompt prefix (the system prompt)
+ * @param statePath File for the saved sequence state
+ * @return Number of tokens now cached, or -1 on failure
+ */
+JNIEXPORT jint JNICALL
+Java_com_mathagent_LlamaEngine_nativeWarmPrompt(
+    JNIEnv *env,
+    jobject /*this*/,
+    jlong contextPtr,
+    jint sessionId,
+    jstring prompt,
+    jstring statePath
+) {
+    std::shared_ptr<Engine> engine = find_engine(contextPtr);
+    if (!engine) {
+        LOGE("Unknown context handle");
+        return -1;
+    }
+
+    const std::string text = to_utf8(env, prompt);
+    const std::string path = to_utf8(env, statePath);
+
+    std::lock_guard<std::mutex> lock(engine->mutex);
+    return (jint)warm_prompt(*engine, (int)sessionId, text, path);
+}
+
+/**
+ * Create an empty session with its own KV sequence and samplers
+ *
+ * @return Session id, or -1 if all sessions are in use
+ */
+JNIEXPORT jint JNICALL
+Java_com_mathagent_LlamaEngine_nativeCreateSession(
+    JNIEnv * /*env*/,
+    jobject /*this*/,
+    jlong contextPtr
+) {
+    std::shared_ptr<Engine> engine = find_engine(contextPtr);
+    if (!engine) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(engine->mutex);
+    Session *session = create_session(*engine);
+    return session ? (jint)session->seq_id : -1;
+}
+
+/**
+ * Fork a session: the new one starts with a copy of the source's KV cache
+ *
+ * The copy shares the source's cells, so a system-prompt prefix warmed once
+ * costs no extra prefill or memory in each fork.
+ *
+ * @return New session id, or -1 on failure
+ */
+JNIEXPORT jint JNICALL
+Java_com_mathagent_LlamaEngine_nativeForkSession(
+    JNIEnv * /*env*/,
+    jobject /*this*/,
+    jlong contextPtr,
+    jint sourceId
+) {
+    std::shared_ptr<Engine> engine = find_engine(contextPtr);
+    if (!engine) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(engine->mutex);
+    if (!find_session(*engine, (int)sourceId)) {
+        LOGE("Cannot fork unknown session %d", (int)sourceId);
+        return -1;
+    }
+
+    Session *fork = create_session(*engine);
+    if (!fork) {
+        return -1;
+    }
+
+    // create_session may rehash the session map, so look the source up again
+    Session *source = find_session(*engine, (int)sourceId);
+    llama_kv_cache_seq_cp(engine->context, source->seq_id, fork->seq_id, -1, -1);
+    fork->tokens = source->tokens;
+    fork->n_keep = source->n_keep;
+    fork->evicted = source->evicted;
+
+    LOGI("Forked session %d into %d (%zu cached tokens)",
+         (int)sourceId, (int)fork->seq_id, fork->tokens.size());
+    return (jint)fork->seq_id;
+}
+
+/**
+ * Free a session's KV sequence and samplers
+ *
+ * The default session lives as long as the context and is only cleared.
+ */
+JNIEXPORT void JNICALL
+Java_com_mathagent_LlamaEngine_nativeFreeSession(
+    JNIEnv * /*env*/,
+    jobject /*this*/,
+    jlong contextPtr,
+    jint sessionId
+) {
+    std::shared_ptr<Engine> engine = find_engine(contextPtr);
+    if (!engine) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(engine->mutex);
+    if ((int)sessionId == DEFAULT_SESSION) {
+        clear_session(*engine, DEFAULT_SESSION);
+        return;
+    }
+    destroy_session(*engine, (int)sessionId);
+}
+
+/**
+ * Queue a generation on the decode thread
+ *
+ * Returns immediately; poll nativeJobState, drain text with
+ * nativeDrainStream and collect it with nativeJobResult. Every returned
+ * job must be passed to nativeReleaseJob, which also cancels it. The job
+ * keeps its context alive, so it finishes even if the handle is freed.
+ *
+ * @param contextPtr Context pointer
+ * @param sessionId Session whose KV sequence and samplers are used
  * @param prompt Input prompt
  * @param maxTokens Maximum tokens to generate
- * @param temperature Sampling temperature
+ * @param temperature Sampling temperature; <= 0 is greedy
+ * @param topK, topP, minP Candidate filters (0, 1 and 0 disable them)
+ * @param repeatPenalty Repetition penalty; 1 disables
+ * @param seed Sampling seed; -1 for random
  * @param grammar Optional GBNF grammar (null for none)
- * @param callback Java callback object for streaming
- * @return Generated text
+ * @param stopStrings Strings that end generation when they appear (may be null)
+ * @return Job id, or 0 on failure
  */
-JNIEXPORT jstring JNICALL
-Java_com_mathagent_LlamaEngine_nativeGenerate(
+JNIEXPORT jlong JNICALL
+Java_com_mathagent_LlamaEngine_nativeSubmitGenerate(
     JNIEnv *env,
     jobject /*this*/,
     jlong contextPtr,
+    jint sessionId,
     jstring prompt,
     jint maxTokens,
     jfloat temperature,
+    jint topK,
+    jfloat topP,
+    jfloat minP,
+    jfloat repeatPenalty,
+    jint seed,
     jstring grammar,
-    jobject callback
+    jobjectArray stopStrings
 ) {
-    if (!contextPtr || !g_model) {
-        LOGE("Context or model is null");
-        return env->NewStringUTF("");
+    std::shared_ptr<Engine> engine = find_engine(contextPtr);
+    if (!engine) {
+        LOGE("Unknown context handle");
+        return 0;
     }
 
-    llama_context *context = reinterpret_cast<llama_context *>(contextPtr);
-    const char *prompt_cstr = env->GetStringUTFChars(prompt, nullptr);
+    auto job = std::make_shared<GenerateJob>(STREAM_RING_BYTES);
+    job->engine = std::move(engine);
+    job->session_id = (int)sessionId;
+    job->max_tokens = (int)maxTokens;
+    job->sampling = sampling_config(temperature, topK, topP, minP, repeatPenalty, seed);
 
-    // Tokenize prompt
-    std::vector<llama_token> tokens = common_tokenize(g_model, prompt_cstr, true);
-    env->ReleaseStringUTFChars(prompt, prompt_cstr);
+    job->prompt = to_utf8(env, prompt);
+    return submit_job(env, std::move(job), grammar, stopStrings);
+}
 
-    LOGI("Tokenized prompt: %zu tokens", tokens.size());
+/**
+ * Queue a generation for an already tokenized prompt
+ *
+ * As nativeSubmitGenerate, but the prompt is taken as is, so callers that
+ * assemble prompts from cached token pieces skip tokenizing them again.
+ *
+ * @param tokens Prompt token ids (from nativeTokenize)
+ * @return Job id, or 0 on failure
+ */
+JNIEXPORT jlong JNICALL
+Java_com_mathagent_LlamaEngine_nativeSubmitGenerateTokens(
+    JNIEnv *env,
+    jobject /*this*/,
+    jlong contextPtr,
+    jint sessionId,
+    jintArray tokens,
+    jint maxTokens,
+    jfloat temperature,
+    jint topK,
+    jfloat topP,
+    jfloat minP,
+    jfloat repeatPenalty,
+    jint seed,
+    jstring grammar,
+    jobjectArray stopStrings
+) {
+    std::shared_ptr<Engine> engine = find_engine(contextPtr);
+    const jsize n_tokens = tokens ? env->GetArrayLength(tokens) : 0;
+    if (!engine || n_tokens == 0) {
+        LOGE("Unknown context handle or empty prompt");
+        return 0;
+    }
 
-    // Get callback class and method
-    jclass callbackClass = env->GetObjectClass(callback);
-    jmethodID onTokenMethod = env->GetMethodID(callbackClass, "onToken", "(Ljava/lang/String;)V");
+    auto job = std::make_shared<GenerateJob>(STREAM_RING_BYTES);
+    job->prompt_tokens.resize((size_t)n_tokens);
+    env->GetIntArrayRegion(tokens, 0, n_tokens, reinterpret_cast<jint *>(job->prompt_tokens.data()));
 
-    if (!onTokenMethod) {
-        LOGE("Failed to find onToken callback method");
+    // An out-of-range id would make llama_decode read past the embeddings
+    const int32_t n_vocab = llama_vocab_n_tokens(engine->vocab());
+    for (llama_token t : job->prompt_tokens) {
+        if (t < 0 || t >= n_vocab) {
+            LOGE("Prompt token %d is outside the vocabulary", (int)t);
+            return 0;
+        }
     }
 
-    // Reset sampler
-    common_sampler_reset(g_sampler);
+    job->engine = std::move(engine);
+    job->session_id = (int)sessionId;
+    job->max_tokens = (int)maxTokens;
+    job->sampling = sampling_config(temperature, topK, topP, minP, repeatPenalty, seed);
+    return submit_job(env, std::move(job), grammar, stopStrings);
+}
 
-    // Process prompt tokens
-    for (size_t i = 0; i < tokens.size(); i++) {
-        common_batch_add(g_batch, tokens[i], i, { 0 }, false);
+/**
+ * Append a UTF-8 segment to a session's native transcript
+ *
+ * Kotlin pushes only what is new (a user turn, a tool observation) and
+ * the bytes are read in place from the direct buffer, so a turn costs its
+ * own size rather than the whole history. Needs no engine lock, so it can
+ * run while a generation is in flight.
+ *
+ * @param buffer Direct ByteBuffer holding the segment from position 0
+ * @param length Segment length in bytes
+ * @param addSpecial Add BOS; only for the first segment
+ * @return Tokens appended, or -1 on failure
+ */
+JNIEXPORT jint JNICALL
+Java_com_mathagent_LlamaEngine_nativeTranscriptAppend(
+    JNIEnv *env,
+    jobject /*this*/,
+    jlong contextPtr,
+    jint sessionId,
+    jobject buffer,
+    jint length,
+    jboolean addSpecial
+) {
+    std::shared_ptr<Engine> engine = find_engine(contextPtr);
+    const char *bytes = buffer ? static_cast<const char *>(env->GetDirectBufferAddress(buffer)) : nullptr;
+    if (!engine || !bytes || length < 0 || (jlong)length > env->GetDirectBufferCapacity(buffer)) {
+        LOGE("Unknown context handle or bad transcript buffer");
+        return -1;
+    }
+    return (jint)transcript_append(*engine, (int)sessionId, std::string(bytes, (size_t)length),
+                                   addSpecial == JNI_TRUE);
+}
+
+/**
+ * Remove count tokens from a session's transcript, starting at token from
+ *
+ * @return Tokens left in the transcript
+ */
+JNIEXPORT jint JNICALL
+Java_com_mathagent_LlamaEngine_nativeTranscriptErase(
+    JNIEnv * /*env*/,
+    jobject /*this*/,
+    jlong contextPtr,
+    jint sessionId,
+    jint from,
+    jint count
+) {
+    std::shared_ptr<Engine> engine = find_engine(contextPtr);
+    if (!engine || from < 0 || count < 0) {
+        return 0;
     }
-    g_batch.logits[g_batch.n_tokens - 1] = true;
+    return (jint)transcript_erase(*engine, (int)sessionId, (size_t)from, (size_t)count);
+}
 
-    if (llama_decode(context, g_batch) != 0) {
-        LOGE("Failed to decode prompt");
-        return env->NewStringUTF("");
+/**
+ * Empty a session's transcript
+ */
+JNIEXPORT void JNICALL
+Java_com_mathagent_LlamaEngine_nativeTranscriptClear(
+    JNIEnv * /*env*/,
+    jobject /*this*/,
+    jlong contextPtr,
+    jint sessionId
+) {
+    if (std::shared_ptr<Engine> engine = find_engine(contextPtr)) {
+        transcript_clear(*engine, (int)sessionId);
     }
+}
 
-    // Generate response
-    std::string generated;
-    int n_generated = 0;
+/**
+ * Queue a generation whose prompt is the session's transcript as it
+ * stands now
+ *
+ * Later appends do not affect the queued job. Parameters as for
+ * nativeSubmitGenerate; maxTokens 0 only prefills the transcript.
+ *
+ * @return Job id, or 0 on failure (including an empty transcript)
+ */
+JNIEXPORT jlong JNICALL
+Java_com_mathagent_LlamaEngine_nativeSubmitGenerateTranscript(
+    JNIEnv *env,
+    jobject /*this*/,
+    jlong contextPtr,
+    jint sessionId,
+    jint maxTokens,
+    jfloat temperature,
+    jint topK,
+    jfloat topP,
+    jfloat minP,
+    jfloat repeatPenalty,
+    jint seed,
+    jstring grammar,
+    jobjectArray stopStrings
+) {
+    std::shared_ptr<Engine> engine = find_engine(contextPtr);
+    if (!engine) {
+        LOGE("Unknown context handle");
+        return 0;
+    }
 
-    while (n_generated < maxTokens) {
-        // Sample token
-        llama_token token = common_sampler_sample(g_sampler, context, g_batch.n_tokens - 1);
-        common_sampler_accept(g_sampler, token, true);
+    auto job = std::make_shared<GenerateJob>(STREAM_RING_BYTES);
+    job->prompt_tokens = transcript_tokens(*engine, (int)sessionId);
+    if (job->prompt_tokens.empty()) {
+        LOGE("Transcript of session %d is empty", (int)sessionId);
+        return 0;
+    }
 
-        // Convert token to string
-        char token_str[256] = {0 };
-        int n_chars = llama_token_to_piece(g_model, token, token_str, sizeof(token_str) - 1);
-        if (n_chars > 0) {
-            generated += std::string(token_str, n_chars);
+    job->engine = std::move(engine);
+    job->session_id = (int)sessionId;
+    job->max_tokens = (int)maxTokens;
+    job->sampling = sampling_config(temperature, topK, topP, minP, repeatPenalty, seed);
+    return submit_job(env, std::move(job), grammar, stopStrings);
+}
 
-            // Call Java callback
-            if (onTokenMethod) {
-                jstring token_jstr = env->NewStringUTF(token_str);
-                env->CallVoidMethod(callback, onTokenMethod, token_jstr);
-                env->DeleteLocalRef(token_jstr);
-            }
-        }
+/**
+ * @return 0 queued, 1 running, 2 done (finished, failed or cancelled), -1 unknown job
+ */
+JNIEXPORT jint JNICALL
+Java_com_mathagent_LlamaEngine_nativeJobState(
+    JNIEnv * /*env*/,
+    jobject /*this*/,
+    jlong jobId
+) {
+    std::shared_ptr<GenerateJob> job = find_job(jobId);
+    return job ? (jint)job->state.load(std::memory_order_acquire) : -1;
+}
 
-        n_generated++;
+/**
+ * Full generated text of a finished job as standard UTF-8 bytes
+ *
+ * Empty until the job is done.
+ */
+JNIEXPORT jbyteArray JNICALL
+Java_com_mathagent_LlamaEngine_nativeJobResult(
+    JNIEnv *env,
+    jobject /*this*/,
+    jlong jobId
+) {
+    std::shared_ptr<GenerateJob> job = find_job(jobId);
+    if (!job || job->state.load(std::memory_order_acquire) != GenerateJob::DONE) {
+        return env->NewByteArray(0);
+    }
+    return to_utf8_bytes(env, job->result);
+}
 
-        // Check for EOS
-        if (token == llama_token_eos(g_model)) {
-            LOGI("EOS token reached");
-            break;
-        }
+/**
+ * Per-generation counters of a finished job
+ *
+ * Times are in milliseconds. Empty until the job is done.
+ *
+ * @return [stop reason, prompt tokens, tokens reused from the KV cache,
+ *          prefill tokens, generated tokens, tokenize, prefill, decode,
+ *          decode per token p50, decode per token p99, sampling, grammar,
+ *          stream, total]; stop reason is a GenerationMetrics::StopReason
+ */
+JNIEXPORT jfloatArray JNICALL
+Java_com_mathagent_LlamaEngine_nativeJobMetrics(
+    JNIEnv *env,
+    jobject /*this*/,
+    jlong jobId
+) {
+    std::shared_ptr<GenerateJob> job = find_job(jobId);
+    if (!job || job->state.load(std::memory_order_acquire) != GenerateJob::DONE) {
+        return env->NewFloatArray(0);
+    }
 
-        // Prepare next batch
-        common_batch_clear(g_batch);
-        common_batch_add(g_batch, token, g_batch.n_tokens, { 0 }, true);
+    const GenerationMetrics &m = job->metrics;
+    GenerationMetrics::StopReason stop_reason = m.stop_reason;
+    if (stop_reason == GenerationMetrics::STOP_NONE && job->cancelled.load(std::memory_order_acquire)) {
+        stop_reason = GenerationMetrics::STOP_CANCELLED;
+    }
 
-        // Decode
-        if (llama_decode(context, g_batch) != 0) {
-            LOGE("Failed to decode generation");
-            break;
+    std::vector<float> per_token = m.decode_token_us;
+    auto percentile = [&per_token](double p) {
+        if (per_token.empty()) {
+            return 0.0f;
         }
-    }
+        const size_t i = std::min(per_token.size() - 1, (size_t)(p * (double)per_token.size()));
+        std::nth_element(per_token.begin(), per_token.begin() + i, per_token.end());
+        return per_token[i];
+    };
+    auto ms = [](int64_t us) { return (jfloat)us / 1000.0f; };
 
-    LOGI("Generated %d tokens", n_generated);
-    return env->NewStringUTF(generated.c_str());
+    const jfloat values[14] = {
+        (jfloat)stop_reason,
+        (jfloat)m.prompt_tokens,
+        (jfloat)m.reused_tokens,
+        (jfloat)m.prefill_tokens,
+        (jfloat)m.generated_tokens,
+        ms(m.tokenize_us),
+        ms(m.prefill_us),
+        ms(m.decode_us),
+        percentile(0.50) / 1000.0f,
+        percentile(0.99) / 1000.0f,
+        ms(m.sample_us),
+        ms(m.grammar_us),
+        ms(m.stream_us),
+        ms(m.total_us),
+    };
+
+    jfloatArray result = env->NewFloatArray(14);
+    env->SetFloatArrayRegion(result, 0, 14, values);
+    return result;
 }
 
 /**
- * Free context resources
+ * Cancel a job if it is still queued or running, and forget it
+ *
+ * A running job stops before its next decode step; the decode thread
+ * drops its own reference when it gets there.
  */
 JNIEXPORT void JNICALL
-Java_com_mathagent_LlamaEngine_nativeFreeContext(
+Java_com_mathagent_LlamaEngine_nativeReleaseJob(
     JNIEnv * /*env*/,
     jobject /*this*/,
-    jlong contextPtr
+    jlong jobId
+) {
+    std::shared_ptr<GenerateJob> job;
+    {
+        std::lock_guard<std::mutex> lock(g_jobs_mutex);
+        auto it = g_jobs.find(jobId);
+        if (it == g_jobs.end()) {
+            return;
+        }
+        job = std::move(it->second);
+        g_jobs.erase(it);
+    }
+
+    if (job->state.load(std::memory_order_acquire) != GenerateJob::DONE) {
+        LOGI("Cancelling generation job %lld", (long long)jobId);
+        g_worker.cancel(*job);
+    }
+}
+
+/**
+ * Drain a job's streamed text into a direct ByteBuffer
+ *
+ * Safe to call from any thread while the job runs. Only whole UTF-8 code
+ * points are returned; a partial sequence waits for the next call.
+ *
+ * @param jobId Job from nativeSubmitGenerate
+ * @param buffer Direct ByteBuffer to fill from position 0
+ * @return Number of bytes written into buffer
+ */
+JNIEXPORT jint JNICALL
+Java_com_mathagent_LlamaEngine_nativeDrainStream(
+    JNIEnv *env,
+    jobject /*this*/,
+    jlong jobId,
+    jobject buffer
+) {
+    std::shared_ptr<GenerateJob> job = find_job(jobId);
+    if (!job) {
+        return 0;
+    }
+
+    auto *out = static_cast<char *>(env->GetDirectBufferAddress(buffer));
+    jlong capacity = env->GetDirectBufferCapacity(buffer);
+    if (!out || capacity <= 0) {
+        LOGE("Stream buffer is not a direct ByteBuffer");
+        return 0;
+    }
+    return (jint)job->stream.read_utf8(out, (size_t)capacity);
+}
+
+/**
+ * Generate completions for several independent prompts in one batch
+ *
+ * Blocks until every prompt is done. Each prompt is its own sequence with
+ * its own sampler in a scratch context (sessions are untouched), and each
+ * decode step covers all unfinished sequences at once, so throughput grows
+ * with the number of prompts. Holds the engine for the whole call, so
+ * interactive generations wait; meant for offline evaluation.
+ *
+ * @param prompts At most MAX_BATCH_SEQUENCES prompts
+ * @param grammar Optional GBNF grammar applied to every sequence (null for none)
+ * @param stopStrings Strings that end a sequence when they appear (may be null)
+ * @param nGenerated Filled with the tokens generated per prompt
+ * @return One UTF-8 byte[] per prompt, or null on failure
+ */
+JNIEXPORT jobjectArray JNICALL
+Java_com_mathagent_LlamaEngine_nativeGenerateBatch(
+    JNIEnv *env,
+    jobject /*this*/,
+    jlong contextPtr,
+    jobjectArray prompts,
+    jint maxTokens,
+    jfloat temperature,
+    jstring grammar,
+    jobjectArray stopStrings,
+    jintArray nGenerated
 ) {
-    if (contextPtr) {
-        llama_context *context = reinterpret_cast<llama_context *>(contextPtr);
-        llama_free(context);
-        LOGI("Context freed");
+    std::shared_ptr<Engine> engine = find_engine(contextPtr);
+    const jsize n_prompts = prompts ? env->GetArrayLength(prompts) : 0;
+    if (!engine || n_prompts == 0 || n_prompts > MAX_BATCH_SEQUENCES || maxTokens <= 0) {
+        LOGE("Invalid batch of %d prompts", (int)n_prompts);
+        return nullptr;
     }
 
-    if (g_sampler) {
-        common_sampler_free(g_sampler);
-        g_sampler = nullptr;
+    auto strings = [env](jobjectArray array) {
+        std::vector<std::string> out;
+        const jsize n = array ? env->GetArrayLength(array) : 0;
+        for (jsize i = 0; i < n; i++) {
+            auto str = (jstring)env->GetObjectArrayElement(array, i);
+            out.push_back(to_utf8(env, str));
+            env->DeleteLocalRef(str);
+        }
+        return out;
+    };
+    const std::vector<std::string> texts = strings(prompts);
+    const std::vector<std::string> stops = strings(stopStrings);
+    const std::string grammar_text = to_utf8(env, grammar);
+
+    std::vector<int> counts;
+    std::vector<std::string> results;
+    bool ok;
+    {
+        std::lock_guard<std::mutex> lock(engine->mutex);
+        ok = generate_batch(*engine, texts, (int)maxTokens, (float)temperature, grammar_text, stops, results, counts);
+    }
+    if (!ok) {
+        return nullptr;
     }
 
-    if (g_batch.n_tokens > 0) {
-        llama_batch_free(g_batch);
-        g_batch = {};
+    if (nGenerated && env->GetArrayLength(nGenerated) >= n_prompts) {
+        std::vector<jint> n(counts.begin(), counts.end());
+        env->SetIntArrayRegion(nGenerated, 0, n_prompts, n.data());
     }
 
-    g_context = nullptr;
+    jobjectArray out = env->NewObjectArray(n_prompts, env->FindClass("[B"), nullptr);
+    for (jsize i = 0; i < n_prompts; i++) {
+        jbyteArray bytes = to_utf8_bytes(env, results[i]);
+        env->SetObjectArrayElement(out, i, bytes);
+        env->DeleteLocalRef(bytes);
+    }
+    return out;
 }
 
 /**
- * Free model resources
+ * Free a context handle
+ *
+ * The context, its sessions and its draft model are freed once no job
+ * holds them either. With cancelJobs its queued and running jobs are
+ * cancelled first; without, they finish on the old context, which is how
+ * a model swap keeps serving.
+ */
+JNIEXPORT void JNICALL
+Java_com_mathagent_LlamaEngine_nativeFreeContext(
+    JNIEnv * /*env*/,
+    jobject /*this*/,
+    jlong contextPtr,
+    jboolean cancelJobs
+) {
+    std::shared_ptr<Engine> engine = release_handle(g_engines, contextPtr);
+    if (engine && cancelJobs == JNI_TRUE) {
+        cancel_engine_jobs(engine.get());
+    }
+}
+
+/**
+ * Free a model handle
+ *
+ * The weights are freed once no context built on them is left.
  */
 JNIEXPORT void JNICALL
 Java_com_mathagent_LlamaEngine_nativeFreeModel(
@@ -315,24 +1239,26 @@ Java_com_mathagent_LlamaEngine_nativeFreeModel(
     jobject /*this*/,
     jlong modelPtr
 ) {
-    if (modelPtr) {
-        llama_model *model = reinterpret_cast<llama_model *>(modelPtr);
-        llama_free_model(model);
-        LOGI("Model freed");
-    }
-    g_model = nullptr;
+    release_handle(g_models, modelPtr);
 }
 
 /**
- * Get system information
+ * Get system information, including the CPU layout and thread choice
  */
 JNIEXPORT jstring JNICALL
 Java_com_mathagent_LlamaEngine_nativeSystemInfo(
     JNIEnv *env,
-    jobject /*this*/
+    jobject /*this*/,
+    jlong contextPtr
 ) {
-    const char *info = llama_print_system_info();
-    return env->NewStringUTF(info);
+    std::string info = llama_print_system_info();
+    info += "\nCPU: " + g_cpu.describe();
+    if (std::shared_ptr<Engine> engine = find_engine(contextPtr)) {
+        info += "\nThreads: " + std::to_string(llama_n_threads(engine->context)) + " decode, "
+              + std::to_string(llama_n_threads_batch(engine->context)) + " prefill";
+        info += engine->threadpool ? " (pinned to performance cores)" : " (unpinned)";
+    }
+    return env->NewStringUTF(info.c_str());
 }
 
 /**
@@ -347,4 +1273,119 @@ Java_com_mathagent_LlamaEngine_nativeShutdown(
     LOGI("Backend shutdown");
 }
 
+// --------------------------------------------------------------------------
+// Embeddings
+// --------------------------------------------------------------------------
+
+/**
+ * Create an embeddings-only context over a loaded model
+ *
+ * The model may be the chat model (its handle from nativeLoadModel) or a
+ * dedicated embedding GGUF; either stays alive while the embedder does.
+ *
+ * @param nCtx Longest input in tokens, or 0 for the default
+ * @param nThreads Threads, or 0 for the default
+ * @return Embedder handle, or 0 on failure
+ */
+JNIEXPORT jlong JNICALL
+Java_com_mathagent_LlamaEngine_nativeCreateEmbedder(
+    JNIEnv * /*env*/,
+    jobject /*this*/,
+    jlong modelPtr,
+    jint nCtx,
+    jint nThreads
+) {
+    std::shared_ptr<LoadedModel> model = find_model(modelPtr);
+    if (!model) {
+        LOGE("Unknown model handle");
+        return 0;
+    }
+    std::shared_ptr<Embedder> embedder = create_embedder(std::move(model), (int)nCtx, (int)nThreads);
+    return embedder ? add_handle(g_embedders, std::move(embedder)) : 0;
+}
+
+/**
+ * @return Dimensions of the embedder's vectors, or 0 for an unknown handle
+ */
+JNIEXPORT jint JNICALL
+Java_com_mathagent_LlamaEngine_nativeEmbeddingSize(
+    JNIEnv * /*env*/,
+    jobject /*this*/,
+    jlong embedderPtr
+) {
+    std::shared_ptr<Embedder> embedder = find_embedder(embedderPtr);
+    return embedder ? (jint)embedder->n_embd : 0;
+}
+
+/**
+ * Embed a text into out (nativeEmbeddingSize floats, L2-normalized)
+ *
+ * @return Floats written, or -1 on failure
+ */
+JNIEXPORT jint JNICALL
+Java_com_mathagent_LlamaEngine_nativeEmbed(
+    JNIEnv *env,
+    jobject /*this*/,
+    jlong embedderPtr,
+    jstring text,
+    jfloatArray out
+) {
+    std::shared_ptr<Embedder> embedder = find_embedder(embedderPtr);
+    if (!embedder || !out || env->GetArrayLength(out) < embedder->n_embd) {
+        LOGE("Unknown embedder handle or output too small");
+        return -1;
+    }
+
+    const std::string input = to_utf8(env, text);
+
+    std::vector<float> embedding;
+    if (!embed_text(*embedder, input, embedding)) {
+        return -1;
+    }
+    env->SetFloatArrayRegion(out, 0, (jsize)embedding.size(), embedding.data());
+    return (jint)embedding.size();
+}
+
+JNIEXPORT void JNICALL
+Java_com_mathagent_LlamaEngine_nativeFreeEmbedder(
+    JNIEnv * /*env*/,
+    jobject /*this*/,
+    jlong embedderPtr
+) {
+    release_handle(g_embedders, embedderPtr);
+}
+
+// --------------------------------------------------------------------------
+// Calculator
+// --------------------------------------------------------------------------
+
+/**
+ * Evaluate an arithmetic expression (see ExpressionEvaluator)
+ *
+ * Needs no model or backend.
+ *
+ * @param fraction Receives numerator and denominator if the value is an
+ *                 exact rational, else a denominator of 0
+ * @return The value, or NaN if the expression is not understood
+ */
+JNIEXPORT jdouble JNICALL
+Java_com_mathagent_NativeCalculator_nativeEvaluate(
+    JNIEnv *env,
+    jobject /*this*/,
+    jstring expression,
+    jlongArray fraction
+) {
+    const ExpressionEvaluator::Result result = ExpressionEvaluator::evaluate(to_utf8(env, expression));
+
+    if (!result.ok) {
+        LOGD("Native evaluation failed at %zu: %s", result.error_pos, result.error.c_str());
+        return NAN;
+    }
+    if (fraction && env->GetArrayLength(fraction) >= 2) {
+        const jlong parts[2] = { (jlong)result.num, result.exact ? (jlong)result.den : 0 };
+        env->SetLongArrayRegion(fraction, 0, 2, parts);
+    }
+    return result.value;
+}
+
 } // extern "C"
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <thread>
+
+/**
+ * Background page-in of a memory-mapped model file
+ *
+ * llama.cpp maps the GGUF and faults weights in on first use, so the first
+ * generation after a cold start stalls on storage. This maps the same file
+ * (sharing the page cache), asks the kernel to read it ahead and touches
+ * one byte per page on a low-priority thread, so the faults happen while
+ * the UI is still coming up.
+ */
+class PageIn {
+public:
+    ~PageIn() {
+        stop();
+    }
+
+    void start(const std::string &path) {
+        stop();
+        stop_.store(false, std::memory_order_relaxed);
+        done_.store(false, std::memory_order_relaxed);
+        thread_ = std::thread(&PageIn::run, this, path);
+    }
+
+    /**
+     * Abandon any page-in still running and wait for the thread
+     */
+    void stop() {
+        stop_.store(true, std::memory_order_relaxed);
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    bool done() const {
+        return done_.load(std::memory_order_acquire);
+    }
+
+private:
+    static constexpr size_t CHUNK_BYTES = 4 << 20;
+
+    void run(std::string path) {
+        nice(10);
+
+        const int fd = open(path.c_str(), O_RDONLY);
+        struct stat st = {};
+        if (fd < 0 || fstat(fd, &st) != 0 || st.st_size <= 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            done_.store(true, std::memory_order_release);
+            return;
+        }
+
+        const size_t size = (size_t)st.st_size;
+        void *addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            done_.store(true, std::memory_order_release);
+            return;
+        }
+
+        auto *bytes = static_cast<const volatile unsigned char *>(addr);
+        const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        unsigned char sink = 0;
+        for (size_t offset = 0; offset < size && !stop_.load(std::memory_order_relaxed); offset += CHUNK_BYTES) {
+            const size_t len = std::min(CHUNK_BYTES, size - offset);
+            madvise(const_cast<unsigned char *>(bytes) + offset, len, MADV_WILLNEED);
+            for (size_t i = 0; i < len; i += page) {
+                sink ^= bytes[offset + i];
+            }
+        }
+        (void)sink;
+
+        munmap(addr, size);
+        done_.store(true, std::memory_order_release);
+    }
+
+    std::thread thread_;
+    std::atomic<bool> stop_{false};
+    std::atomic<bool> done_{false};
+};
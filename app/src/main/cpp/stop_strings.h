@@ -0,0 +1,98 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Incremental stop-string matcher over streamed text
+ *
+ * Text is pushed as it is detokenized. Any tail that could still grow into
+ * a stop string is held back, so a stop string split across tokens is
+ * never streamed to the caller. Once a stop string is complete, the text
+ * before it is released and the matcher reports the stop.
+ */
+class StopStringMatcher {
+public:
+    explicit StopStringMatcher(std::vector<std::string> stops) : stops_(std::move(stops)) {
+        stops_.erase(
+            std::remove_if(stops_.begin(), stops_.end(), [](const std::string &s) { return s.empty(); }),
+            stops_.end());
+    }
+
+    /**
+     * Append text and return the part that can be streamed now
+     *
+     * The view is valid until the next call to push() or flush().
+     */
+    std::string_view push(std::string_view text) {
+        if (stopped_) {
+            return {};
+        }
+        compact();
+        pending_.append(text);
+        if (stops_.empty()) {
+            released_ = pending_.size();
+            return pending_;
+        }
+
+        // Earliest complete match wins
+        size_t match = std::string::npos;
+        for (const std::string &stop : stops_) {
+            match = std::min(match, pending_.find(stop));
+        }
+        if (match != std::string::npos) {
+            stopped_ = true;
+            pending_.resize(match);
+            released_ = match;
+            return pending_;
+        }
+
+        released_ = pending_.size() - held_tail();
+        return std::string_view(pending_.data(), released_);
+    }
+
+    /**
+     * Release any held-back text at the end of a generation
+     */
+    std::string_view flush() {
+        if (stopped_) {
+            return {};
+        }
+        compact();
+        released_ = pending_.size();
+        return pending_;
+    }
+
+    bool stopped() const {
+        return stopped_;
+    }
+
+private:
+    // Longest suffix of pending_ that is a proper prefix of some stop string
+    size_t held_tail() const {
+        size_t held = 0;
+        for (const std::string &stop : stops_) {
+            const size_t max = std::min(stop.size() - 1, pending_.size());
+            for (size_t k = max; k > held; k--) {
+                if (pending_.compare(pending_.size() - k, k, stop, 0, k) == 0) {
+                    held = k;
+                    break;
+                }
+            }
+        }
+        return held;
+    }
+
+    // Drop the text returned by the last push()
+    void compact() {
+        pending_.erase(0, released_);
+        released_ = 0;
+    }
+
+    std::vector<std::string> stops_;
+    std::string pending_;
+    size_t released_ = 0;
+    bool stopped_ = false;
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "utf8_stream.h"
+
+/**
+ * Lock-free single-producer / single-consumer ring buffer of UTF-8 bytes
+ *
+ * The decode loop writes generated text into the ring without touching JNI;
+ * the Kotlin side drains it in batches from another thread. Indices grow
+ * monotonically and are masked on access.
+ */
+class TokenRing {
+public:
+    /**
+     * @param capacity Capacity in bytes, rounded up to a power of two
+     */
+    explicit TokenRing(size_t capacity) {
+        size_t rounded = 1;
+        while (rounded < capacity) {
+            rounded <<= 1;
+        }
+        buffer_.resize(rounded);
+        mask_ = rounded - 1;
+    }
+
+    /**
+     * Producer: append all of data, waiting for the consumer if the ring is full
+     *
+     * While the ring is full the producer sleeps, which pauses decoding until
+     * the consumer catches up instead of spinning a core.
+     *
+     * @return false if abort was set before everything was written
+     */
+    bool write(const char *data, size_t len, const std::atomic<bool> &abort) {
+        while (len > 0) {
+            const size_t head = head_.load(std::memory_order_relaxed);
+            const size_t tail = tail_.load(std::memory_order_acquire);
+            const size_t space = buffer_.size() - (head - tail);
+            if (space == 0) {
+                if (abort.load(std::memory_order_acquire)) {
+                    return false;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+
+            const size_t n = std::min(len, space);
+            copy_in(head, data, n);
+            head_.store(head + n, std::memory_order_release);
+            data += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    /**
+     * Consumer: move up to max bytes into out, ending on a code point boundary
+     *
+     * A UTF-8 sequence cut off by max (or not yet fully written) stays in the
+     * ring for the next read.
+     *
+     * @return Number of bytes copied
+     */
+    size_t read_utf8(char *out, size_t max) {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        const size_t head = head_.load(std::memory_order_acquire);
+        size_t n = std::min(head - tail, max);
+        if (n == 0) {
+            return 0;
+        }
+
+        copy_out(tail, out, n);
+        n -= utf8_incomplete_tail(out, n);
+        tail_.store(tail + n, std::memory_order_release);
+        return n;
+    }
+
+    /**
+     * Bytes written but not yet read
+     */
+    size_t size() const {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+    }
+
+private:
+    void copy_in(size_t pos, const char *data, size_t n) {
+        const size_t offset = pos & mask_;
+        const size_t first = std::min(n, buffer_.size() - offset);
+        memcpy(buffer_.data() + offset, data, first);
+        memcpy(buffer_.data(), data + first, n - first);
+    }
+
+    void copy_out(size_t pos, char *out, size_t n) const {
+        const size_t offset = pos & mask_;
+        const size_t first = std::min(n, buffer_.size() - offset);
+        memcpy(out, buffer_.data() + offset, first);
+        memcpy(out + first, buffer_.data(), n - first);
+    }
+
+    std::vector<char> buffer_;
+    size_t mask_ = 0;
+    alignas(64) std::atomic<size_t> head_{0};   // Written by the producer
+    alignas(64) std::atomic<size_t> tail_{0};   // Written by the consumer
+};
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#include "llama.h"
+
+/**
+ * Number of bytes at the end of bytes[0:n] that start a UTF-8 sequence
+ * which is still missing continuation bytes
+ *
+ * Returns 0 when the data ends on a code point boundary, or when the tail
+ * is malformed (it can never become valid, so holding it back is pointless).
+ */
+inline size_t utf8_incomplete_tail(const char *bytes, size_t n) {
+    // The lead byte of an unfinished sequence is at most 3 bytes back
+    for (size_t back = 1; back <= 3 && back <= n; back++) {
+        const unsigned char c = (unsigned char)bytes[n - back];
+        if ((c & 0xC0) == 0x80) {
+            continue;
+        }
+
+        size_t expected = 1;
+        if ((c & 0xE0) == 0xC0) {
+            expected = 2;
+        } else if ((c & 0xF0) == 0xE0) {
+            expected = 3;
+        } else if ((c & 0xF8) == 0xF0) {
+            expected = 4;
+        }
+        return expected > back ? back : 0;
+    }
+    return 0;
+}
+
+/**
+ * Incremental detokenizer that only ever emits complete UTF-8 code points
+ *
+ * Byte-level BPE vocabularies split multi-byte characters (√, π, ≤, CJK)
+ * across tokens. Each piece is rendered into one reusable buffer behind any
+ * bytes held back from the previous token, and only the complete prefix is
+ * returned. No allocation happens once the buffer has grown to fit the
+ * longest piece.
+ */
+class Utf8Detokenizer {
+public:
+    explicit Utf8Detokenizer(const llama_vocab *vocab) : vocab_(vocab), buffer_(64) {}
+
+    /**
+     * Forget held-back bytes before a new generation
+     */
+    void reset() {
+        pending_ = 0;
+        emitted_ = 0;
+    }
+
+    /**
+     * Append a token and return the newly completed text
+     *
+     * The view is valid until the next call to push(), flush() or reset().
+     */
+    std::string_view push(llama_token token) {
+        compact();
+
+        int32_t n = render(token);
+        if (n < 0) {
+            buffer_.resize(pending_ + (size_t)(-n));
+            n = render(token);
+        }
+        if (n <= 0) {
+            return {};
+        }
+
+        const size_t total = pending_ + (size_t)n;
+        const size_t held = utf8_incomplete_tail(buffer_.data(), total);
+        emitted_ = total - held;
+        pending_ = held;
+        return std::string_view(buffer_.data(), emitted_);
+    }
+
+    /**
+     * Emit anything still held back at the end of a generation
+     *
+     * An unfinished sequence can no longer complete, so it becomes U+FFFD.
+     */
+    std::string_view flush() {
+        if (pending_ == 0) {
+            return {};
+        }
+        reset();
+        return std::string_view("\xEF\xBF\xBD", 3);
+    }
+
+private:
+    int32_t render(llama_token token) {
+        return llama_token_to_piece(
+            vocab_, token,
+            buffer_.data() + pending_, (int32_t)(buffer_.size() - pending_),
+            0, true);
+    }
+
+    // Move held-back bytes from behind the last emitted text to the front
+    void compact() {
+        if (emitted_ > 0 && pending_ > 0) {
+            memmove(buffer_.data(), buffer_.data() + emitted_, pending_);
+        }
+        emitted_ = 0;
+    }
+
+    const llama_vocab *vocab_;
+    std::vector<char> buffer_;
+    size_t pending_ = 0;    // Held-back bytes of an unfinished code point
+    size_t emitted_ = 0;    // Bytes returned by the last push()
+};
@@ -1,7 +1,23 @@
 package com.mathagent
 
+import android.app.ActivityManager
 import android.content.Context
+import android.content.SharedPreferences
+import android.os.Build
+import kotlinx.coroutines.CancellationException
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.async
+import kotlinx.coroutines.coroutineScope
+import kotlinx.coroutines.currentCoroutineContext
+import kotlinx.coroutines.delay
+import kotlinx.coroutines.ensureActive
+import kotlinx.coroutines.withContext
 import java.io.File
+import java.io.RandomAccessFile
+import java.nio.ByteBuffer
+import java.nio.CharBuffer
+import java.nio.charset.CodingErrorAction
+import java.security.MessageDigest
 
 /**
  * JNI wrapper for llama.cpp
@@ -12,6 +28,10 @@ import java.io.File
  *
  * IMPORTANT: Always call close() when done to free native memory.
  * Use try-finally or implement AutoCloseable pattern in calling code.
+ *
+ * Native model and context handles are reference counted: a generation
+ * keeps the context it started on alive, so swapModel() can replace the
+ * model while one is still running.
  */
 class LlamaEngine(private val context: Context) : AutoCloseable {
 
@@ -22,16 +42,115 @@ class LlamaEngine(private val context: Context) : AutoCloseable {
 
         // Model parameters for Qwen2.5-Math-1.5B-Q4_K_M
         internal const val N_CTX = 2048          // Context window
+        const val CTX_FROM_BUDGET = 0           // ContextConfig.nCtx: size n_ctx to free RAM
         internal const val N_GPU_LAYERS = 99    // Offload all to GPU (Vulkan)
-        internal const val N_THREADS = 8        // Tensor G2 has 8 CPU cores
+        internal const val N_THREADS = 0        // Decode threads; 0 = performance cores (from sysfs), capped at 4
+        internal const val N_THREADS_BATCH = 0  // Prefill threads; 0 = all performance cores
+        internal const val N_BATCH = 512        // Max tokens per llama_decode call
+        internal const val N_UBATCH = 512       // Physical batch; tune per backend/SoC
         internal const val MAX_TOKENS = 512     // Max tokens per generation
         internal const val TEMPERATURE = 0.7f
+
+        // Generation ends (without emitting the match) at any of these
+        val DEFAULT_STOP_STRINGS = listOf("<|im_end|>", "\nObservation:")
+        internal const val N_DRAFT = 8          // Max tokens drafted per speculative step
+        internal const val LOOKUP_NGRAM_MIN = 2 // Shortest n-gram matched by prompt lookup
+        internal const val LOOKUP_NGRAM_MAX = 4 // Longest n-gram matched by prompt lookup
+
+        // generateBatch(): prompts decoded side by side per native call
+        internal const val BATCH_SIZE = 8
+        const val MAX_BATCH_SIZE = 16           // Native limit (MAX_BATCH_SEQUENCES)
+
+        // Sessions are KV sequences of the shared context (n_seq_max)
+        const val DEFAULT_SESSION = 0           // Created with the context, never freed
+        internal const val MAX_SESSIONS = 4
+
+        // Saved prompt KV state, stored next to the GGUF as <model>.<key>.kvstate
+        internal const val PROMPT_STATE_EXTENSION = "kvstate"
+
+        // Bytes of the GGUF header hashed into the prompt state key
+        private const val MODEL_FINGERPRINT_BYTES = 1 shl 20
+
+        // Tokenized prompt pieces kept per model by tokenize()
+        private const val TOKEN_CACHE_ENTRIES = 64
+
+        // Streamed text is drained from the native ring at most this often
+        private const val STREAM_POLL_MS = 16L
+        private const val STREAM_BUFFER_BYTES = 4096
+        private const val TRANSCRIPT_BUFFER_BYTES = 16 * 1024  // Grows to fit a segment
+
+        // enableEmbeddings(): questions are short, and embedding runs next to generation
+        private const val EMBED_CTX = 256       // Tokens embedded per text; the rest is truncated
+        private const val EMBED_THREADS = 2
+
+        // Model load progress is polled at most this often
+        private const val LOAD_POLL_MS = 50L
+
+        // nativeJobState values
+        private const val JOB_DONE = 2
+
+        // First-run calibration: each candidate is benchmarked and the
+        // fastest is stored per device + model
+        private const val TUNING_PREFS = "llama_tuning"
+        private const val TUNING_PENDING_SUFFIX = ".pending"  // Candidate being tried; set if the driver crashed
+        private const val TUNING_FAILED_SUFFIX = ".failed"
+        private const val CALIBRATION_PROMPT_TOKENS = 128
+        private const val CALIBRATION_GEN_TOKENS = 32
+
+        // Score = seconds for a typical ReAct turn at the measured rates
+        private const val TURN_PREFILL_TOKENS = 128f
+        private const val TURN_DECODE_TOKENS = 128f
+
+        // Full offload, about half of Qwen2.5-1.5B's 28 layers, CPU only
+        private val CALIBRATION_GPU_LAYERS = listOf(N_GPU_LAYERS, 14, 0)
+
+        private val DEFAULT_PROFILE = TuningProfile(N_GPU_LAYERS, N_THREADS, N_THREADS_BATCH)
+
+        // Memory-budget context sizing: the KV cache may use this share of
+        // the RAM available when the context is created
+        private const val KV_MEMORY_FRACTION = 0.25
+        private const val MIN_BUDGET_CTX = 1024
+        private const val MAX_BUDGET_CTX = 8192  // Native side also caps at the training context
+        private const val CTX_STEP = 256
     }
 
-    private var modelPtr: Long = 0
-    private var ctxPtr: Long = 0
-    var isLoaded = false
-        private set
+    /**
+     * KV cache and context settings applied by the next loadModel()
+     */
+    var contextConfig = ContextConfig()
+
+    /**
+     * Weight loading settings applied by the next loadModel()
+     */
+    var loadOptions = LoadOptions()
+
+    private val tuningPrefs: SharedPreferences =
+        context.getSharedPreferences(TUNING_PREFS, Context.MODE_PRIVATE)
+
+    // Current model and context; replaced in one write by swapModel()
+    @Volatile
+    private var loaded: Loaded? = null
+
+    private val ctxPtr: Long get() = loaded?.ctxPtr ?: 0L
+
+    // Carried over to the new context by swapModel()
+    @Volatile
+    private var draftPath: String? = null
+    @Volatile
+    private var warmedPrefix: String? = null
+
+    private val transcriptEncoder = DirectUtf8Encoder(TRANSCRIPT_BUFFER_BYTES)
+
+    // Set by enableEmbeddings(); one built over the chat model follows swapModel()
+    @Volatile
+    private var embedder: Embedder? = null
+
+    val isLoaded: Boolean get() = loaded != null
+
+    /**
+     * n_ctx of the loaded context, for budgeting prompts
+     */
+    val contextSize: Int get() = loaded?.nCtx ?: N_CTX
 
     init {
         // Initialize llama.cpp backend
@@ -43,107 +162,1294 @@ class LlamaEngine(private val context: Context) : AutoCloseable {
      *
      * Model: Qwen2.5-Math-1.5B-Instruct-Q4_K_M.gguf (~1GB)
      * Download from: https://huggingface.co/RichardErkhov/Qwen_-_Qwen2.5-Math-1.5B-gguf
+     *
+     * Uses the tuning profile stored by calibrate() for this device and
+     * model, or the defaults if there is none yet. Cancelling the calling
+     * coroutine aborts the load.
+     *
+     * @param onProgress Called with the weight loading progress in [0, 1]
+     */
+    suspend fun loadModel(modelPath: String, onProgress: (Float) -> Unit = {}): Boolean {
+        val modelFile = File(modelPath)
+        if (!modelFile.exists()) {
+            throw IllegalArgumentException("Model file not found: $modelPath")
+        }
+        return loadWith(modelFile, storedProfile(modelFile) ?: DEFAULT_PROFILE, onProgress)
+    }
+
+    /**
+     * Switch to another model without taking the engine offline
+     *
+     * The new model and context are loaded while the current ones keep
+     * serving. The draft model and the default session's warmed prompt are
+     * set up on the new context, then it replaces the current one in a
+     * single step. A generation already running finishes on the old model,
+     * which is freed after it. Sessions other than DEFAULT_SESSION are not
+     * carried over.
+     *
+     * Both models are resident during the switch; where RAM is too tight
+     * for that, close() and loadModel() instead.
+     *
+     * @param onProgress Called with the weight loading progress in [0, 1]
+     * @return false if the new model failed to load; the current one stays
      */
-    suspend fun loadModel(modelPath: String): Boolean {
+    suspend fun swapModel(modelPath: String, onProgress: (Float) -> Unit = {}): Boolean {
+        if (loaded == null) {
+            return loadModel(modelPath, onProgress)
+        }
         val modelFile = File(modelPath)
         if (!modelFile.exists()) {
             throw IllegalArgumentException("Model file not found: $modelPath")
         }
 
-        // Load model
-        modelPtr = nativeLoadModel(modelPath, N_CTX, N_GPU_LAYERS)
+        val next = openModel(modelFile, storedProfile(modelFile) ?: DEFAULT_PROFILE, onProgress) ?: return false
+        try {
+            // Best effort, as after loadModel(): both only affect speed
+            draftPath?.takeIf { File(it).exists() }?.let { path ->
+                runCatching {
+                    withContext(Dispatchers.IO) {
+                        nativeLoadDraftModel(
+                            next.ctxPtr, path, next.nCtx, next.profile.threads, next.profile.gpuLayers, N_DRAFT
+                        )
+                    }
+                }
+            }
+            warmedPrefix?.let { prefix -> runCatching { warm(next, prefix, DEFAULT_SESSION) } }
+            currentCoroutineContext().ensureActive()
+        } catch (e: CancellationException) {
+            free(next, cancelJobs = true)
+            throw e
+        }
+
+        // An embedder over the chat model moves to the new one; its id
+        // changes, so vectors from the old model are not compared with it
+        val followed = embedder?.takeIf { it.followsChatModel }
+        val nextEmbedder = followed?.let {
+            withContext(Dispatchers.IO) { createEmbedder(next.modelPtr, next.modelFile, followsChatModel = true) }
+        }
+
+        // enableEmbeddings() or disableEmbeddings() may have replaced (and
+        // freed) the old embedder meanwhile; then the new one is not needed
+        var installed = false
+        val previous = synchronized(this) {
+            if (followed != null && embedder === followed) {
+                embedder = nextEmbedder
+                installed = true
+            }
+            loaded.also { loaded = next }
+        }
+        if (installed) {
+            followed?.let { nativeFreeEmbedder(it.ptr) }
+        } else {
+            nextEmbedder?.let { nativeFreeEmbedder(it.ptr) }
+        }
+        previous?.let { free(it, cancelJobs = false) }
+        return true
+    }
+
+    /**
+     * Load the model and context with the given offload and thread settings,
+     * replacing whatever is loaded
+     */
+    private suspend fun loadWith(
+        modelFile: File,
+        profile: TuningProfile,
+        onProgress: (Float) -> Unit = {}
+    ): Boolean {
+        close()
+        loaded = openModel(modelFile, profile, onProgress)
+        return loaded != null
+    }
+
+    /**
+     * Load a model and create its context, leaving the current ones alone
+     *
+     * @return The new handles, or null if either step failed
+     */
+    private suspend fun openModel(
+        modelFile: File,
+        profile: TuningProfile,
+        onProgress: (Float) -> Unit
+    ): Loaded? {
+        // Load model, reporting progress until the native call returns
+        val options = loadOptions
+        val modelPtr = coroutineScope {
+            val load = async(Dispatchers.IO) {
+                nativeLoadModel(
+                    modelFile.absolutePath, N_CTX, profile.gpuLayers,
+                    options.useMmap, options.useMlock, options.pageIn && options.useMmap
+                )
+            }
+            try {
+                while (!load.isCompleted) {
+                    onProgress(nativeLoadProgress())
+                    delay(LOAD_POLL_MS)
+                }
+            } finally {
+                if (!load.isCompleted) nativeCancelLoad()
+            }
+            load.await()
+        }
         if (modelPtr == 0L) {
-            return false
+            return null
         }
+        onProgress(1f)
 
         // Initialize context
-        ctxPtr = nativeInitContext(modelPtr, N_CTX, N_THREADS, TEMPERATURE)
-        isLoaded = ctxPtr != 0L
+        val config = contextConfig
+        val flashAttn = config.flashAttention ?: (profile.gpuLayers == 0)
+        val nCtx = if (config.nCtx == CTX_FROM_BUDGET) {
+            budgetContextSize(modelPtr, config.kvCacheType, flashAttn)
+        } else {
+            config.nCtx
+        }
+        val ctxPtr = withContext(Dispatchers.IO) {
+            nativeInitContext(
+                modelPtr, nCtx, profile.threads, profile.threadsBatch, N_BATCH, N_UBATCH, TEMPERATURE,
+                config.kvCacheType.nativeId, flashAttn
+            )
+        }
+        if (ctxPtr == 0L) {
+            nativeFreeModel(modelPtr)
+            return null
+        }
+
+        return Loaded(
+            modelPtr = modelPtr,
+            ctxPtr = ctxPtr,
+            modelFile = modelFile,
+            profile = profile,
+            nCtx = nativeMemoryUsage(ctxPtr)[2].toInt(),
+            kvCacheType = config.kvCacheType,
+            flashAttention = flashAttn
+        )
+    }
+
+    private fun free(handles: Loaded, cancelJobs: Boolean) {
+        nativeFreeContext(handles.ctxPtr, cancelJobs)
+        nativeFreeModel(handles.modelPtr)
+    }
+
+    /**
+     * Whether calibrate() has already picked settings for the loaded model
+     */
+    fun hasTuningProfile(): Boolean = loaded?.let { storedProfile(it.modelFile) } != null
+
+    /**
+     * Benchmark offload and thread settings and keep the fastest
+     *
+     * Tries full, partial and no Vulkan offload (plus CPU with every core)
+     * on a short synthetic prefill and decode. The winner is stored for this
+     * device and model and used by later loadModel() calls; the engine is
+     * left loaded with it. A candidate that fails to load, or that crashed
+     * the process on an earlier attempt, is skipped from then on.
+     *
+     * Reloads the model several times, so run it once, before loading a
+     * draft model or warming prompts.
+     *
+     * @return The chosen profile, or null if no candidate worked
+     */
+    suspend fun calibrate(): TuningProfile? = withContext(Dispatchers.Default) {
+        val model = loaded?.modelFile ?: throw IllegalStateException("Model not loaded. Call loadModel() first.")
+        val key = profileKey(model)
+
+        val failed = tuningPrefs.getStringSet(key + TUNING_FAILED_SUFFIX, null).orEmpty().toMutableSet()
+        tuningPrefs.getString(key + TUNING_PENDING_SUFFIX, null)?.let { failed += it }
+
+        var best: TuningProfile? = null
+        var bestSeconds = Float.MAX_VALUE
+        for (candidate in calibrationCandidates()) {
+            val id = candidate.encode()
+            if (id in failed) continue
+
+            // Written synchronously so a driver crash is remembered
+            tuningPrefs.edit().putString(key + TUNING_PENDING_SUFFIX, id).commit()
+            val rates = if (loadWith(model, candidate)) {
+                nativeBenchmark(ctxPtr, CALIBRATION_PROMPT_TOKENS, CALIBRATION_GEN_TOKENS)
+            } else {
+                FloatArray(0)
+            }
+            tuningPrefs.edit().remove(key + TUNING_PENDING_SUFFIX).apply()
+
+            if (rates.size < 2 || rates[0] <= 0f || rates[1] <= 0f) {
+                failed += id
+                continue
+            }
+            val seconds = TURN_PREFILL_TOKENS / rates[0] + TURN_DECODE_TOKENS / rates[1]
+            if (seconds < bestSeconds) {
+                bestSeconds = seconds
+                best = candidate
+            }
+        }
+
+        val editor = tuningPrefs.edit().putStringSet(key + TUNING_FAILED_SUFFIX, failed)
+        best?.let { editor.putString(key, it.encode()) }
+        editor.apply()
+
+        val winner = best ?: DEFAULT_PROFILE
+        if (loaded?.profile != winner) {
+            loadWith(model, winner)
+        }
+        best
+    }
+
+    /**
+     * Largest n_ctx whose KV cache fits KV_MEMORY_FRACTION of available RAM
+     */
+    private fun budgetContextSize(modelPtr: Long, kvCacheType: KvCacheType, flashAttn: Boolean): Int {
+        val bytesPerToken = nativeKvBytesPerToken(modelPtr, kvCacheType.nativeId, flashAttn)
+        if (bytesPerToken <= 0L) return N_CTX
+
+        val memInfo = ActivityManager.MemoryInfo()
+        (context.getSystemService(Context.ACTIVITY_SERVICE) as ActivityManager).getMemoryInfo(memInfo)
+        val tokens = (memInfo.availMem * KV_MEMORY_FRACTION / bytesPerToken).toLong()
+        return (tokens / CTX_STEP * CTX_STEP).toInt().coerceIn(MIN_BUDGET_CTX, MAX_BUDGET_CTX)
+    }
+
+    /**
+     * Memory held by the loaded model and its KV cache
+     */
+    fun memoryUsage(): MemoryUsage {
+        val handles = loaded
+        val usage = nativeMemoryUsage(handles?.ctxPtr ?: 0L)
+        val f16BytesPerToken = handles
+            ?.let { nativeKvBytesPerToken(it.modelPtr, KvCacheType.F16.nativeId, false) } ?: 0L
+        return MemoryUsage(
+            modelBytes = usage[0],
+            kvCacheBytes = usage[1],
+            contextTokens = usage[2].toInt(),
+            trainContextTokens = usage[3].toInt(),
+            kvTokensPerF16Token = if (usage[1] > 0L && f16BytesPerToken > 0L) {
+                (f16BytesPerToken.toDouble() * usage[2] / usage[1]).toFloat()
+            } else {
+                1f
+            }
+        )
+    }
+
+    private fun calibrationCandidates(): List<TuningProfile> =
+        CALIBRATION_GPU_LAYERS.map { TuningProfile(it, N_THREADS, N_THREADS_BATCH) } +
+            Runtime.getRuntime().availableProcessors().let { TuningProfile(0, it, it) }
+
+    private fun storedProfile(model: File): TuningProfile? =
+        tuningPrefs.getString(profileKey(model), null)?.let { TuningProfile.decode(it) }
+
+    // Device (SoC and GPU driver come with the build) plus model identity
+    private fun profileKey(model: File): String =
+        "${Build.MANUFACTURER}/${Build.MODEL}/${Build.HARDWARE}/${Build.FINGERPRINT}|" +
+            "${model.name}:${model.length()}"
+
+    /**
+     * Decode a fixed prompt prefix into the KV cache, reusing a saved copy
+     *
+     * The first launch decodes the prefix and saves the sequence state next
+     * to the model file; later launches restore it instead of recomputing.
+     * Subsequent generate() calls starting with this prefix skip its prefill.
+     * Sessions forked from a warmed session share its prefix.
+     *
+     * @param prefix The exact text every prompt starts with (e.g. system prompt)
+     * @param sessionId Session to warm
+     * @return true if the prefix is now resident in the KV cache
+     */
+    suspend fun warmSystemPrompt(
+        prefix: String,
+        sessionId: Int = DEFAULT_SESSION
+    ): Boolean {
+        val handles = loaded ?: throw IllegalStateException("Model not loaded. Call loadModel() first.")
+        return warm(handles, prefix, sessionId).also { warmed ->
+            if (warmed && sessionId == DEFAULT_SESSION) warmedPrefix = prefix
+        }
+    }
+
+    private suspend fun warm(
+        handles: Loaded,
+        prefix: String,
+        sessionId: Int
+    ): Boolean = withContext(Dispatchers.Default) {
+        val model = handles.modelFile
+        val stateFile = promptStateFile(handles, prefix)
 
-        return isLoaded
+        // Drop state saved for an older prompt or configuration of this model
+        model.parentFile
+            ?.listFiles { f -> f.isPromptStateFor(model) && f != stateFile }
+            ?.forEach { it.delete() }
+
+        nativeWarmPrompt(handles.ctxPtr, sessionId, prefix, stateFile.absolutePath) > 0
+    }
+
+    /**
+     * Create an empty session with its own KV cache sequence and samplers
+     *
+     * Each session keeps its cached prompt across generate() calls, so
+     * switching between conversations does not re-decode either history.
+     *
+     * @return Session id, or null if MAX_SESSIONS are already in use
+     */
+    fun createSession(): Int? {
+        checkLoaded()
+        return nativeCreateSession(ctxPtr).takeIf { it >= 0 }
+    }
+
+    /**
+     * Create a session starting from a copy of another session's KV cache
+     *
+     * The copy shares cache cells with the source, so forking after
+     * warmSystemPrompt() gives a new conversation the prefix for free.
+     *
+     * @return Session id, or null if no session slot is free
+     */
+    fun forkSession(sourceId: Int = DEFAULT_SESSION): Int? {
+        checkLoaded()
+        return nativeForkSession(ctxPtr, sourceId).takeIf { it >= 0 }
+    }
+
+    /**
+     * Free a session's KV cache sequence and samplers
+     *
+     * DEFAULT_SESSION is only cleared, as it lives as long as the context.
+     */
+    fun freeSession(sessionId: Int) {
+        if (ctxPtr != 0L) {
+            nativeFreeSession(ctxPtr, sessionId)
+        }
+    }
+
+    /**
+     * Token ids for text, with special-token markup such as <|im_start|> parsed
+     *
+     * Results are kept in a per-model LRU cache keyed by the text, so pieces
+     * that recur in every prompt (the system prompt, earlier observations)
+     * are tokenized once. Prompts assembled from pieces go to
+     * generate(tokens, ...); split text only before a newline or special
+     * token, where the tokenizer splits anyway, or the pieces may tokenize
+     * differently from the whole.
+     *
+     * The returned array is shared with the cache and must not be modified.
+     *
+     * @param addSpecial Add BOS; only for the first piece of a prompt
+     */
+    fun tokenize(text: String, addSpecial: Boolean = false): IntArray {
+        val handles = loaded ?: throw IllegalStateException("Model not loaded. Call loadModel() first.")
+        return handles.tokenCache.getOrPut(text, addSpecial) {
+            nativeTokenize(handles.modelPtr, text, addSpecial, true)
+        }
+    }
+
+    /**
+     * Number of tokens text takes in a prompt
+     */
+    fun countTokens(text: String): Int = tokenize(text).size
+
+    private fun checkLoaded() {
+        if (!isLoaded) {
+            throw IllegalStateException("Model not loaded. Call loadModel() first.")
+        }
+    }
+
+    /**
+     * Load a small draft model to enable speculative decoding
+     *
+     * The draft proposes up to N_DRAFT tokens per step, which the main model
+     * verifies in a single batch. It must share the main model's vocabulary
+     * (e.g. Qwen2.5-0.5B for Qwen2.5-Math-1.5B). Call after loadModel().
+     *
+     * @return true if speculative decoding is active
+     */
+    suspend fun loadDraftModel(draftPath: String): Boolean = withContext(Dispatchers.IO) {
+        val handles = loaded ?: throw IllegalStateException("Model not loaded. Call loadModel() first.")
+        if (!File(draftPath).exists()) {
+            throw IllegalArgumentException("Draft model file not found: $draftPath")
+        }
+        nativeLoadDraftModel(
+            handles.ctxPtr, draftPath, handles.nCtx, handles.profile.threads, handles.profile.gpuLayers, N_DRAFT
+        ).also { active ->
+            if (active) this@LlamaEngine.draftPath = draftPath
+        }
+    }
+
+    /**
+     * Free the draft model and return to plain decoding
+     */
+    fun unloadDraftModel() {
+        draftPath = null
+        nativeFreeDraftModel(ctxPtr)
+    }
+
+    /**
+     * Turn on embed(), over the chat model or a dedicated embedding GGUF
+     *
+     * Without a path the loaded chat model's hidden states are mean-pooled:
+     * no extra download and no extra weights in RAM (the mapping is shared),
+     * and the embedder follows swapModel(). A small embedding model (a
+     * BERT-style GGUF with its own pooling) separates paraphrases from
+     * different questions better, at the cost of loading it. Either way the
+     * embedder has its own small context, so embedding never waits for a
+     * generation. Call after loadModel(); replaces any earlier embedder.
+     *
+     * @return true if embeddings are available
+     */
+    suspend fun enableEmbeddings(modelPath: String? = null): Boolean = withContext(Dispatchers.IO) {
+        disableEmbeddings()
+        val next = if (modelPath == null) {
+            val handles = loaded ?: throw IllegalStateException("Model not loaded. Call loadModel() first.")
+            createEmbedder(handles.modelPtr, handles.modelFile, followsChatModel = true)
+        } else {
+            val modelFile = File(modelPath)
+            if (!modelFile.exists()) {
+                throw IllegalArgumentException("Embedding model file not found: $modelPath")
+            }
+            val modelPtr = nativeLoadModel(modelFile.absolutePath, EMBED_CTX, 0, true, false, false)
+            if (modelPtr == 0L) return@withContext false
+            // The embedder keeps its own reference to the model
+            try {
+                createEmbedder(modelPtr, modelFile, followsChatModel = false)
+            } finally {
+                nativeFreeModel(modelPtr)
+            }
+        }
+        synchronized(this@LlamaEngine) { embedder.also { embedder = next } }?.let { nativeFreeEmbedder(it.ptr) }
+        next != null
+    }
+
+    /**
+     * Free the embedder; embed() returns null until enableEmbeddings()
+     */
+    fun disableEmbeddings() {
+        synchronized(this) { embedder.also { embedder = null } }?.let { nativeFreeEmbedder(it.ptr) }
+    }
+
+    /**
+     * Identifies the model and pooling behind embed(), or null if embeddings
+     * are off. Vectors are only comparable when this matches.
+     */
+    val embeddingModelId: String? get() = embedder?.modelId
+
+    /**
+     * Embed a text as an L2-normalized vector, so a dot product is its
+     * cosine similarity
+     *
+     * @return The embedding, or null if embeddings are off or it failed
+     */
+    suspend fun embed(text: String): FloatArray? = withContext(Dispatchers.Default) {
+        val current = embedder ?: return@withContext null
+        val out = FloatArray(current.dimensions)
+        // A handle freed meanwhile is simply not found natively
+        if (nativeEmbed(current.ptr, text, out) == current.dimensions) out else null
+    }
+
+    private fun createEmbedder(modelPtr: Long, modelFile: File, followsChatModel: Boolean): Embedder? {
+        val ptr = nativeCreateEmbedder(modelPtr, EMBED_CTX, EMBED_THREADS)
+        if (ptr == 0L) return null
+        val dimensions = nativeEmbeddingSize(ptr)
+        return Embedder(ptr, "${modelFile.name}:${modelFile.length()}:$dimensions", dimensions, followsChatModel)
+    }
+
+    /**
+     * Enable or disable prompt-lookup speculative decoding
+     *
+     * Drafts continuations by copying what followed earlier occurrences of
+     * the last few tokens (tool observations are often echoed verbatim).
+     * Needs no second model, so it is the option for low-RAM devices. On by
+     * default; when a draft model is also loaded, lookup is tried first.
+     */
+    fun setPromptLookup(enabled: Boolean) {
+        nativeSetPromptLookup(enabled, LOOKUP_NGRAM_MIN, LOOKUP_NGRAM_MAX, N_DRAFT)
+    }
+
+    /**
+     * Speculative decoding statistics for the most recent generate() call
+     */
+    fun lastSpeculativeStats(): SpeculativeStats {
+        val stats = nativeSpeculativeStats(ctxPtr)
+        return SpeculativeStats(
+            draftedTokens = stats[0].toInt(),
+            acceptedTokens = stats[1].toInt(),
+            acceptanceRate = stats[2],
+            tokensPerSecond = stats[3]
+        )
     }
 
     /**
      * Generate completion with streaming
      *
+     * The request is queued on the native decode thread, which writes text
+     * into a per-job ring buffer; this coroutine drains it every
+     * STREAM_POLL_MS and hands the batched text to onToken, so the decode
+     * thread makes no JNI upcalls. If onToken falls behind, decoding pauses
+     * once the ring fills.
+     *
+     * Cancelling the calling coroutine cancels the native job, which stops
+     * before its next decode step.
+     *
      * @param prompt The input prompt
      * @param grammar Optional GBNF grammar for constrained decoding
-     * @param onToken Callback for each generated token
+     * @param sessionId Session whose KV cache the prompt is decoded into
+     * @param stopStrings Text that ends generation; a match is not emitted
+     * @param sampling Sampling parameters for this call only; samplers are
+     *                 cached per config, so alternating configs is cheap
+     * @param onMetrics Called with the generation's counters once it finishes
+     * @param onToken Callback for each batch of streamed text
      */
     suspend fun generate(
         prompt: String,
         grammar: String?,
-        onToken: (String) -> Unit
+        sessionId: Int = DEFAULT_SESSION,
+        stopStrings: List<String> = DEFAULT_STOP_STRINGS,
+        sampling: SamplingConfig = SamplingConfig.DEFAULT,
+        onMetrics: ((GenerationMetrics) -> Unit)? = null,
+        onToken: suspend (String) -> Unit
     ): String {
-        if (!isLoaded) {
-            throw IllegalStateException("Model not loaded. Call loadModel() first.")
+        checkLoaded()
+
+        val jobId = nativeSubmitGenerate(
+            ctxPtr = ctxPtr,
+            sessionId = sessionId,
+            prompt = prompt,
+            maxTokens = MAX_TOKENS,
+            temperature = sampling.temperature,
+            topK = sampling.topK,
+            topP = sampling.topP,
+            minP = sampling.minP,
+            repeatPenalty = sampling.repeatPenalty,
+            seed = sampling.seed,
+            grammar = grammar,
+            stopStrings = stopStrings.toTypedArray()
+        )
+        if (jobId == 0L) {
+            throw IllegalStateException("Failed to submit generation")
         }
+        return awaitJob(jobId, onMetrics, onToken)
+    }
+
+    /**
+     * Generate from an already tokenized prompt, e.g. pieces from tokenize()
+     *
+     * Streams and cancels exactly like generate(prompt, ...).
+     */
+    suspend fun generate(
+        tokens: IntArray,
+        grammar: String?,
+        sessionId: Int = DEFAULT_SESSION,
+        stopStrings: List<String> = DEFAULT_STOP_STRINGS,
+        sampling: SamplingConfig = SamplingConfig.DEFAULT,
+        onMetrics: ((GenerationMetrics) -> Unit)? = null,
+        onToken: suspend (String) -> Unit
+    ): String {
+        checkLoaded()
 
-        // Create callback wrapper
-        val callback = TokenCallback { token ->
-            onToken(token)
+        val jobId = nativeSubmitGenerateTokens(
+            ctxPtr = ctxPtr,
+            sessionId = sessionId,
+            tokens = tokens,
+            maxTokens = MAX_TOKENS,
+            temperature = sampling.temperature,
+            topK = sampling.topK,
+            topP = sampling.topP,
+            minP = sampling.minP,
+            repeatPenalty = sampling.repeatPenalty,
+            seed = sampling.seed,
+            grammar = grammar,
+            stopStrings = stopStrings.toTypedArray()
+        )
+        if (jobId == 0L) {
+            throw IllegalStateException("Failed to submit generation")
+        }
+        return awaitJob(jobId, onMetrics, onToken)
+    }
+
+    /**
+     * Append a segment to a session's native transcript
+     *
+     * The transcript is the prompt for generateFromTranscript(). Only the
+     * new segment crosses JNI, encoded straight into a direct buffer, and
+     * only it is tokenized, so a turn costs its own size instead of the
+     * whole history. Split segments before a newline or special token, as
+     * for tokenize(). Does not wait for a running generation.
+     *
+     * @param addSpecial Add BOS; only for the first segment
+     * @return Tokens the segment added
+     */
+    fun appendTranscript(text: String, sessionId: Int = DEFAULT_SESSION, addSpecial: Boolean = false): Int {
+        checkLoaded()
+        val n = synchronized(transcriptEncoder) {
+            val bytes = transcriptEncoder.encode(text)
+            nativeTranscriptAppend(ctxPtr, sessionId, bytes, bytes.limit(), addSpecial)
         }
+        check(n >= 0) { "Failed to append to the transcript of session $sessionId" }
+        return n
+    }
 
-        val result = nativeGenerate(
+    /**
+     * Remove count tokens from a session's transcript, starting at token from
+     *
+     * When the session's KV cache holds the transcript up to the erased
+     * span, those entries are removed and the ones after them shifted back
+     * in place, so the rest of the transcript is not prefilled again. Waits
+     * for a generation running on the context.
+     *
+     * @return Tokens left in the transcript
+     */
+    fun eraseTranscript(from: Int, count: Int, sessionId: Int = DEFAULT_SESSION): Int =
+        nativeTranscriptErase(ctxPtr, sessionId, from, count)
+
+    fun clearTranscript(sessionId: Int = DEFAULT_SESSION) {
+        nativeTranscriptClear(ctxPtr, sessionId)
+    }
+
+    /**
+     * Generate with the session's transcript, as it stands now, as the prompt
+     *
+     * Streams and cancels exactly like generate(prompt, ...). The transcript
+     * does not grow by the generated text; append it along with whatever
+     * follows it.
+     */
+    suspend fun generateFromTranscript(
+        grammar: String?,
+        sessionId: Int = DEFAULT_SESSION,
+        stopStrings: List<String> = DEFAULT_STOP_STRINGS,
+        sampling: SamplingConfig = SamplingConfig.DEFAULT,
+        onMetrics: ((GenerationMetrics) -> Unit)? = null,
+        onToken: suspend (String) -> Unit
+    ): String {
+        checkLoaded()
+
+        val jobId = nativeSubmitGenerateTranscript(
             ctxPtr = ctxPtr,
-            prompt = prompt,
+            sessionId = sessionId,
             maxTokens = MAX_TOKENS,
-            temperature = TEMPERATURE,
+            temperature = sampling.temperature,
+            topK = sampling.topK,
+            topP = sampling.topP,
+            minP = sampling.minP,
+            repeatPenalty = sampling.repeatPenalty,
+            seed = sampling.seed,
             grammar = grammar,
-            callback = callback
+            stopStrings = stopStrings.toTypedArray()
         )
+        if (jobId == 0L) {
+            throw IllegalStateException("Failed to submit generation")
+        }
+        return awaitJob(jobId, onMetrics, onToken)
+    }
+
+    /**
+     * Prefill the session's transcript, as it stands now, without generating
+     *
+     * Queued like a generation, so it runs in order with them. Use it to
+     * decode text known ahead of a slow step (tool framing while the tool
+     * runs); the next generation then only prefills what was appended since.
+     */
+    suspend fun prefillTranscript(sessionId: Int = DEFAULT_SESSION) {
+        checkLoaded()
 
-        return result
+        val greedy = SamplingConfig.GREEDY
+        val jobId = nativeSubmitGenerateTranscript(
+            ctxPtr = ctxPtr,
+            sessionId = sessionId,
+            maxTokens = 0,
+            temperature = greedy.temperature,
+            topK = greedy.topK,
+            topP = greedy.topP,
+            minP = greedy.minP,
+            repeatPenalty = greedy.repeatPenalty,
+            seed = greedy.seed,
+            grammar = null,
+            stopStrings = emptyArray()
+        )
+        if (jobId == 0L) {
+            throw IllegalStateException("Failed to submit transcript prefill")
+        }
+        awaitJob(jobId, onMetrics = null) { }
+    }
+
+    /**
+     * Stream a submitted job to onToken until it finishes, then release it
+     *
+     * Time spent draining and in onToken is added to the metrics as
+     * callbackMillis.
+     */
+    private suspend fun awaitJob(
+        jobId: Long,
+        onMetrics: ((GenerationMetrics) -> Unit)?,
+        onToken: suspend (String) -> Unit
+    ): String {
+        val streamBuffer = ByteBuffer.allocateDirect(STREAM_BUFFER_BYTES)
+        var callbackNanos = 0L
+        try {
+            while (true) {
+                // Read the state first so a final drain follows completion
+                val done = nativeJobState(jobId) == JOB_DONE
+                val drainStart = System.nanoTime()
+                drainStream(jobId, streamBuffer, onToken)
+                callbackNanos += System.nanoTime() - drainStart
+                if (done) break
+                delay(STREAM_POLL_MS)
+            }
+            if (onMetrics != null) {
+                GenerationMetrics.fromNative(nativeJobMetrics(jobId), callbackNanos / 1_000_000f)
+                    ?.let(onMetrics)
+            }
+            return String(nativeJobResult(jobId), Charsets.UTF_8)
+        } finally {
+            nativeReleaseJob(jobId)
+        }
+    }
+
+    /**
+     * Generate completions for many independent prompts, batchSize at a time
+     *
+     * For offline evaluation. Each prompt is decoded as its own sequence
+     * with its own sampler, and every decode step advances all sequences of
+     * a batch at once, so throughput grows with batchSize (up to what the
+     * device's compute allows) instead of staying at single-stream speed.
+     * Sessions are not touched, but interactive generate() calls wait while
+     * a batch runs. Cancelling the calling coroutine stops after the
+     * current batch.
+     *
+     * @param batchSize Prompts per batch, at most MAX_BATCH_SIZE
+     * @throws IllegalStateException if a batch fails to decode
+     */
+    suspend fun generateBatch(
+        prompts: List<String>,
+        grammar: String? = null,
+        stopStrings: List<String> = DEFAULT_STOP_STRINGS,
+        maxTokens: Int = MAX_TOKENS,
+        temperature: Float = TEMPERATURE,
+        batchSize: Int = BATCH_SIZE
+    ): BatchGeneration = withContext(Dispatchers.Default) {
+        checkLoaded()
+        require(batchSize in 1..MAX_BATCH_SIZE) { "batchSize must be in 1..$MAX_BATCH_SIZE" }
+
+        val texts = ArrayList<String>(prompts.size)
+        val tokens = ArrayList<Int>(prompts.size)
+        val start = System.nanoTime()
+        for (chunk in prompts.chunked(batchSize)) {
+            ensureActive()
+            val counts = IntArray(chunk.size)
+            val results = nativeGenerateBatch(
+                ctxPtr, chunk.toTypedArray(), maxTokens, temperature, grammar,
+                stopStrings.toTypedArray(), counts
+            ) ?: throw IllegalStateException("Batch generation failed")
+            results.mapTo(texts) { String(it, Charsets.UTF_8) }
+            tokens += counts.toList()
+        }
+        BatchGeneration(texts, tokens, (System.nanoTime() - start) / 1_000_000)
+    }
+
+    /**
+     * Pass everything currently in a job's native ring to onToken
+     */
+    private suspend fun drainStream(
+        jobId: Long,
+        streamBuffer: ByteBuffer,
+        onToken: suspend (String) -> Unit
+    ) {
+        while (true) {
+            val n = nativeDrainStream(jobId, streamBuffer)
+            if (n <= 0) return
+
+            streamBuffer.position(0).limit(n)
+            val text = Charsets.UTF_8.decode(streamBuffer).toString()
+            streamBuffer.clear()
+            onToken(text)
+        }
+    }
+
+    /**
+     * Set how many prompt tokens are decoded per llama_decode call
+     *
+     * Values above N_BATCH (or <= 0) use N_BATCH. Smaller chunks lower peak
+     * memory; the best value differs between Vulkan and CPU, so compare
+     * lastPrefillTimings() across settings on the target device.
+     */
+    fun setPrefillChunkSize(tokens: Int) {
+        nativeSetPrefillChunk(tokens)
+    }
+
+    /**
+     * Batch-decode tokens the grammar forces instead of sampling each one
+     *
+     * On by default. Only affects generations with a grammar.
+     */
+    fun setGrammarFastForward(enabled: Boolean) {
+        nativeSetFastForward(enabled)
+    }
+
+    /**
+     * Timings for each chunk of the most recent prompt prefill
+     */
+    fun lastPrefillTimings(): List<PrefillChunkTiming> {
+        val flat = nativePrefillTimings(ctxPtr)
+        return (flat.indices step 2).map { i ->
+            PrefillChunkTiming(tokens = flat[i].toInt(), millis = flat[i + 1])
+        }
     }
 
     /**
      * Get system information (for debugging)
      */
     fun getSystemInfo(): String {
-        return nativeSystemInfo()
+        return nativeSystemInfo(ctxPtr)
+    }
+
+    /**
+     * Location of the saved prompt state for this model, context and prompt
+     *
+     * The key covers a fingerprint of the model file (size, mtime and GGUF
+     * header), the context parameters (including flash attention, which
+     * decides the V cache type) and the prompt text, so a stale state is
+     * never restored after any of them changes.
+     */
+    private fun promptStateFile(handles: Loaded, prefix: String): File {
+        val model = handles.modelFile
+        val digest = MessageDigest.getInstance("SHA-256")
+
+        digest.update("${model.length()}:${model.lastModified()}".toByteArray())
+        RandomAccessFile(model, "r").use { raf ->
+            val header = ByteArray(minOf(MODEL_FINGERPRINT_BYTES.toLong(), raf.length()).toInt())
+            raf.readFully(header)
+            digest.update(header)
+        }
+        digest.update(
+            ("ctx=${handles.nCtx};kv=${handles.kvCacheType};fa=${handles.flashAttention};" +
+                "gpu=${handles.profile.gpuLayers}").toByteArray()
+        )
+        digest.update(prefix.toByteArray(Charsets.UTF_8))
+
+        val key = digest.digest().take(8).joinToString("") { "%02x".format(it) }
+        return File(model.parentFile, "${model.nameWithoutExtension}.$key.$PROMPT_STATE_EXTENSION")
     }
 
+    private fun File.isPromptStateFor(model: File): Boolean =
+        extension == PROMPT_STATE_EXTENSION && name.startsWith("${model.nameWithoutExtension}.")
+
     /**
      * Free native resources
+     *
+     * Cancels any generation still running; its context is freed once it
+     * has stopped.
      */
     override fun close() {
-        if (ctxPtr != 0L) {
-            nativeFreeContext(ctxPtr)
-            ctxPtr = 0
-        }
-        if (modelPtr != 0L) {
-            nativeFreeModel(modelPtr)
-            modelPtr = 0
-        }
-        isLoaded = false
+        val handles = synchronized(this) { loaded.also { loaded = null } }
+        handles?.let { free(it, cancelJobs = true) }
+        disableEmbeddings()
+        draftPath = null
+        warmedPrefix = null
     }
 
+    /**
+     * Native handles for one model and its context, with the settings they
+     * were created with
+     */
+    private class Loaded(
+        val modelPtr: Long,
+        val ctxPtr: Long,
+        val modelFile: File,
+        val profile: TuningProfile,
+        val nCtx: Int,
+        val kvCacheType: KvCacheType,
+        val flashAttention: Boolean     // Decides the V cache type, and so the KV layout
+    ) {
+        // Token ids depend on the vocabulary, so the cache goes with the model
+        val tokenCache = TokenCache(TOKEN_CACHE_ENTRIES)
+    }
+
+    /**
+     * Native embedder handle and the vectors it produces
+     */
+    private class Embedder(
+        val ptr: Long,
+        val modelId: String,
+        val dimensions: Int,
+        val followsChatModel: Boolean
+    )
+
     // ==========================================================================
     // Native method declarations (implemented in llama_jni.cpp)
     // ==========================================================================
 
     private external fun nativeInit()
-    private external fun nativeLoadModel(path: String, nCtx: Int, nGpuLayers: Int): Long
-    private external fun nativeInitContext(modelPtr: Long, nCtx: Int, nThreads: Int, temperature: Float): Long
-    private external fun nativeGenerate(
+    private external fun nativeLoadModel(
+        path: String,
+        nCtx: Int,
+        nGpuLayers: Int,
+        useMmap: Boolean,
+        useMlock: Boolean,
+        pageIn: Boolean
+    ): Long
+    private external fun nativeLoadProgress(): Float
+    private external fun nativeCancelLoad()
+    private external fun nativeInitContext(
+        modelPtr: Long,
+        nCtx: Int,
+        nThreads: Int,
+        nThreadsBatch: Int,
+        nBatch: Int,
+        nUbatch: Int,
+        temperature: Float,
+        kvType: Int,
+        flashAttn: Boolean
+    ): Long
+    private external fun nativeKvBytesPerToken(modelPtr: Long, kvType: Int, flashAttn: Boolean): Long
+    private external fun nativeMemoryUsage(ctxPtr: Long): LongArray
+    private external fun nativeSetPrefillChunk(chunkSize: Int)
+    private external fun nativePrefillTimings(ctxPtr: Long): FloatArray
+    private external fun nativeSetFastForward(enabled: Boolean)
+    private external fun nativeBenchmark(ctxPtr: Long, nPrompt: Int, nGen: Int): FloatArray
+    private external fun nativeLoadDraftModel(
         ctxPtr: Long,
+        path: String,
+        nCtx: Int,
+        nThreads: Int,
+        nGpuLayers: Int,
+        nDraft: Int
+    ): Boolean
+    private external fun nativeFreeDraftModel(ctxPtr: Long)
+    private external fun nativeSetPromptLookup(enabled: Boolean, ngramMin: Int, ngramMax: Int, nDraft: Int)
+    private external fun nativeSpeculativeStats(ctxPtr: Long): FloatArray
+    private external fun nativeWarmPrompt(ctxPtr: Long, sessionId: Int, prompt: String, statePath: String): Int
+    private external fun nativeCreateSession(ctxPtr: Long): Int
+    private external fun nativeForkSession(ctxPtr: Long, sourceId: Int): Int
+    private external fun nativeFreeSession(ctxPtr: Long, sessionId: Int)
+    private external fun nativeSubmitGenerate(
+        ctxPtr: Long,
+        sessionId: Int,
         prompt: String,
         maxTokens: Int,
         temperature: Float,
+        topK: Int,
+        topP: Float,
+        minP: Float,
+        repeatPenalty: Float,
+        seed: Int,
         grammar: String?,
-        callback: TokenCallback
-    ): String
-    private external fun nativeFreeContext(ctxPtr: Long)
+        stopStrings: Array<String>
+    ): Long
+    private external fun nativeSubmitGenerateTokens(
+        ctxPtr: Long,
+        sessionId: Int,
+        tokens: IntArray,
+        maxTokens: Int,
+        temperature: Float,
+        topK: Int,
+        topP: Float,
+        minP: Float,
+        repeatPenalty: Float,
+        seed: Int,
+        grammar: String?,
+        stopStrings: Array<String>
+    ): Long
+    private external fun nativeTranscriptAppend(
+        ctxPtr: Long,
+        sessionId: Int,
+        buffer: ByteBuffer,
+        length: Int,
+        addSpecial: Boolean
+    ): Int
+    private external fun nativeTranscriptErase(ctxPtr: Long, sessionId: Int, from: Int, count: Int): Int
+    private external fun nativeTranscriptClear(ctxPtr: Long, sessionId: Int)
+    private external fun nativeSubmitGenerateTranscript(
+        ctxPtr: Long,
+        sessionId: Int,
+        maxTokens: Int,
+        temperature: Float,
+        topK: Int,
+        topP: Float,
+        minP: Float,
+        repeatPenalty: Float,
+        seed: Int,
+        grammar: String?,
+        stopStrings: Array<String>
+    ): Long
+    private external fun nativeCreateEmbedder(modelPtr: Long, nCtx: Int, nThreads: Int): Long
+    private external fun nativeEmbeddingSize(embedderPtr: Long): Int
+    private external fun nativeEmbed(embedderPtr: Long, text: String, out: FloatArray): Int
+    private external fun nativeFreeEmbedder(embedderPtr: Long)
+    private external fun nativeTokenize(modelPtr: Long, text: String, addSpecial: Boolean, parseSpecial: Boolean): IntArray
+    private external fun nativeJobState(jobId: Long): Int
+    private external fun nativeJobResult(jobId: Long): ByteArray
+    private external fun nativeJobMetrics(jobId: Long): FloatArray
+    private external fun nativeReleaseJob(jobId: Long)
+    private external fun nativeDrainStream(jobId: Long, buffer: ByteBuffer): Int
+    private external fun nativeGenerateBatch(
+        ctxPtr: Long,
+        prompts: Array<String>,
+        maxTokens: Int,
+        temperature: Float,
+        grammar: String?,
+        stopStrings: Array<String>,
+        nGenerated: IntArray
+    ): Array<ByteArray>?
+    private external fun nativeFreeContext(ctxPtr: Long, cancelJobs: Boolean)
     private external fun nativeFreeModel(modelPtr: Long)
-    private external fun nativeSystemInfo(): String
+    private external fun nativeSystemInfo(ctxPtr: Long): String
     private external fun nativeShutdown()
 }
 
 /**
- * Callback interface for streaming token generation
+ * Least-recently-used cache of tokenized text
+ *
+ * Keyed by the text itself (its hash is computed once by String), so a
+ * hash collision can never return another text's tokens.
  */
-class TokenCallback(private val onToken: (String) -> Unit) {
-    fun onToken(token: String) {
-        onToken(token)
+internal class TokenCache(private val capacity: Int) {
+    private data class Key(val text: String, val addSpecial: Boolean)
+
+    private val entries = object : LinkedHashMap<Key, IntArray>(capacity, 0.75f, true) {
+        override fun removeEldestEntry(eldest: MutableMap.MutableEntry<Key, IntArray>): Boolean = size > capacity
+    }
+
+    @Synchronized
+    fun getOrPut(text: String, addSpecial: Boolean, tokenize: () -> IntArray): IntArray =
+        entries.getOrPut(Key(text, addSpecial), tokenize)
+}
+
+/**
+ * UTF-8 encoder into a reused direct ByteBuffer
+ *
+ * Hands text to native code as standard UTF-8 without a byte[] copy; the
+ * buffer only grows. Callers synchronize on the encoder.
+ */
+internal class DirectUtf8Encoder(initialBytes: Int) {
+    private val encoder = Charsets.UTF_8.newEncoder()
+        .onMalformedInput(CodingErrorAction.REPLACE)
+        .onUnmappableCharacter(CodingErrorAction.REPLACE)
+    private var buffer: ByteBuffer = ByteBuffer.allocateDirect(initialBytes)
+
+    /**
+     * Encode text from position 0; the buffer is valid until the next call
+     */
+    fun encode(text: String): ByteBuffer {
+        val maxBytes = (text.length * encoder.maxBytesPerChar()).toInt()
+        if (buffer.capacity() < maxBytes) {
+            buffer = ByteBuffer.allocateDirect(maxOf(maxBytes, buffer.capacity() * 2))
+        }
+        buffer.clear()
+        encoder.reset()
+        encoder.encode(CharBuffer.wrap(text), buffer, true)
+        encoder.flush(buffer)
+        buffer.flip()
+        return buffer
     }
 }
+
+/**
+ * Wall time spent decoding one chunk of a prompt prefill
+ */
+data class PrefillChunkTiming(val tokens: Int, val millis: Float) {
+    val tokensPerSecond: Float get() = if (millis > 0f) tokens * 1000f / millis else 0f
+}
+
+/**
+ * Speculative decoding outcome of one generation
+ *
+ * tokensPerSecond counts every generated token, so it is the effective
+ * decode speed including accepted draft tokens.
+ */
+data class SpeculativeStats(
+    val draftedTokens: Int,
+    val acceptedTokens: Int,
+    val acceptanceRate: Float,
+    val tokensPerSecond: Float
+)
+
+/**
+ * Sampling parameters for one generate() call
+ *
+ * A temperature <= 0 is greedy; without a grammar or repeat penalty it
+ * takes the argmax of the logits directly, skipping the sampler chain.
+ *
+ * @param topK Keep the k most likely tokens; 0 disables
+ * @param topP Nucleus threshold; 1 disables
+ * @param minP Drop tokens below minP times the top probability; 0 disables
+ * @param repeatPenalty Penalty on recently generated tokens; 1 disables
+ * @param seed Sampling seed; -1 for random
+ */
+data class SamplingConfig(
+    val temperature: Float = LlamaEngine.TEMPERATURE,
+    val topK: Int = 40,
+    val topP: Float = 0.95f,
+    val minP: Float = 0.05f,
+    val repeatPenalty: Float = 1.0f,
+    val seed: Int = -1
+) {
+    companion object {
+        val DEFAULT = SamplingConfig()
+        val GREEDY = SamplingConfig(temperature = 0f)
+    }
+}
+
+/**
+ * Where the time of one generate() call went
+ *
+ * Times are in milliseconds. All but callbackMillis are measured on the
+ * decode thread: samplingMillis includes grammar constraints applied while
+ * sampling, grammarMillis is the fast-forward probing on top, and
+ * streamMillis is time handing text over, including waits while the
+ * stream was full. callbackMillis is what draining the stream and onToken
+ * took on the collecting side.
+ */
+data class GenerationMetrics(
+    val stopReason: StopReason,
+    val promptTokens: Int,
+    val reusedTokens: Int,
+    val prefillTokens: Int,
+    val generatedTokens: Int,
+    val tokenizeMillis: Float,
+    val prefillMillis: Float,
+    val decodeMillis: Float,
+    val decodeMillisPerTokenP50: Float,
+    val decodeMillisPerTokenP99: Float,
+    val samplingMillis: Float,
+    val grammarMillis: Float,
+    val streamMillis: Float,
+    val totalMillis: Float,
+    val callbackMillis: Float
+) {
+    /** Native GenerationMetrics::StopReason, in order */
+    enum class StopReason { NONE, EOG, MAX_TOKENS, STOP_STRING, GRAMMAR_COMPLETE, CANCELLED, ERROR }
+
+    val prefillTokensPerSecond: Float
+        get() = if (prefillMillis > 0f) prefillTokens * 1000f / prefillMillis else 0f
+
+    val decodeTokensPerSecond: Float
+        get() = if (decodeMillis > 0f) generatedTokens * 1000f / decodeMillis else 0f
+
+    internal companion object {
+        private const val NATIVE_FIELDS = 14
+
+        /**
+         * Unpack nativeJobMetrics(); null if the job had not finished
+         */
+        fun fromNative(values: FloatArray, callbackMillis: Float): GenerationMetrics? {
+            if (values.size < NATIVE_FIELDS) return null
+            return GenerationMetrics(
+                stopReason = StopReason.values().getOrElse(values[0].toInt()) { StopReason.NONE },
+                promptTokens = values[1].toInt(),
+                reusedTokens = values[2].toInt(),
+                prefillTokens = values[3].toInt(),
+                generatedTokens = values[4].toInt(),
+                tokenizeMillis = values[5],
+                prefillMillis = values[6],
+                decodeMillis = values[7],
+                decodeMillisPerTokenP50 = values[8],
+                decodeMillisPerTokenP99 = values[9],
+                samplingMillis = values[10],
+                grammarMillis = values[11],
+                streamMillis = values[12],
+                totalMillis = values[13],
+                callbackMillis = callbackMillis
+            )
+        }
+    }
+}
+
+/**
+ * Outcome of LlamaEngine.generateBatch(), in prompt order
+ */
+data class BatchGeneration(
+    val texts: List<String>,
+    val generatedTokens: List<Int>,
+    val millis: Long
+) {
+    val tokensPerSecond: Float
+        get() = if (millis > 0) generatedTokens.sum() * 1000f / millis else 0f
+}
+
+/**
+ * Offload and thread settings chosen by LlamaEngine.calibrate()
+ *
+ * A thread count of 0 lets the native layer pick from the CPU topology.
+ */
+data class TuningProfile(
+    val gpuLayers: Int,
+    val threads: Int,
+    val threadsBatch: Int
+) {
+    internal fun encode(): String = "$gpuLayers,$threads,$threadsBatch"
+
+    internal companion object {
+        fun decode(value: String): TuningProfile? {
+            val parts = value.split(",").map { it.toIntOrNull() ?: return null }
+            if (parts.size != 3) return null
+            return TuningProfile(parts[0], parts[1], parts[2])
+        }
+    }
+}
+
+/**
+ * KV cache element type; quantized caches trade a little accuracy for memory
+ *
+ * Without flash attention llama.cpp keeps V at f16 and quantizes only K, so
+ * the saving is much smaller: q8_0 then fits about 1.3x the tokens of f16
+ * in the same RAM rather than about 1.9x, q4_0 about 1.6x rather than 3.6x.
+ * MemoryUsage.kvTokensPerF16Token reports what the loaded context gets.
+ */
+enum class KvCacheType(internal val nativeId: Int) {
+    F16(0),
+    Q8_0(1),    // About half of f16 with flash attention
+    Q4_0(2)     // About a quarter of f16 with flash attention
+}
+
+/**
+ * Context settings for LlamaEngine.loadModel()
+ *
+ * @param kvCacheType KV cache type. The V cache is only quantized with flash attention.
+ * @param flashAttention Force flash attention on or off; null enables it for CPU-only profiles,
+ *                       where the backend always supports it. The Vulkan backend has no flash
+ *                       attention on phone GPUs, so offloaded profiles quantize K only.
+ * @param nCtx Context size, or LlamaEngine.CTX_FROM_BUDGET to size it from free RAM
+ */
+data class ContextConfig(
+    val kvCacheType: KvCacheType = KvCacheType.F16,
+    val flashAttention: Boolean? = null,
+    val nCtx: Int = LlamaEngine.N_CTX
+) {
+    companion object {
+        // Below this much RAM the low-memory killer is a real risk
+        private const val LOW_RAM_BYTES = 6L * 1024 * 1024 * 1024
+
+        /**
+         * Defaults for this device: q8_0 KV and a budget-sized context on
+         * low-RAM phones, f16 otherwise. The budget is computed from the
+         * real per-token cost, so a GPU profile (K quantized only) gets a
+         * proportionally smaller context than a CPU one.
+         */
+        fun forDevice(context: Context): ContextConfig {
+            val activityManager = context.getSystemService(Context.ACTIVITY_SERVICE) as ActivityManager
+            val memInfo = ActivityManager.MemoryInfo().also { activityManager.getMemoryInfo(it) }
+            return if (activityManager.isLowRamDevice || memInfo.totalMem < LOW_RAM_BYTES) {
+                ContextConfig(kvCacheType = KvCacheType.Q8_0, nCtx = LlamaEngine.CTX_FROM_BUDGET)
+            } else {
+                ContextConfig()
+            }
+        }
+    }
+}
+
+/**
+ * How LlamaEngine.loadModel() brings the weights into memory
+ *
+ * @param useMmap Map the GGUF instead of reading it; loads faster and lets
+ *                the OS drop clean pages under memory pressure
+ * @param useMlock Pin the weights in RAM; avoids re-faulting after
+ *                 pressure but counts fully against the app's memory
+ * @param pageIn With mmap, fault the file in on a background thread so the
+ *               first generation does not stall on storage
+ */
+data class LoadOptions(
+    val useMmap: Boolean = true,
+    val useMlock: Boolean = false,
+    val pageIn: Boolean = true
+)
+
+/**
+ * Native memory held by the engine
+ */
+data class MemoryUsage(
+    val modelBytes: Long,
+    val kvCacheBytes: Long,
+    val contextTokens: Int,
+    val trainContextTokens: Int,
+    val kvTokensPerF16Token: Float     // Context gained over an f16 cache of the same size
+)
@@ -44,6 +44,7 @@ import androidx.core.view.WindowInsetsCompat
 import androidx.lifecycle.lifecycleScope
 import kotlinx.coroutines.delay
 import kotlinx.coroutines.launch
+import java.io.File
 import java.text.SimpleDateFormat
 import java.util.*
 
@@ -67,6 +68,12 @@ class MainActivity : ComponentActivity() {
     // App state
     private val appState = mutableStateOf(AppState.Loading)
 
+    // Load progress of a model swap in flight; the chat stays usable meanwhile
+    private val switchProgress = mutableStateOf<Float?>(null)
+
+    // Python/SymPy startup, run alongside the model load
+    private val toolsReadiness = mutableStateOf(ToolsReadiness.PENDING)
+
     private val requestPermissionLauncher = registerForActivityResult(
         ActivityResultContracts.RequestPermission()
     ) { isGranted ->
@@ -84,9 +91,18 @@ class MainActivity : ComponentActivity() {
         WindowCompat.setDecorFitsSystemWindows(window, false)
 
         // Initialize components
-        llamaEngine = LlamaEngine(applicationContext)
-        reactAgent = ReActAgent(llamaEngine, applicationContext)
+        llamaEngine = LlamaEngine(applicationContext).apply {
+            contextConfig = ContextConfig.forDevice(applicationContext)
+        }
         modelManager = ModelManager(applicationContext)
+        val answerCache = SemanticAnswerCache(llamaEngine, File(filesDir, "semantic_answers.bin"))
+        reactAgent = ReActAgent(llamaEngine, applicationContext, answerCache = answerCache)
+
+        // Bring up Python and SymPy while the model is found and loaded, so
+        // the first tool call does not stall on them
+        lifecycleScope.launch {
+            reactAgent.prewarmTools { stage -> toolsReadiness.value = stage }
+        }
 
         // Check storage permission
         checkPermission()
@@ -99,7 +115,11 @@ class MainActivity : ComponentActivity() {
 
                     // Main content based on state
                     when (val state = appState.value) {
-                        is AppState.Loading -> LoadingScreen()
+                        is AppState.Loading -> LoadingScreen(tools = toolsReadiness.value)
+                        is AppState.LoadingModel -> LoadingScreen(
+                            progress = state.progress,
+                            tools = toolsReadiness.value
+                        )
                         is AppState.PermissionDenied -> PermissionDeniedScreen {
                             checkPermission()
                         }
@@ -115,7 +135,10 @@ class MainActivity : ComponentActivity() {
                         is AppState.Ready -> ChatScreen(
                             agent = reactAgent,
                             isModelLoaded = true,
-                            modelManager = modelManager
+                            modelManager = modelManager,
+                            switchProgress = switchProgress.value,
+                            toolsReadiness = toolsReadiness.value,
+                            onSwitchModel = { file -> switchModel(file) }
                         )
                         is AppState.Error -> ErrorScreen(
                             message = (state as AppState.Error).message,
@@ -231,13 +254,57 @@ class MainActivity : ComponentActivity() {
     }
 
     private suspend fun loadModel(path: String): Boolean {
+        appState.value = AppState.LoadingModel(0f)
         return try {
-            llamaEngine.loadModel(path)
+            llamaEngine.loadModel(path) { progress ->
+                appState.value = AppState.LoadingModel(progress)
+            }.also { loaded ->
+                if (loaded) {
+                    // First run on this device + model: pick offload and threads
+                    if (!llamaEngine.hasTuningProfile()) {
+                        runCatching { llamaEngine.calibrate() }
+                    }
+
+                    // Best effort: both only affect speed, never correctness
+                    modelManager.findDraftModel()?.let { draft ->
+                        runCatching { llamaEngine.loadDraftModel(draft.absolutePath) }
+                    }
+                    runCatching { reactAgent.warmUp() }
+
+                    // Without embeddings the answer cache just misses
+                    runCatching { llamaEngine.enableEmbeddings(modelManager.findEmbeddingModel()?.absolutePath) }
+                }
+            }
         } catch (e: Exception) {
             false
         }
     }
 
+    /**
+     * Swap to another downloaded model while the current one keeps answering
+     *
+     * The swap carries the draft model and the warmed system prompt over;
+     * the remembered choice is loaded on later launches.
+     */
+    private fun switchModel(file: File) {
+        if (switchProgress.value != null || file == modelManager.activeModelFile) return
+        lifecycleScope.launch {
+            switchProgress.value = 0f
+            try {
+                val swapped = runCatching {
+                    llamaEngine.swapModel(file.absolutePath) { progress ->
+                        switchProgress.value = progress
+                    }
+                }.getOrDefault(false)
+                if (swapped) {
+                    modelManager.setActiveModel(file)
+                }
+            } finally {
+                switchProgress.value = null
+            }
+        }
+    }
+
     override fun onDestroy() {
         super.onDestroy()
         llamaEngine.close()
@@ -250,6 +317,7 @@ class MainActivity : ComponentActivity() {
 
 sealed class AppState {
     object Loading : AppState()
+    data class LoadingModel(val progress: Float) : AppState()
     object PermissionDenied : AppState()
     object DownloadRequired : AppState()
     data class Downloading(val model: ModelOption, val progress: Float) : AppState()
@@ -355,7 +423,7 @@ fun AmbientBackgroundGlows() {
 // ==========================================================================
 
 @Composable
-fun LoadingScreen() {
+fun LoadingScreen(progress: Float? = null, tools: ToolsReadiness? = null) {
     val infiniteTransition = rememberInfiniteTransition(label = "loading")
 
     val floatOffset by infiniteTransition.animateFloat(
@@ -451,15 +519,44 @@ fun LoadingScreen() {
                 }
             }
 
+            if (progress != null) {
+                LinearProgressIndicator(
+                    progress = { progress },
+                    modifier = Modifier
+                        .width(200.dp)
+                        .height(4.dp)
+                        .clip(RoundedCornerShape(2.dp)),
+                    color = Color(0xFF10B981),
+                    trackColor = Color(0xFF27272A)
+                )
+            }
+
             Text(
-                text = "Initializing...",
+                text = if (progress != null) "Loading model... ${(progress * 100).toInt()}%" else "Initializing...",
                 fontSize = 14.sp,
                 color = Color(0xFF71717A)
             )
+
+            if (tools != null) {
+                Text(
+                    text = "Math tools: ${toolsLabel(tools)}",
+                    fontSize = 12.sp,
+                    color = if (tools == ToolsReadiness.READY) Color(0xFF34D399) else Color(0xFF71717A)
+                )
+            }
         }
     }
 }
 
+private fun toolsLabel(tools: ToolsReadiness): String = when (tools) {
+    ToolsReadiness.PENDING -> "waiting"
+    ToolsReadiness.STARTING_PYTHON -> "starting Python..."
+    ToolsReadiness.IMPORTING_SYMPY -> "loading SymPy..."
+    ToolsReadiness.WARMING -> "warming up..."
+    ToolsReadiness.READY -> "ready"
+    ToolsReadiness.FAILED -> "SymPy unavailable, using basic tools"
+}
+
 // ==========================================================================
 // Permission Denied Screen
 // ==========================================================================
@@ -1122,8 +1219,16 @@ fun DownloadingScreen(
 // ==========================================================================
 
 @Composable
-fun ChatScreen(agent: ReActAgent, isModelLoaded: Boolean, modelManager: ModelManager) {
+fun ChatScreen(
+    agent: ReActAgent,
+    isModelLoaded: Boolean,
+    modelManager: ModelManager,
+    switchProgress: Float? = null,
+    toolsReadiness: ToolsReadiness = ToolsReadiness.READY,
+    onSwitchModel: (File) -> Unit = {}
+) {
     val messages = remember { mutableStateListOf<ChatMessage>() }
+    val showModelMenu = remember { mutableStateOf(false) }
     val inputState = remember { mutableStateOf("") }
     val isGenerating = remember { mutableStateOf(false) }
     val listState = rememberLazyListState()
@@ -1207,12 +1312,32 @@ fun ChatScreen(agent: ReActAgent, isModelLoaded: Boolean, modelManager: ModelMan
                         fontWeight = FontWeight.Bold,
                         color = Color.White
                     )
-                    Text(
-                        text = "Socratic Tutor • Offline",
-                        fontSize = 11.sp,
-                        color = Color(0xFF34D399).copy(alpha = 0.7f),
-                        letterSpacing = 1.sp
-                    )
+                    // Tap to switch between downloaded models
+                    Box {
+                        Text(
+                            text = "Socratic Tutor • ${modelManager.activeModelFile.nameWithoutExtension}",
+                            fontSize = 11.sp,
+                            color = Color(0xFF34D399).copy(alpha = 0.7f),
+                            letterSpacing = 1.sp,
+                            maxLines = 1,
+                            modifier = Modifier.clickable { showModelMenu.value = true }
+                        )
+                        DropdownMenu(
+                            expanded = showModelMenu.value,
+                            onDismissRequest = { showModelMenu.value = false }
+                        ) {
+                            modelManager.getChatModels().forEach { file ->
+                                DropdownMenuItem(
+                                    text = { Text(file.nameWithoutExtension) },
+                                    enabled = switchProgress == null,
+                                    onClick = {
+                                        showModelMenu.value = false
+                                        onSwitchModel(file)
+                                    }
+                                )
+                            }
+                        }
+                    }
                 }
 
                 // Status indicator
@@ -1230,9 +1355,18 @@ fun ChatScreen(agent: ReActAgent, isModelLoaded: Boolean, modelManager: ModelMan
                             .pulse()
                     )
                     Text(
-                        text = if (isModelLoaded) "Ready" else "Loading",
+                        text = when {
+                            switchProgress != null -> "Switching ${(switchProgress * 100).toInt()}%"
+                            !isModelLoaded -> "Loading"
+                            !toolsReadiness.isSettled -> "Tools ${toolsLabel(toolsReadiness)}"
+                            else -> "Ready"
+                        },
                         fontSize = 11.sp,
-                        color = if (isModelLoaded) Color(0xFF34D399) else Color(0xFFFBBF24)
+                        color = if (isModelLoaded && switchProgress == null && toolsReadiness.isSettled) {
+                            Color(0xFF34D399)
+                        } else {
+                            Color(0xFFFBBF24)
+                        }
                     )
                 }
             }
@@ -1328,35 +1462,39 @@ fun ChatScreen(agent: ReActAgent, isModelLoaded: Boolean, modelManager: ModelMan
                                         )
                                     )
 
-                                    agent.chat(userMessage).collect { event ->
-                                        when (event) {
-                                            is AgentEvent.Token -> {
-                                                fullContent += event.text
-                                                updateMessageContent(messages, assistantMessageId, fullContent)
-                                            }
-                                            is AgentEvent.ToolCall -> {
-                                                updateMessageContent(
-                                                    messages,
-                                                    assistantMessageId,
-                                                    fullContent + "\n🔧 ${event.tool}"
-                                                )
+                                    // Leaving the screen cancels this scope, which cancels
+                                    // the native decode job before its next token
+                                    try {
+                                        agent.chat(userMessage).collect { event ->
+                                            when (event) {
+                                                is AgentEvent.Token -> {
+                                                    fullContent += event.text
+                                                    updateMessageContent(messages, assistantMessageId, fullContent)
+                                                }
+                                                is AgentEvent.ToolCall -> {
+                                                    updateMessageContent(
+                                                        messages,
+                                                        assistantMessageId,
+                                                        fullContent + "\n🔧 ${event.tool}"
+                                                    )
+                                                }
+                                                is AgentEvent.FinalAnswer -> {
+                                                    fullContent = event.text
+                                                    updateMessageContent(messages, assistantMessageId, fullContent)
+                                                }
+                                                is AgentEvent.Error -> {
+                                                    updateMessageContent(
+                                                        messages,
+                                                        assistantMessageId,
+                                                        fullContent + "\n❌ Error: ${event.message}"
+                                                    )
+                                                }
+                                                else -> {}
                                             }
-                                            is AgentEvent.FinalAnswer -> {
-                                                fullContent = event.text
-                                                updateMessageContent(messages, assistantMessageId, fullContent)
-                                            }
-                                            is AgentEvent.Error -> {
-                                                updateMessageContent(
-                                                    messages,
-                                                    assistantMessageId,
-                                                    fullContent + "\n❌ Error: ${event.message}"
-                                                )
-                                            }
-                                            else -> {}
                                         }
+                                    } finally {
+                                        isGenerating.value = false
                                     }
-
-                                    isGenerating.value = false
                                 }
                             }
                         },
@@ -9,16 +9,20 @@ import net.objecthunter.exp4j.ExpressionBuilder
 /**
  * Math tools for the Socratic Math Tutor
  *
- * Uses exp4j for numeric calculations and SymPy (via Chaquopy)
- * for symbolic algebra operations.
+ * Uses the native evaluator, then exp4j, for numeric calculations and
+ * SymPy (via Chaquopy) for symbolic algebra operations.
  *
  * These tools are called by the ReAct agent during math reasoning.
  */
 class MathTools(private val context: Context) {
 
-    private val sympy: SymPyBridge by lazy {
-        SymPyBridge(context).also { it.init() }
-    }
+    // Starts Python on first use, off the calling thread
+    private val sympy = SymPyBridge(context)
+
+    /**
+     * Bring up Python and SymPy ahead of the first tool call
+     */
+    suspend fun prewarm(onStage: (ToolsReadiness) -> Unit = {}) = sympy.prewarm(onStage)
 
     /**
      * Calculate a mathematical expression (numeric)
@@ -27,8 +31,25 @@ class MathTools(private val context: Context) {
      * - "2 + 2" → "4"
      * - "3.5 * 4" → "14"
      * - "sin(30 degrees)" → "0.5"
+     * - "1/3 + 1/6" → "0.5" (exactly 1/2)
+     *
+     * Plain arithmetic is answered by NativeCalculator without leaving the
+     * calling thread; exp4j and then SymPy only see what it rejects.
      */
-    suspend fun calculate(input: String): ToolResult = withContext(Dispatchers.IO) {
+    suspend fun calculate(input: String): ToolResult {
+        NativeCalculator.evaluate(input)?.let { value ->
+            val result = if (value.isInteger) value.numerator.toString() else formatResult(value.value)
+            val exact = if (value.isExact && !value.isInteger) " = ${value.numerator}/${value.denominator}" else ""
+            return ToolResult(
+                success = true,
+                result = result,
+                explanation = "Calculated: $input$exact = $result"
+            )
+        }
+        return calculateFallback(input)
+    }
+
+    private suspend fun calculateFallback(input: String): ToolResult = withContext(Dispatchers.IO) {
         try {
             val processed = preprocessTrig(input)
             val expression: Expression = ExpressionBuilder(processed).build()
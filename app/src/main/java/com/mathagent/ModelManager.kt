@@ -1,12 +1,31 @@
 package com.mathagent
 
 import android.content.Context
+import android.system.ErrnoException
+import android.system.Os
+import android.system.OsConstants
+import kotlinx.coroutines.CancellationException
 import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.coroutineScope
+import kotlinx.coroutines.currentCoroutineContext
+import kotlinx.coroutines.delay
+import kotlinx.coroutines.ensureActive
+import kotlinx.coroutines.joinAll
+import kotlinx.coroutines.launch
 import kotlinx.coroutines.withContext
 import java.io.File
+import java.io.FileInputStream
 import java.io.FileOutputStream
+import java.io.IOException
+import java.io.RandomAccessFile
 import java.net.HttpURLConnection
 import java.net.URL
+import java.nio.ByteBuffer
+import java.nio.channels.FileChannel
+import java.security.MessageDigest
+import java.util.BitSet
+import java.util.concurrent.atomic.AtomicInteger
+import java.util.concurrent.atomic.AtomicLong
 
 /**
  * Manages model download and storage
@@ -23,6 +42,26 @@ class ModelManager(private val context: Context) {
         private const val DEFAULT_MODEL_NAME = "Qwen2.5-Math-1.5B.Q4_K_M.gguf"
         private const val DEFAULT_MODEL_SIZE = 986048448L // ~940MB
 
+        // Small same-vocabulary models used as speculative decoding drafts
+        private val DRAFT_MODEL_PATTERN = Regex("""(?i)qwen2\.5-0\.5b""")
+
+        // Small sentence-embedding models for the semantic answer cache
+        private val EMBEDDING_MODEL_PATTERN = Regex("""(?i)embed|minilm|bge-|gte-|e5-""")
+
+        // Downloads
+        private const val DOWNLOAD_CONNECTIONS = 4
+        private const val DOWNLOAD_BUFFER_BYTES = 256 * 1024
+        private const val DOWNLOAD_STATE_EXTENSION = "chunks"      // Finished chunks of a .part file
+        private const val CHUNK_RETRIES = 3
+        private const val RETRY_BACKOFF_MS = 2000L                 // Times the attempt number
+        private const val MAX_REDIRECTS = 5
+        private val GGUF_MAGIC = "GGUF".toByteArray(Charsets.US_ASCII)
+        private val SHA256_PATTERN = Regex("[0-9a-f]{64}")
+
+        // Model picked with setActiveModel(), by file name
+        private const val PREFS_NAME = "model_manager"
+        private const val KEY_ACTIVE_MODEL = "active_model"
+
         /**
          * Registry of available models from HuggingFace
          */
@@ -65,17 +104,25 @@ class ModelManager(private val context: Context) {
     private val modelsDir: File
         get() = File(context.filesDir, "models").apply { mkdirs() }
 
+    private val prefs = context.getSharedPreferences(PREFS_NAME, Context.MODE_PRIVATE)
+
     /**
      * Get the currently active model file
      */
     val activeModelFile: File
         get() {
+            // The user's pick, while it is still downloaded
+            prefs.getString(KEY_ACTIVE_MODEL, null)
+                ?.let { File(modelsDir, it) }
+                ?.takeIf { it.exists() && !isAuxiliaryModel(it) }
+                ?.let { return it }
+
             // Check for downloaded models, prefer default
             val defaultFile = File(modelsDir, DEFAULT_MODEL_NAME)
             if (defaultFile.exists()) return defaultFile
 
-            // Return any downloaded GGUF file
-            modelsDir.listFiles()?.firstOrNull { it.extension == "gguf" }?.let {
+            // Return any downloaded GGUF file that isn't a draft or embedding model
+            modelsDir.listFiles()?.firstOrNull { it.extension == "gguf" && !isAuxiliaryModel(it) }?.let {
                 return it
             }
 
@@ -83,6 +130,42 @@ class ModelManager(private val context: Context) {
             return defaultFile
         }
 
+    /**
+     * Remember a downloaded model as the one to load on later launches
+     */
+    fun setActiveModel(file: File) {
+        prefs.edit().putString(KEY_ACTIVE_MODEL, file.name).apply()
+    }
+
+    /**
+     * Downloaded models that can be chatted with (everything but drafts
+     * and embedding models)
+     */
+    fun getChatModels(): List<File> {
+        return getDownloadedModels().filterNot { isAuxiliaryModel(it) }
+    }
+
+    /**
+     * Downloaded draft model for speculative decoding, if any
+     */
+    fun findDraftModel(): File? {
+        return getDownloadedModels().firstOrNull { isDraftModel(it) }
+    }
+
+    /**
+     * Downloaded embedding model for the answer cache, if any; without one
+     * the chat model embeds
+     */
+    fun findEmbeddingModel(): File? {
+        return getDownloadedModels().firstOrNull { isEmbeddingModel(it) }
+    }
+
+    private fun isDraftModel(file: File): Boolean = DRAFT_MODEL_PATTERN.containsMatchIn(file.name)
+
+    private fun isEmbeddingModel(file: File): Boolean = EMBEDDING_MODEL_PATTERN.containsMatchIn(file.name)
+
+    private fun isAuxiliaryModel(file: File): Boolean = isDraftModel(file) || isEmbeddingModel(file)
+
     /**
      * Get all downloaded models
      */
@@ -108,78 +191,375 @@ class ModelManager(private val context: Context) {
     /**
      * Download model from a direct URL
      *
+     * When the server takes byte ranges (HuggingFace and its CDN do), the
+     * file is fetched as DownloadState.CHUNK_BYTES chunks over several
+     * connections, written in place into a .part file preallocated to its
+     * full size (so the GGUF ends up contiguous for mmap). Finished chunks
+     * are recorded next to it, so a failed or cancelled download resumes
+     * where it stopped. Otherwise the file is streamed in one piece.
+     *
+     * The GGUF magic is checked as soon as the first chunk lands, and the
+     * whole file against expectedSha256 or, failing that, the SHA-256 that
+     * HuggingFace publishes for LFS files (X-Linked-Etag). A corrupt
+     * download is deleted rather than resumed.
+     *
      * @param url Direct download URL to GGUF file
      * @param fileName Optional custom filename (auto-detected from URL if null)
      * @param expectedSize Optional expected size for progress calculation
-     * @param onProgress Progress callback (bytes downloaded, total bytes)
+     * @param expectedSha256 Optional checksum (hex) the file must match
+     * @param onProgress Progress callback (bytes downloaded, total bytes),
+     *                   from background threads
      */
     suspend fun downloadFromUrl(
         url: String,
         fileName: String? = null,
         expectedSize: Long? = null,
+        expectedSha256: String? = null,
         onProgress: ((bytesDownloaded: Long, totalBytes: Long) -> Unit)? = null
     ): Result<File> = withContext(Dispatchers.IO) {
+        val targetFileName = fileName ?: url.substringAfterLast("/")
+        val outputFile = File(modelsDir, "$targetFileName.part")
+        val stateFile = File(modelsDir, "$targetFileName.part.$DOWNLOAD_STATE_EXTENSION")
+        val finalFile = File(modelsDir, targetFileName)
+
         try {
-            val targetFileName = fileName ?: url.substringAfterLast("/")
-            val outputFile = File(modelsDir, "$targetFileName.part")
-            val finalFile = File(modelsDir, targetFileName)
-
-            // Delete partial download if exists
-            if (outputFile.exists()) outputFile.delete()
-
-            val connection = URL(url).openConnection() as HttpURLConnection
-            connection.apply {
-                requestMethod = "GET"
-                connectTimeout = 30000
-                readTimeout = 60000  // Longer timeout for large files
-                setRequestProperty("Accept", "application/octet-stream")
-                setRequestProperty("User-Agent", "MathMentor-Android/1.0")
+            val remote = probe(URL(url))
+            val sha256 = expectedSha256 ?: remote.sha256
+
+            val digest = if (remote.rangeSupported) {
+                downloadRanged(remote, outputFile, stateFile, onProgress)
+                null
+            } else {
+                // No resume without ranges
+                stateFile.delete()
+                downloadStream(remote, outputFile, expectedSize ?: DEFAULT_MODEL_SIZE, onProgress)
             }
+            verifyDownload(outputFile, sha256, digest)
 
-            // Check response code
-            if (connection.responseCode != HttpURLConnection.HTTP_OK) {
-                return@withContext Result.failure(
-                    Exception("HTTP ${connection.responseCode}: ${connection.responseMessage}")
-                )
+            // Rename to final filename
+            if (outputFile.renameTo(finalFile)) {
+                stateFile.delete()
+                Result.success(finalFile)
+            } else {
+                Result.failure(Exception("Failed to complete download"))
             }
+        } catch (e: CancellationException) {
+            throw e
+        } catch (e: CorruptDownloadException) {
+            outputFile.delete()
+            stateFile.delete()
+            Result.failure(e)
+        } catch (e: Exception) {
+            Result.failure(e)
+        }
+    }
 
-            val contentLength = connection.contentLengthLong
-            val totalBytes = if (contentLength > 0) contentLength else (expectedSize ?: DEFAULT_MODEL_SIZE)
+    // ==========================================================================
+    // Download helpers
+    // ==========================================================================
 
-            val inputStream = connection.inputStream
-            val outputStream = FileOutputStream(outputFile)
+    private class RemoteFile(
+        val url: URL,               // After redirects
+        val totalBytes: Long,       // -1 if unknown
+        val rangeSupported: Boolean,
+        val sha256: String?,
+        val validator: String?      // Identifies the content for resuming
+    )
 
-            val buffer = ByteArray(8192)
-            var bytesRead: Int
-            var totalBytesRead = 0L
+    private class CorruptDownloadException(message: String) : IOException(message)
+
+    private fun openConnection(url: URL): HttpURLConnection =
+        (url.openConnection() as HttpURLConnection).apply {
+            requestMethod = "GET"
+            connectTimeout = 30000
+            readTimeout = 60000  // Longer timeout for large files
+            setRequestProperty("Accept", "application/octet-stream")
+            setRequestProperty("User-Agent", "MathMentor-Android/1.0")
+        }
+
+    /**
+     * Follow redirects by hand, keeping HuggingFace's checksum headers
+     * (only the first hop has them), and ask for one byte to learn whether
+     * ranges work and how large the file is
+     */
+    private fun probe(url: URL): RemoteFile {
+        var current = url
+        var sha256: String? = null
+        var linkedSize = -1L
+        repeat(MAX_REDIRECTS + 1) {
+            val connection = openConnection(current).apply {
+                instanceFollowRedirects = false
+                setRequestProperty("Range", "bytes=0-0")
+            }
+            try {
+                val code = connection.responseCode
+                connection.getHeaderField("X-Linked-Etag")?.let(::parseSha256)?.let { sha256 = it }
+                connection.getHeaderField("X-Linked-Size")?.toLongOrNull()?.let { linkedSize = it }
+                when (code) {
+                    in 300..399 -> {
+                        val location = connection.getHeaderField("Location")
+                            ?: throw IOException("HTTP $code without a Location")
+                        current = URL(current, location)
+                    }
+                    HttpURLConnection.HTTP_PARTIAL -> {
+                        val total = connection.getHeaderField("Content-Range")
+                            ?.substringAfterLast('/')?.toLongOrNull() ?: linkedSize
+                        val validator = sha256 ?: connection.getHeaderField("ETag")
+                        return RemoteFile(current, total, total > 0, sha256, validator)
+                    }
+                    HttpURLConnection.HTTP_OK -> {
+                        val total = connection.contentLengthLong.takeIf { it > 0 } ?: linkedSize
+                        return RemoteFile(current, total, false, sha256, null)
+                    }
+                    else -> throw IOException("HTTP $code: ${connection.responseMessage}")
+                }
+            } finally {
+                connection.disconnect()
+            }
+        }
+        throw IOException("Too many redirects")
+    }
+
+    private fun parseSha256(etag: String): String? =
+        etag.removePrefix("W/").trim('"').lowercase().takeIf { SHA256_PATTERN.matches(it) }
+
+    /**
+     * Fetch the pending chunks over DOWNLOAD_CONNECTIONS connections
+     */
+    private suspend fun downloadRanged(
+        remote: RemoteFile,
+        partFile: File,
+        stateFile: File,
+        onProgress: ((Long, Long) -> Unit)?
+    ) = coroutineScope {
+        val total = remote.totalBytes
+        val chunkCount = DownloadState.chunkCount(total)
+        val done = loadDownloadState(stateFile, partFile, total, remote.validator, chunkCount)
+        val pending = (0 until chunkCount).filterNot { done[it] }
+        val downloaded = AtomicLong(
+            (0 until chunkCount).filter { done[it] }.sumOf { DownloadState.chunkLength(it, total) }
+        )
+        onProgress?.invoke(downloaded.get(), total)
+
+        RandomAccessFile(partFile, "rw").use { raf ->
+            if (raf.length() != total) {
+                preallocate(raf, total)
+            }
+            val channel = raf.channel
+
+            FileOutputStream(stateFile, true).use { state ->
+                val next = AtomicInteger()
+                List(minOf(DOWNLOAD_CONNECTIONS, pending.size)) {
+                    launch {
+                        val buffer = ByteArray(DOWNLOAD_BUFFER_BYTES)
+                        while (true) {
+                            val index = pending.getOrNull(next.getAndIncrement()) ?: break
+                            downloadChunk(remote.url, channel, index, total, buffer, downloaded, onProgress)
+                            if (index == 0) {
+                                checkGgufMagic(channel)
+                            }
 
-            inputStream.use { input ->
-                outputStream.use { output ->
-                    while (input.read(buffer).also { bytesRead = it } != -1) {
-                        output.write(buffer, 0, bytesRead)
+                            // Durable before it is recorded, so a resume never trusts lost data
+                            channel.force(false)
+                            synchronized(state) {
+                                state.write("${DownloadState.record(index)}\n".toByteArray())
+                            }
+                        }
+                    }
+                }.joinAll()
+            }
+            channel.force(true)
+        }
+    }
+
+    /**
+     * Chunks already on disk, or none (and a fresh state file) if the .part
+     * file belongs to other content or cannot be trusted
+     */
+    private fun loadDownloadState(
+        stateFile: File,
+        partFile: File,
+        total: Long,
+        validator: String?,
+        chunkCount: Int
+    ): BitSet {
+        val lines = if (validator != null && stateFile.isFile && partFile.length() == total) {
+            stateFile.readLines()
+        } else {
+            emptyList()
+        }
+        return DownloadState.parse(lines, total, validator, chunkCount) ?: run {
+            partFile.delete()
+            stateFile.writeText(DownloadState.header(total, validator) + "\n")
+            BitSet(chunkCount)
+        }
+    }
+
+    /**
+     * Reserve the whole file up front: fails early when storage is short,
+     * and lets the filesystem lay the file out in one extent
+     */
+    private fun preallocate(raf: RandomAccessFile, size: Long) {
+        try {
+            Os.posix_fallocate(raf.fd, 0, size)
+        } catch (e: ErrnoException) {
+            if (e.errno == OsConstants.ENOSPC) {
+                throw IOException("Not enough free storage for ${size / (1024 * 1024)} MB")
+            }
+            // Filesystem without fallocate; a sparse file still works
+        }
+        raf.setLength(size)
+    }
+
+    /**
+     * Fetch one chunk into place, retrying with backoff on network errors
+     */
+    private suspend fun downloadChunk(
+        url: URL,
+        channel: FileChannel,
+        index: Int,
+        total: Long,
+        buffer: ByteArray,
+        downloaded: AtomicLong,
+        onProgress: ((Long, Long) -> Unit)?
+    ) {
+        val start = index * DownloadState.CHUNK_BYTES
+        val length = DownloadState.chunkLength(index, total)
+        var attempt = 0
+        while (true) {
+            var written = 0L
+            try {
+                val connection = openConnection(url).apply {
+                    setRequestProperty("Range", "bytes=$start-${start + length - 1}")
+                }
+                try {
+                    if (connection.responseCode != HttpURLConnection.HTTP_PARTIAL) {
+                        throw IOException("HTTP ${connection.responseCode} for chunk $index")
+                    }
+                    connection.inputStream.use { input ->
+                        while (written < length) {
+                            currentCoroutineContext().ensureActive()
+                            val bytesRead = input.read(buffer, 0, minOf(buffer.size.toLong(), length - written).toInt())
+                            if (bytesRead == -1) break
+                            val data = ByteBuffer.wrap(buffer, 0, bytesRead)
+                            while (data.hasRemaining()) {
+                                channel.write(data, start + written + data.position())
+                            }
+                            written += bytesRead
+                            onProgress?.invoke(downloaded.addAndGet(bytesRead.toLong()), total)
+                        }
+                    }
+                } finally {
+                    connection.disconnect()
+                }
+                if (written != length) {
+                    throw IOException("Chunk $index ended after $written of $length bytes")
+                }
+                return
+            } catch (e: IOException) {
+                downloaded.addAndGet(-written)
+                if (++attempt > CHUNK_RETRIES) throw e
+                delay(RETRY_BACKOFF_MS * attempt)
+            }
+        }
+    }
+
+    private fun checkGgufMagic(channel: FileChannel) {
+        val magic = ByteBuffer.allocate(GGUF_MAGIC.size)
+        channel.read(magic, 0)
+        if (!magic.array().contentEquals(GGUF_MAGIC)) {
+            throw CorruptDownloadException("Downloaded file is not a GGUF model")
+        }
+    }
+
+    /**
+     * Single-connection fallback, hashing as it streams
+     *
+     * @return SHA-256 of the file, hex
+     */
+    private suspend fun downloadStream(
+        remote: RemoteFile,
+        outputFile: File,
+        fallbackSize: Long,
+        onProgress: ((Long, Long) -> Unit)?
+    ): String {
+        val connection = openConnection(remote.url)
+        try {
+            if (connection.responseCode != HttpURLConnection.HTTP_OK) {
+                throw IOException("HTTP ${connection.responseCode}: ${connection.responseMessage}")
+            }
+            val contentLength = connection.contentLengthLong
+            val totalBytes = if (contentLength > 0) contentLength else remote.totalBytes.takeIf { it > 0 } ?: fallbackSize
+
+            val digest = MessageDigest.getInstance("SHA-256")
+            val buffer = ByteArray(DOWNLOAD_BUFFER_BYTES)
+            var totalBytesRead = 0L
+            connection.inputStream.use { input ->
+                RandomAccessFile(outputFile, "rw").use { raf ->
+                    raf.setLength(0)
+                    if (contentLength > 0) {
+                        preallocate(raf, contentLength)
+                    }
+                    while (true) {
+                        currentCoroutineContext().ensureActive()
+                        val bytesRead = input.read(buffer)
+                        if (bytesRead == -1) break
+                        raf.write(buffer, 0, bytesRead)
+                        digest.update(buffer, 0, bytesRead)
                         totalBytesRead += bytesRead
 
                         onProgress?.invoke(totalBytesRead, totalBytes)
                     }
+                    if (contentLength > 0 && totalBytesRead != contentLength) {
+                        throw IOException("Download ended after $totalBytesRead of $contentLength bytes")
+                    }
+                    raf.fd.sync()
                 }
             }
+            return digest.digest().toHex()
+        } finally {
+            connection.disconnect()
+        }
+    }
 
-            // Rename to final filename
-            if (outputFile.renameTo(finalFile)) {
-                Result.success(finalFile)
-            } else {
-                Result.failure(Exception("Failed to complete download"))
+    /**
+     * Check the GGUF magic and, when a checksum is known, the whole file
+     */
+    private fun verifyDownload(file: File, sha256: String?, streamedDigest: String?) {
+        RandomAccessFile(file, "r").use { checkGgufMagic(it.channel) }
+        if (sha256 == null) return
+
+        val actual = streamedDigest ?: run {
+            val digest = MessageDigest.getInstance("SHA-256")
+            val buffer = ByteArray(DOWNLOAD_BUFFER_BYTES)
+            FileInputStream(file).use { input ->
+                while (true) {
+                    val bytesRead = input.read(buffer)
+                    if (bytesRead == -1) break
+                    digest.update(buffer, 0, bytesRead)
+                }
             }
-        } catch (e: Exception) {
-            Result.failure(e)
+            digest.digest().toHex()
+        }
+        if (!actual.equals(sha256, ignoreCase = true)) {
+            throw CorruptDownloadException("Checksum mismatch: expected $sha256, got $actual")
         }
     }
 
+    private fun ByteArray.toHex(): String = joinToString("") { "%02x".format(it) }
+
     /**
      * Delete a model file
      */
     fun deleteModel(fileName: String): Boolean {
         val file = File(modelsDir, fileName)
+
+        // Saved prompt KV state belongs to this model and is useless without it
+        modelsDir.listFiles { f ->
+            f.extension == LlamaEngine.PROMPT_STATE_EXTENSION &&
+                f.name.startsWith("${file.nameWithoutExtension}.")
+        }?.forEach { it.delete() }
+
         return if (file.exists()) {
             file.delete()
         } else {
@@ -194,6 +574,12 @@ class ModelManager(private val context: Context) {
         val file = File(modelsDir, "$fileName.part")
         if (!file.exists()) return 0f
 
+        // Ranged downloads are preallocated; count their finished chunks
+        val state = File(modelsDir, "$fileName.part.$DOWNLOAD_STATE_EXTENSION")
+        if (state.isFile) {
+            DownloadState.progress(state.readLines())?.let { return it }
+        }
+
         // Estimate progress based on typical model size
         val estimatedSize = when {
             fileName.contains("Q5") -> 1_200_000_000L
@@ -227,6 +613,49 @@ class ModelManager(private val context: Context) {
     }
 }
 
+/**
+ * Chunk layout of a ranged download and its state file
+ *
+ * The state file is "<total> <validator>" followed by one "<index>." line
+ * per finished chunk, appended as chunks land; a torn last line lacks its
+ * dot and is ignored.
+ */
+internal object DownloadState {
+    const val CHUNK_BYTES = 8L * 1024 * 1024  // Unit of parallelism and resume
+
+    fun chunkCount(total: Long): Int = ((total + CHUNK_BYTES - 1) / CHUNK_BYTES).toInt()
+
+    fun chunkLength(index: Int, total: Long): Long = minOf(CHUNK_BYTES, total - index * CHUNK_BYTES)
+
+    fun header(total: Long, validator: String?): String = "$total ${validator ?: "-"}"
+
+    fun record(index: Int): String = "$index."
+
+    /**
+     * Finished chunks listed in a state file, or null if it does not belong
+     * to this content (no validator, or a different header)
+     */
+    fun parse(lines: List<String>, total: Long, validator: String?, chunkCount: Int): BitSet? {
+        if (validator == null || lines.firstOrNull() != header(total, validator)) return null
+        val done = BitSet(chunkCount)
+        for (line in lines.drop(1)) {
+            line.takeIf { it.endsWith('.') }?.dropLast(1)?.toIntOrNull()
+                ?.takeIf { it in 0 until chunkCount }
+                ?.let(done::set)
+        }
+        return done
+    }
+
+    /**
+     * Fraction of the download finished, or null if the file has no usable header
+     */
+    fun progress(lines: List<String>): Float? {
+        val total = lines.firstOrNull()?.substringBefore(' ')?.toLongOrNull()?.takeIf { it > 0 } ?: return null
+        val chunks = lines.drop(1).count { it.endsWith('.') }
+        return (chunks * CHUNK_BYTES.toFloat() / total).coerceAtMost(1f)
+    }
+}
+
 /**
  * Represents a downloadable model option
  */
@@ -0,0 +1,48 @@
+package com.mathagent
+
+/**
+ * Native arithmetic evaluator, the fast path of MathTools.calculate
+ *
+ * Lives in the mathagent library next to the llama.cpp bindings but needs
+ * no model or Python. Handles arithmetic, powers, factorials, trig in
+ * radians or degrees, implicit multiplication and exact rationals; returns
+ * null for anything else (variables, complex results), which callers hand
+ * to exp4j and SymPy.
+ */
+object NativeCalculator {
+
+    private val available: Boolean = try {
+        System.loadLibrary("mathagent")
+        true
+    } catch (e: UnsatisfiedLinkError) {
+        false
+    }
+
+    /**
+     * Evaluate an expression, or null if it is not plain arithmetic
+     */
+    fun evaluate(expression: String): Value? {
+        if (!available) return null
+        val fraction = LongArray(2)
+        val value = nativeEvaluate(expression, fraction)
+        if (value.isNaN()) return null
+        return Value(value, fraction[0], fraction[1])
+    }
+
+    private external fun nativeEvaluate(expression: String, fraction: LongArray): Double
+
+    /**
+     * An evaluated expression
+     *
+     * @property numerator Exact value's numerator when denominator is not 0
+     * @property denominator 0 if the value is not an exact rational
+     */
+    data class Value(
+        val value: Double,
+        val numerator: Long,
+        val denominator: Long
+    ) {
+        val isExact: Boolean get() = denominator != 0L
+        val isInteger: Boolean get() = denominator == 1L
+    }
+}
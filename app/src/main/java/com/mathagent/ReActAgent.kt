@@ -1,6 +1,9 @@
 package com.mathagent
 
 import android.content.Context
+import kotlinx.coroutines.async
+import kotlinx.coroutines.awaitAll
+import kotlinx.coroutines.coroutineScope
 import kotlinx.coroutines.flow.Flow
 import kotlinx.coroutines.flow.flow
 
@@ -21,7 +24,9 @@ import kotlinx.coroutines.flow.flow
  */
 class ReActAgent(
     private val llamaEngine: LlamaEngine,
-    private val context: Context
+    private val context: Context,
+    private val sessionId: Int = LlamaEngine.DEFAULT_SESSION,
+    private val answerCache: SemanticAnswerCache? = null
 ) {
     // Math tools instance with context
     private val mathTools = MathTools(context)
@@ -72,6 +77,9 @@ class ReActAgent(
         When you need to use a tool, output:
         {"action": "tool_name", "input": "parameter"}
 
+        When you need several tools that do not depend on each other, output a list:
+        [{"action": "tool_name", "input": "parameter"}, {"action": "tool_name", "input": "parameter"}]
+
         When you have the final answer, output:
         {"answer": "your response"}
 
@@ -79,61 +87,122 @@ class ReActAgent(
         not to do the work for them.
     """.trimIndent()
 
+    /**
+     * Prefill the system prompt so the first chat() skips it
+     *
+     * Call once after the model is loaded; the KV state is persisted so
+     * later app launches restore it instead of recomputing.
+     */
+    suspend fun warmUp(): Boolean = llamaEngine.warmSystemPrompt(buildSystemPrefix(), sessionId)
+
+    /**
+     * Start the tools' Python runtime; run it concurrently with the model load
+     */
+    suspend fun prewarmTools(onStage: (ToolsReadiness) -> Unit = {}) = mathTools.prewarm(onStage)
+
+    /**
+     * Hit rate and lookup latency of the answer cache, if there is one
+     */
+    fun answerCacheStats(): SemanticCacheStats? = answerCache?.stats()
+
     /**
      * Process a user message through the ReAct loop
      *
-     * Streams responses as tokens are generated
+     * Streams responses as tokens are generated. Cancelling the collector
+     * cancels the in-flight native generation, so no decode steps are spent
+     * after the caller goes away.
+     *
+     * With an answer cache, a question matching an earlier one replays that
+     * answer and its tool calls instead of running the loop.
      */
     fun chat(userMessage: String): Flow<AgentEvent> = flow {
-        // Build prompt with system instructions
-        val fullPrompt = buildFullPrompt(userMessage)
+        val lookup = answerCache?.lookup(userMessage)
+        lookup?.hit?.let { cached ->
+            emit(AgentEvent.CacheHit(cached.question, lookup.similarity))
+            cached.toolTrace.forEach { step ->
+                emit(AgentEvent.ToolCall(step.tool, step.input))
+                emit(AgentEvent.ToolResult(step.tool, step.success, step.output))
+            }
+            emit(AgentEvent.FinalAnswer(cached.answer))
+            return@flow
+        }
+        val toolTrace = ArrayList<ToolStep>()
+
+        // The prompt lives in the session's native transcript: system
+        // instructions, the user turn, then one "response + observation"
+        // step per tool call, each pushed (and tokenized) once
+        llamaEngine.clearTranscript(sessionId)
+        val headTokens = llamaEngine.appendTranscript(buildSystemPrefix(), sessionId, addSpecial = true) +
+            llamaEngine.appendTranscript(buildUserTurn(userMessage), sessionId)
+        val stepTokens = ArrayDeque<Int>()
+        var totalTokens = headTokens
 
         // ReAct loop: Thought → Action → Observation → ...
         var remainingIterations = MAX_ITERATIONS
         var finalAnswer: String? = null
-        var conversationHistory = fullPrompt
 
         while (remainingIterations-- > 0 && finalAnswer == null) {
             // Generate from LLM with grammar-constrained output
             val response = StringBuilder()
-            llamaEngine.generate(
-                prompt = conversationHistory,
+            var metrics: GenerationMetrics? = null
+            totalTokens = dropOldestSteps(headTokens, stepTokens, totalTokens)
+            llamaEngine.generateFromTranscript(
                 grammar = REACT_JSON_GRAMMAR,
+                sessionId = sessionId,
+                onMetrics = { metrics = it },
                 onToken = { token ->
                     response.append(token)
                     emit(AgentEvent.Token(token))
                 }
             )
+            metrics?.let { emit(AgentEvent.Metrics(MAX_ITERATIONS - remainingIterations, it)) }
 
             val responseText = response.toString().trim()
 
             // Parse the JSON response
             when {
                 responseText.contains("\"action\"") -> {
-                    // Tool call detected
-                    val toolCall = parseToolCall(responseText)
-
-                    // Execute the tool
-                    emit(AgentEvent.ToolCall(toolCall.action, toolCall.input))
-                    val result = executeTool(toolCall.action, toolCall.input, userMessage)
-
-                    // Feed observation back to LLM
-                    val observation = if (result.success) {
-                        "Tool ${toolCall.action} returned: ${result.result}\n${result.explanation}"
-                    } else {
-                        "Tool ${toolCall.action} failed: ${result.error}"
+                    // Tool calls detected; independent calls run concurrently
+                    val toolCalls = parseToolCalls(responseText)
+                    toolCalls.forEach { emit(AgentEvent.ToolCall(it.action, it.input)) }
+
+                    // The model's step is known already, so the engine prefills
+                    // it while the tools run. It ends at the line break, where
+                    // the tokenizer splits anyway
+                    var added = llamaEngine.appendTranscript("$responseText\n", sessionId)
+                    val results = coroutineScope {
+                        val prefill = async { llamaEngine.prefillTranscript(sessionId) }
+                        val results = toolCalls
+                            .map { async { executeTool(it.action, it.input, userMessage) } }
+                            .awaitAll()
+                        prefill.await()
+                        results
                     }
 
-                    emit(AgentEvent.ToolResult(toolCall.action, result.success, observation))
+                    // Feed observations back to LLM, one line per call
+                    val observations = toolCalls.zip(results) { toolCall, result ->
+                        val observation = if (result.success) {
+                            "Tool ${toolCall.action} returned: ${result.result}\n${result.explanation}"
+                        } else {
+                            "Tool ${toolCall.action} failed: ${result.error}"
+                        }
+                        emit(AgentEvent.ToolResult(toolCall.action, result.success, observation))
+                        toolTrace.add(ToolStep(toolCall.action, toolCall.input, result.success, observation))
+                        observation
+                    }
 
-                    // Add to conversation for next iteration
-                    conversationHistory += "\nObservation: $observation\n"
+                    // Add the observation lines whole, for the next iteration
+                    val observed = observations.joinToString("") { "Observation: $it\n" }
+                    added += llamaEngine.appendTranscript(observed, sessionId)
+                    stepTokens.addLast(added)
+                    totalTokens += added
                 }
 
                 responseText.contains("\"answer\"") -> {
                     // Final answer
                     finalAnswer = extractAnswer(responseText)
                     emit(AgentEvent.FinalAnswer(finalAnswer))
+                    lookup?.let { answerCache?.store(it, finalAnswer, toolTrace) }
                 }
 
                 else -> {
@@ -144,7 +213,7 @@ class ReActAgent(
             }
         }
 
-        if (finalAnswer == null && maxIterations <= 0) {
+        if (finalAnswer == null && remainingIterations < 0) {
             emit(AgentEvent.Error("Agent exceeded maximum iterations"))
         }
     }
@@ -190,15 +259,48 @@ class ReActAgent(
     // Prompt building and parsing
     // ==========================================================================
 
-    private fun buildFullPrompt(userMessage: String): String {
+    private fun buildSystemPrefix(): String {
         return """<|im_start|>system
 $systemPrompt<|im_end|>
-<|im_start|>user
+"""
+    }
+
+    private fun buildUserTurn(userMessage: String): String {
+        return """<|im_start|>user
 $userMessage<|im_end|>
 <|im_start|>assistant
 """
     }
 
+    /**
+     * Make room for the next generation in the transcript
+     *
+     * If the history would leave less than a full generation of room in the
+     * context, the oldest steps are erased right after the head (system
+     * prompt and question, which must stay). The engine shifts the erased
+     * steps out of the KV cache in place, so the steps after them keep their
+     * cache and only the new step is prefilled.
+     *
+     * @return Tokens left in the transcript
+     */
+    private fun dropOldestSteps(headTokens: Int, stepTokens: ArrayDeque<Int>, totalTokens: Int): Int {
+        val budget = llamaEngine.contextSize - LlamaEngine.MAX_TOKENS
+        var total = totalTokens
+        while (total > budget && stepTokens.isNotEmpty()) {
+            total = llamaEngine.eraseTranscript(headTokens, stepTokens.removeFirst(), sessionId)
+        }
+        return total
+    }
+
+    private fun parseToolCalls(response: String): List<ToolCall> {
+        // Extract every call from a list like: [{"action": "calculate", "input": "2+2"}, ...]
+        val thought = extractThought(response) ?: "Thinking..."
+        val toolCalls = TOOL_CALL_PATTERN.findAll(response)
+            .map { ToolCall(thought, it.groupValues[1], it.groupValues[2]) }
+            .toList()
+        return toolCalls.ifEmpty { listOf(parseToolCall(response)) }
+    }
+
     private fun parseToolCall(response: String): ToolCall {
         // Extract action and input from JSON like: {"action": "calculate", "input": "2+2"}
         val actionMatch = ACTION_PATTERN.find(response)
@@ -234,25 +336,31 @@ $userMessage<|im_end|>
         private val INPUT_PATTERN = Regex(""""input":\s*"([^"]+)"""")
         private val THOUGHT_PATTERN = Regex(""""thought":\s*"([^"]+)"""")
         private val ANSWER_PATTERN = Regex(""""answer":\s*"([^"]+)"""")
+        private val TOOL_CALL_PATTERN = Regex(""""action":\s*"([^"]+)"\s*,\s*"input":\s*"([^"]*)"""")
 
         /**
          * Optimized GBNF Grammar for llama.cpp
          *
          * Forces the LLM to output valid JSON with either:
          * - Tool call: {"action": "...", "input": "..."}
+         * - Independent tool calls: [{"action": ...}, {"action": ...}]
          * - Final answer: {"answer": "..."}
          *
          * Optimizations:
          * - Uses escape sequences for quotes in strings
          * - Allows nested JSON with escaped content
          * - More robust pattern matching
+         *
+         * JSON keys are quoted literals so the output matches ACTION_PATTERN
+         * and friends. The engine compiles this once and caches it by hash.
          */
         const val REACT_JSON_GRAMMAR = """
-            root ::= tool_call | final_answer | text
+            root ::= tool_calls | final_answer | text
+
+            tool_calls ::= tool_call | "[" ws tool_call (ws "," ws tool_call)* ws "]"
 
-            tool_call ::= "{" ws "action" ws ":" ws quote action quote "," ws "input" ws ":" ws quote input quote "}"
-            final_answer ::= "{" ws "answer" ws ":" ws quote text quote "}"
-            text ::= [^\n"]*
+            tool_call ::= "{" ws quote "action" quote ws ":" ws quote action quote ws "," ws quote "input" quote ws ":" ws quote input quote ws "}"
+            final_answer ::= "{" ws quote "answer" quote ws ":" ws quote text quote ws "}"
 
             action ::= "calculate" | "solve_equation" | "simplify_expression" | "expand_expression" | "factor_expression" | "get_hint" | "verify_worked_example" | "check_answer"
             input ::= string_content
@@ -261,7 +369,7 @@ $userMessage<|im_end|>
             text ::= [^"\n]*
 
             ws ::= " "*
-            quote ::= '"'
+            quote ::= "\""
         """
     }
 
@@ -276,7 +384,7 @@ $userMessage<|im_end|>
  * Events emitted during ReAct loop execution
  */
 sealed class AgentEvent {
-    /** Individual token being streamed */
+    /** Streamed text (one or more tokens, batched by the engine) */
     data class Token(val text: String) : AgentEvent()
 
     /** Tool being called */
@@ -285,9 +393,15 @@ sealed class AgentEvent {
     /** Result from tool execution */
     data class ToolResult(val tool: String, val success: Boolean, val output: String) : AgentEvent()
 
+    /** The answer that follows is replayed from a similar earlier question */
+    data class CacheHit(val question: String, val similarity: Float) : AgentEvent()
+
     /** Final answer from agent */
     data class FinalAnswer(val text: String) : AgentEvent()
 
     /** Error occurred */
     data class Error(val message: String) : AgentEvent()
+
+    /** Performance counters of one generation; iteration counts from 1 */
+    data class Metrics(val iteration: Int, val metrics: GenerationMetrics) : AgentEvent()
 }
@@ -0,0 +1,324 @@
+package com.mathagent
+
+import android.util.Log
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.withContext
+import java.io.DataInputStream
+import java.io.DataOutputStream
+import java.io.File
+import java.io.IOException
+import java.util.concurrent.atomic.AtomicLong
+
+/**
+ * Answers to past questions, found again by meaning
+ *
+ * Each entry keeps a question's embedding, the agent's final answer and the
+ * tool calls that led to it. A new question hits an entry when their cosine
+ * similarity reaches the threshold AND their math signature (the question
+ * without its filler words) is identical. Embeddings alone
+ * put "Solve 2x + 5 = 15" right next to "Solve 2x + 5 = 17"; the signature is
+ * what keeps the second from replaying the first's answer, while the
+ * embedding matches the phrasing around it ("how do I solve ...", "help me
+ * with ...").
+ *
+ * The index is a flat array searched exhaustively: at MAX_ENTRIES vectors of
+ * a few thousand floats that is a fraction of a millisecond, well below the
+ * cost of embedding the question. Entries persist to one binary file and are
+ * dropped when the embedding model changes, since its vectors are not
+ * comparable with the old ones.
+ *
+ * @param file Where entries are stored, e.g. in filesDir
+ * @param threshold Minimum cosine similarity for a hit
+ */
+class SemanticAnswerCache internal constructor(
+    private val embedder: QuestionEmbedder,
+    private val file: File,
+    private val threshold: Float = DEFAULT_THRESHOLD
+) {
+    constructor(llamaEngine: LlamaEngine, file: File, threshold: Float = DEFAULT_THRESHOLD) : this(
+        object : QuestionEmbedder {
+            override val modelId: String? get() = llamaEngine.embeddingModelId
+            override suspend fun embed(text: String): FloatArray? = llamaEngine.embed(text)
+        },
+        file,
+        threshold
+    )
+
+    companion object {
+        private const val TAG = "SemanticAnswerCache"
+
+        const val DEFAULT_THRESHOLD = 0.92f     // Mean-pooled chat model states sit close together
+        private const val MAX_ENTRIES = 500     // Oldest are evicted
+        private const val FILE_MAGIC = 0x4d415343  // "MASC"
+        private const val FILE_VERSION = 2      // 2: signatures keep every non-filler word
+
+        // Phrasing that never changes what is asked. Any other word may
+        // ("greater" vs "less", "prime" vs "even", "not"), so it is kept.
+        // Single letters are variables, except "i" and the "s" of "what's".
+        private val FILLER_WORDS = setOf(
+            "i", "s", "me", "my", "you", "we", "us", "it", "this", "that", "an", "the",
+            "is", "are", "was", "be", "do", "does", "did", "can", "could", "would", "will", "should",
+            "please", "help", "how", "what", "whats", "tell", "show", "find", "give", "get", "work", "out",
+            "want", "need", "know", "like", "let", "lets", "just", "now", "so", "if",
+            "of", "to", "for", "with", "by", "in", "on", "at", "hi", "hey", "thanks", "question", "problem"
+        )
+        // Whole words only: the "xy" of "2xy" is a product, not phrasing
+        private val WORD = Regex("\\b[a-z]+\\b")
+        private val NOT_MATH = Regex("[^a-z0-9.+\\-*/^=()<>!%,°]")
+
+        /**
+         * The parts of a question that decide its answer: everything but
+         * filler words, lowercased, with whitespace and other punctuation
+         * removed
+         */
+        internal fun mathSignature(question: String): String {
+            val words = WORD.replace(question.lowercase()) { match ->
+                if (match.value in FILLER_WORDS) " " else match.value
+            }
+            return NOT_MATH.replace(words, "").trimEnd('.', ',')
+        }
+    }
+
+    /**
+     * A question's embedding and signature, with the entry it hit, if any
+     *
+     * Pass it back to store() after answering a miss, so the question is not
+     * embedded twice.
+     */
+    class Lookup internal constructor(
+        val question: String,
+        internal val signature: String,
+        internal val embedding: FloatArray?,
+        internal val modelId: String?,
+        val hit: CachedAnswer?,
+        val similarity: Float
+    )
+
+    private class Entry(
+        val signature: String,
+        val embedding: FloatArray,
+        val answer: CachedAnswer
+    )
+
+    // Insertion order, oldest first; guarded by this
+    private val entries = ArrayList<Entry>()
+    private var entriesModelId: String? = null
+    private var loadedFromDisk = false
+
+    private val lookups = AtomicLong()
+    private val hits = AtomicLong()
+    private val lookupNanos = AtomicLong()
+
+    /**
+     * Find a cached answer for a question
+     *
+     * Returns a miss without counting it when embeddings are off.
+     */
+    suspend fun lookup(question: String): Lookup {
+        val start = System.nanoTime()
+        val text = normalize(question)
+        val signature = mathSignature(text)
+        val modelId = embedder.modelId
+        val embedding = modelId?.let { embedder.embed(text) }
+            ?: return Lookup(text, signature, null, null, null, 0f)
+
+        val best = withContext(Dispatchers.IO) {
+            synchronized(this@SemanticAnswerCache) {
+                ensureLoaded(modelId)
+                search(embedding, signature)
+            }
+        }
+        val hit = best?.takeIf { it.second >= threshold }
+
+        lookups.incrementAndGet()
+        if (hit != null) hits.incrementAndGet()
+        lookupNanos.addAndGet(System.nanoTime() - start)
+        return Lookup(text, signature, embedding, modelId, hit?.first?.answer, best?.second ?: 0f)
+    }
+
+    /**
+     * Remember the answer to a question that missed
+     */
+    suspend fun store(lookup: Lookup, answer: String, toolTrace: List<ToolStep>) {
+        val embedding = lookup.embedding ?: return
+        val modelId = lookup.modelId ?: return
+        withContext(Dispatchers.IO) {
+            synchronized(this@SemanticAnswerCache) {
+                ensureLoaded(modelId)
+                if (entriesModelId != modelId) return@withContext
+                entries.removeAll { it.signature == lookup.signature && dot(it.embedding, embedding) >= threshold }
+                entries.add(Entry(lookup.signature, embedding, CachedAnswer(lookup.question, answer, toolTrace)))
+                while (entries.size > MAX_ENTRIES) entries.removeAt(0)
+                save()
+            }
+        }
+    }
+
+    /**
+     * Drop every entry, in memory and on disk
+     */
+    @Synchronized
+    fun clear() {
+        loadedFromDisk = true
+        entries.clear()
+        file.delete()
+    }
+
+    fun stats(): SemanticCacheStats = SemanticCacheStats(
+        lookups = lookups.get(),
+        hits = hits.get(),
+        totalLookupMillis = lookupNanos.get() / 1_000_000f,
+        entries = synchronized(this) { entries.size }
+    )
+
+    private fun search(embedding: FloatArray, signature: String): Pair<Entry, Float>? {
+        var best: Entry? = null
+        var bestSimilarity = -1f
+        for (entry in entries) {
+            if (entry.signature != signature) continue
+            val similarity = dot(entry.embedding, embedding)
+            if (similarity > bestSimilarity) {
+                best = entry
+                bestSimilarity = similarity
+            }
+        }
+        return best?.let { it to bestSimilarity }
+    }
+
+    // Both vectors are L2-normalized, so this is their cosine similarity
+    private fun dot(a: FloatArray, b: FloatArray): Float {
+        if (a.size != b.size) return -1f
+        var sum = 0f
+        for (i in a.indices) sum += a[i] * b[i]
+        return sum
+    }
+
+    private fun normalize(question: String): String = question.trim().replace(Regex("\\s+"), " ")
+
+    // --------------------------------------------------------------------------
+    // Persistence
+    // --------------------------------------------------------------------------
+
+    private fun ensureLoaded(modelId: String) {
+        if (!loadedFromDisk) {
+            loadedFromDisk = true
+            load()
+        }
+        if (entriesModelId != modelId) {
+            if (entries.isNotEmpty()) Log.i(TAG, "Embedding model changed, dropping ${entries.size} answers")
+            entries.clear()
+            entriesModelId = modelId
+        }
+    }
+
+    private fun load() {
+        if (!file.exists()) return
+        try {
+            DataInputStream(file.inputStream().buffered()).use { input ->
+                if (input.readInt() != FILE_MAGIC || input.readInt() != FILE_VERSION) return
+                entriesModelId = input.readUTF()
+                val dimensions = input.readInt()
+                repeat(input.readInt()) {
+                    val signature = input.readUTF()
+                    val question = input.readString()
+                    val answer = input.readString()
+                    val trace = List(input.readInt()) {
+                        ToolStep(input.readUTF(), input.readString(), input.readBoolean(), input.readString())
+                    }
+                    val embedding = FloatArray(dimensions) { input.readFloat() }
+                    entries.add(Entry(signature, embedding, CachedAnswer(question, answer, trace)))
+                }
+            }
+        } catch (e: IOException) {
+            Log.w(TAG, "Discarding unreadable answer cache", e)
+            entries.clear()
+            entriesModelId = null
+        }
+    }
+
+    // Written whole to a temporary file and renamed over the old one
+    private fun save() {
+        val modelId = entriesModelId ?: return
+        val tmp = File(file.path + ".tmp")
+        try {
+            DataOutputStream(tmp.outputStream().buffered()).use { output ->
+                output.writeInt(FILE_MAGIC)
+                output.writeInt(FILE_VERSION)
+                output.writeUTF(modelId)
+                output.writeInt(entries.firstOrNull()?.embedding?.size ?: 0)
+                output.writeInt(entries.size)
+                for (entry in entries) {
+                    output.writeUTF(entry.signature)
+                    output.writeString(entry.answer.question)
+                    output.writeString(entry.answer.answer)
+                    output.writeInt(entry.answer.toolTrace.size)
+                    for (step in entry.answer.toolTrace) {
+                        output.writeUTF(step.tool)
+                        output.writeString(step.input)
+                        output.writeBoolean(step.success)
+                        output.writeString(step.output)
+                    }
+                    entry.embedding.forEach { output.writeFloat(it) }
+                }
+            }
+            if (!tmp.renameTo(file)) tmp.delete()
+        } catch (e: IOException) {
+            Log.w(TAG, "Failed to save answer cache", e)
+            tmp.delete()
+        }
+    }
+
+    // writeUTF caps strings at 64 KB; answers and tool output may not fit
+    private fun DataOutputStream.writeString(value: String) {
+        val bytes = value.toByteArray(Charsets.UTF_8)
+        writeInt(bytes.size)
+        write(bytes)
+    }
+
+    private fun DataInputStream.readString(): String {
+        val bytes = ByteArray(readInt())
+        readFully(bytes)
+        return String(bytes, Charsets.UTF_8)
+    }
+}
+
+/**
+ * Where SemanticAnswerCache gets its vectors; LlamaEngine in the app
+ */
+internal interface QuestionEmbedder {
+    /** Identifies the model behind embed(), or null if embeddings are off */
+    val modelId: String?
+
+    /** An L2-normalized embedding, or null if it failed */
+    suspend fun embed(text: String): FloatArray?
+}
+
+/**
+ * A past question's final answer and the tool calls behind it
+ */
+data class CachedAnswer(
+    val question: String,
+    val answer: String,
+    val toolTrace: List<ToolStep>
+)
+
+/**
+ * One tool call of an answered question, as shown to the user
+ */
+data class ToolStep(
+    val tool: String,
+    val input: String,
+    val success: Boolean,
+    val output: String
+)
+
+data class SemanticCacheStats(
+    val lookups: Long,
+    val hits: Long,
+    val totalLookupMillis: Float,   // Embedding included
+    val entries: Int
+) {
+    val hitRate: Float get() = if (lookups == 0L) 0f else hits.toFloat() / lookups
+
+    val meanLookupMillis: Float get() = if (lookups == 0L) 0f else totalLookupMillis / lookups
+}
@@ -4,28 +4,79 @@ import android.content.Context
 import com.chaquo.python.Python
 import com.chaquo.python.PyException
 import com.chaquo.python.android.AndroidPlatform
+import kotlinx.coroutines.CancellationException
 import kotlinx.coroutines.Dispatchers
 import kotlinx.coroutines.withContext
+import org.json.JSONArray
+import org.json.JSONException
+import org.json.JSONObject
+import java.io.File
+import java.io.IOException
+import java.security.MessageDigest
+import java.util.concurrent.atomic.AtomicInteger
+import java.util.concurrent.atomic.AtomicLong
 
 /**
  * SymPy bridge using Chaquopy
  *
  * Provides access to Python symbolic math capabilities
  * through SymPy for algebraic simplification, equation solving, etc.
+ *
+ * Results are memoized on (method, normalized arguments) in a process-wide
+ * LRU, backed by a directory under cacheDir unless diskCache is false, so
+ * repeated tool calls skip Python within and across chats and restarts.
  */
-class SymPyBridge(private val context: Context) {
+class SymPyBridge(private val context: Context, private val diskCache: Boolean = true) {
 
     private val python: Python by lazy { Python.getInstance() }
 
-    // Cache the module reference to avoid repeated lookups
-    private val sympyModule by lazy { python.getModule("sympy_bridge") }
+    // Cache the module reference to avoid repeated lookups; the first
+    // lookup starts Python and imports the module (and SymPy)
+    private val sympyModule by lazy {
+        init()
+        python.getModule("sympy_bridge")
+    }
 
     /**
      * Initialize Python environment
      */
     fun init() {
-        if (!Python.isStarted()) {
-            Python.start(AndroidPlatform(context))
+        // Python is process-wide; prewarm and a first tool call may race here
+        synchronized(SymPyBridge::class.java) {
+            if (!Python.isStarted()) {
+                Python.start(AndroidPlatform(context))
+            }
+        }
+    }
+
+    /**
+     * Start Python, import sympy_bridge and run one solve
+     *
+     * The interpreter and imported modules are process-wide, so running this
+     * once (alongside the model load) takes the multi-second first-call
+     * stall out of the first tool-using answer. The solve bypasses the
+     * result cache, which could otherwise answer it without Python.
+     *
+     * @param onStage Called, from a background thread, as each stage starts
+     *                and once with READY or FAILED
+     */
+    suspend fun prewarm(onStage: (ToolsReadiness) -> Unit = {}) = withContext(Dispatchers.IO) {
+        try {
+            onStage(ToolsReadiness.STARTING_PYTHON)
+            init()
+            onStage(ToolsReadiness.IMPORTING_SYMPY)
+            sympyModule.let { module ->
+                onStage(ToolsReadiness.WARMING)
+                module.callAttr("solve_equation", PREWARM_EQUATION)
+            }
+            onStage(ToolsReadiness.READY)
+        } catch (e: CancellationException) {
+            throw e
+        } catch (e: Throwable) {
+            // Not only PyException: Python.start and AndroidPlatform can throw
+            // RuntimeException or UnsatisfiedLinkError, and this runs in the
+            // activity's scope, where anything uncaught crashes the app
+            onStage(ToolsReadiness.FAILED)
         }
     }
 
@@ -82,14 +133,22 @@ class SymPyBridge(private val context: Context) {
 
     /**
      * Generic method invoker to reduce boilerplate
+     *
+     * Answers from the result cache when it can; Python errors are not
+     * cached, results Python returned (including failures) are.
      */
     private suspend fun invokeMethod(
         methodName: String,
         vararg args: Any?
     ): SymPyResult = withContext(Dispatchers.IO) {
+        if (diskCache) {
+            resultCache.attachDisk(File(context.cacheDir, RESULT_CACHE_DIR))
+        }
+        val key = resultKey(methodName, args)
+        resultCache.get(key)?.let { return@withContext it }
         try {
             val result = sympyModule.callAttr(methodName, *args)
-            SymPyResult.fromPyObject(result)
+            SymPyResult.fromPyObject(result).also { resultCache.put(key, it) }
         } catch (e: PyException) {
             SymPyResult(
                 success = false,
@@ -99,6 +158,191 @@ class SymPyBridge(private val context: Context) {
             )
         }
     }
+
+    companion object {
+        private const val RESULT_CACHE_ENTRIES = 256  // In memory
+        private const val RESULT_CACHE_DIR = "sympy_results"
+        private const val RESULT_CACHE_VERSION = 1    // Bump when sympy_bridge.py changes its output
+        private const val PREWARM_EQUATION = "2*x + 1 = 5"  // Pulls in parsing and the solver
+
+        // Spaces around operators never change what an argument means
+        private val OPERATOR_SPACING = Regex("""\s*([-+*/^=(),])\s*""")
+        private val WHITESPACE = Regex("""\s+""")
+
+        private val resultCache = ToolResultCache(RESULT_CACHE_ENTRIES)
+
+        /**
+         * Hit and miss counters of the result cache since process start
+         */
+        fun cacheStats(): ToolCacheStats = resultCache.stats()
+
+        internal fun resultKey(methodName: String, args: Array<out Any?>): String =
+            args.joinToString("\u0000", prefix = "$RESULT_CACHE_VERSION\u0000$methodName\u0000") {
+                it.toString().trim()
+                    .replace(OPERATOR_SPACING, "$1")
+                    .replace(WHITESPACE, " ")
+            }
+    }
+}
+
+/**
+ * Startup stages of the Python/SymPy tools, in order
+ */
+enum class ToolsReadiness {
+    PENDING,
+    STARTING_PYTHON,
+    IMPORTING_SYMPY,
+    WARMING,
+    READY,
+    FAILED;         // Tools still work, falling back to their non-SymPy paths
+
+    val isSettled: Boolean get() = this == READY || this == FAILED
+}
+
+/**
+ * Bounded LRU of SymPy results with an optional directory tier
+ *
+ * Memory misses fall through to one JSON file per entry, named by the
+ * key's SHA-256, and disk hits are promoted back into memory. The
+ * directory is trimmed to its least recently used files as it grows.
+ */
+internal class ToolResultCache(private val capacity: Int) {
+    private val entries = object : LinkedHashMap<String, SymPyResult>(capacity, 0.75f, true) {
+        override fun removeEldestEntry(eldest: MutableMap.MutableEntry<String, SymPyResult>): Boolean =
+            size > capacity
+    }
+
+    @Volatile
+    private var dir: File? = null
+    private val diskEntries = AtomicInteger()
+
+    private val hits = AtomicLong()
+    private val diskHits = AtomicLong()
+    private val misses = AtomicLong()
+
+    @Synchronized
+    fun attachDisk(directory: File) {
+        if (dir == directory) return
+        if (!directory.isDirectory && !directory.mkdirs()) return
+        dir = directory
+        trimDisk(directory)
+    }
+
+    fun get(key: String): SymPyResult? {
+        synchronized(this) { entries[key] }?.let {
+            hits.incrementAndGet()
+            return it
+        }
+        readDisk(key)?.let {
+            diskHits.incrementAndGet()
+            synchronized(this) { entries[key] = it }
+            return it
+        }
+        misses.incrementAndGet()
+        return null
+    }
+
+    fun put(key: String, result: SymPyResult) {
+        synchronized(this) { entries[key] = result }
+        writeDisk(key, result)
+    }
+
+    fun stats(): ToolCacheStats = ToolCacheStats(hits.get(), diskHits.get(), misses.get())
+
+    private fun fileFor(directory: File, key: String): File {
+        val digest = MessageDigest.getInstance("SHA-256").digest(key.toByteArray(Charsets.UTF_8))
+        return File(directory, digest.joinToString("") { "%02x".format(it) } + ".json")
+    }
+
+    private fun readDisk(key: String): SymPyResult? {
+        val file = fileFor(dir ?: return null, key)
+        if (!file.isFile) return null
+        return try {
+            fromJson(JSONObject(file.readText())).also { file.setLastModified(System.currentTimeMillis()) }
+        } catch (e: IOException) {
+            null
+        } catch (e: JSONException) {
+            file.delete()
+            null
+        }
+    }
+
+    private fun writeDisk(key: String, result: SymPyResult) {
+        val directory = dir ?: return
+        val file = fileFor(directory, key)
+        val tmp = File(directory, "${file.name}.tmp")
+        try {
+            tmp.writeText(toJson(result).toString())
+            if (!tmp.renameTo(file)) {
+                tmp.delete()
+                return
+            }
+        } catch (e: IOException) {
+            tmp.delete()
+            return
+        }
+        if (diskEntries.incrementAndGet() > MAX_DISK_ENTRIES) {
+            synchronized(this) { trimDisk(directory) }
+        }
+    }
+
+    // Drop the least recently used files down to three quarters of the bound
+    private fun trimDisk(directory: File) {
+        val files = directory.listFiles { file -> file.extension == "json" }.orEmpty()
+        var count = files.size
+        if (count > MAX_DISK_ENTRIES) {
+            for (file in files.sortedBy { it.lastModified() }) {
+                if (count <= MAX_DISK_ENTRIES * 3 / 4) break
+                if (file.delete()) count--
+            }
+        }
+        diskEntries.set(count)
+    }
+
+    private fun toJson(result: SymPyResult): JSONObject = JSONObject().apply {
+        put("success", result.success)
+        put("result", result.result ?: JSONObject.NULL)
+        put("explanation", result.explanation)
+        put("error", result.error ?: JSONObject.NULL)
+        result.steps?.let { put("steps", JSONArray(it)) }
+        result.solutions?.let { put("solutions", JSONArray(it)) }
+    }
+
+    private fun fromJson(json: JSONObject): SymPyResult = SymPyResult(
+        success = json.getBoolean("success"),
+        result = json.optStringOrNull("result"),
+        explanation = json.getString("explanation"),
+        error = json.optStringOrNull("error"),
+        steps = json.optJSONArray("steps")?.toStringList(),
+        solutions = json.optJSONArray("solutions")?.toStringList()
+    )
+
+    private fun JSONObject.optStringOrNull(name: String): String? =
+        if (isNull(name)) null else getString(name)
+
+    private fun JSONArray.toStringList(): List<String> = List(length()) { getString(it) }
+
+    companion object {
+        private const val MAX_DISK_ENTRIES = 2048
+    }
+}
+
+/**
+ * Counters of the SymPy result cache
+ *
+ * Each lookup counts once: a memory hit, a disk hit, or a miss that went
+ * to Python.
+ */
+data class ToolCacheStats(
+    val hits: Long,
+    val diskHits: Long,
+    val misses: Long
+) {
+    val hitRate: Float
+        get() {
+            val total = hits + diskHits + misses
+            return if (total == 0L) 0f else (hits + diskHits).toFloat() / total
+        }
 }
 
 /**
@@ -0,0 +1,136 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+
+#include "expr_eval.h"
+#include "test_util.h"
+
+static void check_value(const char *expr, double expected, int line) {
+    const ExpressionEvaluator::Result r = ExpressionEvaluator::evaluate(expr);
+    if (!r.ok || std::fabs(r.value - expected) > 1e-9 * std::max(1.0, std::fabs(expected))) {
+        fprintf(stderr, "%s:%d: \"%s\" gave ok=%d %.12g (%s), expected %.12g\n",
+                __FILE__, line, expr, r.ok, r.value, r.error.c_str(), expected);
+        test_failures()++;
+    }
+}
+
+static void check_exact(const char *expr, int64_t num, int64_t den, int line) {
+    const ExpressionEvaluator::Result r = ExpressionEvaluator::evaluate(expr);
+    if (!r.ok || !r.exact || r.num != num || r.den != den) {
+        fprintf(stderr, "%s:%d: \"%s\" gave ok=%d exact=%d %lld/%lld, expected %lld/%lld\n",
+                __FILE__, line, expr, r.ok, r.exact, (long long)r.num, (long long)r.den,
+                (long long)num, (long long)den);
+        test_failures()++;
+    }
+}
+
+static void check_error(const std::string &expr, int line) {
+    const ExpressionEvaluator::Result r = ExpressionEvaluator::evaluate(expr);
+    if (r.ok) {
+        fprintf(stderr, "%s:%d: \"%s\" gave %.12g, expected an error\n", __FILE__, line, expr.c_str(), r.value);
+        test_failures()++;
+    }
+}
+
+#define CHECK_VALUE(expr, expected) check_value(expr, expected, __LINE__)
+#define CHECK_EXACT(expr, num, den) check_exact(expr, num, den, __LINE__)
+#define CHECK_ERROR(expr) check_error(expr, __LINE__)
+
+TEST(arithmetic) {
+    CHECK_EXACT("2 + 2", 4, 1);
+    CHECK_EXACT("2 + 3 * 4", 14, 1);
+    CHECK_EXACT("(2 + 3) * 4", 20, 1);
+    CHECK_EXACT("2^10", 1024, 1);
+    CHECK_EXACT("2 ** 3 ** 2", 512, 1);     // Right associative
+    CHECK_EXACT("-2^2", -4, 1);
+    CHECK_EXACT("2^-2", 1, 4);
+    CHECK_EXACT("6 \xC3\x97 7", 42, 1);     // ×
+    CHECK_EXACT("8 \xC3\xB7 2", 4, 1);      // ÷
+    CHECK_EXACT("5 \xE2\x88\x92 7", -2, 1); // −
+    CHECK_VALUE("2^0.5", std::sqrt(2.0));
+}
+
+TEST(exact_rationals) {
+    CHECK_EXACT("1/3 + 1/6", 1, 2);
+    CHECK_EXACT("0.1 + 0.2", 3, 10);
+    CHECK_EXACT("3.5 * 4", 14, 1);
+    CHECK_EXACT(".5 * 2", 1, 1);
+    CHECK_EXACT("1.5e3", 1500, 1);
+    CHECK_EXACT("abs(-3/4)", 3, 4);
+    CHECK_EXACT("sqrt(9/4)", 3, 2);
+    CHECK_EXACT("floor(7/2)", 3, 1);
+}
+
+TEST(factorials) {
+    CHECK_EXACT("5!", 120, 1);
+    CHECK_EXACT("3! + 1", 7, 1);
+    CHECK_EXACT("0!", 1, 1);
+    CHECK_ERROR("2.5!");
+    CHECK_ERROR("(-1)!");
+    CHECK_ERROR("171!");
+}
+
+TEST(implicit_multiplication) {
+    CHECK_EXACT("2(3+4)", 14, 1);
+    CHECK_EXACT("(1+1)(2+2)", 8, 1);
+    CHECK_VALUE("3pi", 3 * M_PI);
+    CHECK_VALUE("2\xCF\x80", 2 * M_PI);             // 2π
+    CHECK_VALUE("2sqrt(2)", 2 * std::sqrt(2.0));
+    CHECK_VALUE("2\xE2\x88\x9A" "4", 4.0);          // 2√4
+    CHECK_VALUE("2e", 2 * M_E);                     // Not scientific notation
+}
+
+TEST(juxtaposed_numbers_are_errors) {
+    CHECK_ERROR("2 3");
+    CHECK_ERROR("1 000");
+    CHECK_ERROR("(2)3");
+    CHECK_ERROR("1.5.5");
+    CHECK_ERROR("1e5.2");
+}
+
+TEST(logarithms) {
+    CHECK_VALUE("log(100)", std::log(100.0));       // Natural, like exp4j and SymPy
+    CHECK_VALUE("ln(e)", 1.0);
+    CHECK_VALUE("log10(1000)", 3.0);
+    CHECK_VALUE("log2(8)", 3.0);
+    CHECK_VALUE("exp(1)", M_E);
+    CHECK_ERROR("log(0)");
+    CHECK_ERROR("log(-1)");
+}
+
+TEST(trig_degrees_and_radians) {
+    CHECK_VALUE("sin(30)", 0.5);                    // Bare integer: degrees
+    CHECK_VALUE("cos(60\xC2\xB0)", 0.5);            // °
+    CHECK_VALUE("tan(45 deg)", 1.0);
+    CHECK_VALUE("sin(pi/2)", 1.0);                  // Anything else: radians
+    CHECK_VALUE("cos(0.5)", std::cos(0.5));
+}
+
+TEST(roots) {
+    CHECK_VALUE("\xE2\x88\x9A" "16", 4.0);          // √16
+    CHECK_VALUE("cbrt(27)", 3.0);
+    CHECK_ERROR("sqrt(-1)");
+}
+
+TEST(errors) {
+    CHECK_ERROR("");
+    CHECK_ERROR("1 / 0");
+    CHECK_ERROR("2x + 1");                          // Variables go to SymPy
+    CHECK_ERROR("2 x");
+    CHECK_ERROR("(1 + 2");
+    CHECK_ERROR("1 +");
+    CHECK_ERROR("foo(1)");
+    CHECK_ERROR("pi2");
+    CHECK_ERROR(std::string(100, '(') + "1" + std::string(100, ')'));
+}
+
+TEST(error_position) {
+    const ExpressionEvaluator::Result r = ExpressionEvaluator::evaluate("1 + $");
+    CHECK(!r.ok);
+    CHECK_EQ(r.error_pos, (size_t)4);
+}
+
+int main() {
+    return run_tests();
+}
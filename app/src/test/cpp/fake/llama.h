@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Just enough of llama.h for the header-only pieces under test
+ *
+ * A vocabulary is a list of byte pieces, indexed by token id.
+ */
+
+typedef int32_t llama_token;
+
+struct llama_vocab {
+    std::vector<std::string> pieces;
+};
+
+inline int32_t llama_token_to_piece(
+    const llama_vocab *vocab, llama_token token, char *buf, int32_t length, int32_t /*lstrip*/, bool /*special*/
+) {
+    const std::string &piece = vocab->pieces[(size_t)token];
+    if ((int32_t)piece.size() > length) {
+        return -(int32_t)piece.size();
+    }
+    memcpy(buf, piece.data(), piece.size());
+    return (int32_t)piece.size();
+}
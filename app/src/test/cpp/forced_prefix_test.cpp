@@ -0,0 +1,45 @@
+#include <string>
+
+#include "forced_prefix.h"
+#include "test_util.h"
+
+// Token ids index the pieces
+static const llama_vocab vocab{ { "a", "ab", "abc", "b", "", "{\"action\": \"", "{\"" } };
+
+TEST(single_token_is_forced_whole) {
+    CHECK_EQ(forced_prefix(&vocab, { 2 }), "abc");
+}
+
+TEST(token_ending_inside_the_prefix_stops_it) {
+    // "ab" | "ac" with no "ac" token: the allowed set is {a, ab}, and "a"
+    // followed by "c" is still valid, so only "a" is forced
+    CHECK_EQ(forced_prefix(&vocab, { 0, 1 }), "a");
+    CHECK_EQ(forced_prefix(&vocab, { 1, 0 }), "a");
+    CHECK_EQ(forced_prefix(&vocab, { 1, 2 }), "ab");
+}
+
+TEST(diverging_tokens_force_nothing) {
+    CHECK_EQ(forced_prefix(&vocab, { 0, 3 }), "");
+    CHECK_EQ(forced_prefix(&vocab, { 0, 1, 3 }), "");
+}
+
+TEST(empty_piece_forces_nothing) {
+    CHECK_EQ(forced_prefix(&vocab, { 1, 4 }), "");
+}
+
+TEST(no_allowed_tokens_force_nothing) {
+    CHECK_EQ(forced_prefix(&vocab, {}), "");
+}
+
+TEST(long_pieces_are_rendered_whole) {
+    const llama_vocab long_vocab{ { std::string(100, 'x') + "1", std::string(100, 'x') + "2" } };
+    CHECK_EQ(forced_prefix(&long_vocab, { 0, 1 }), std::string(100, 'x'));
+}
+
+TEST(json_framing_is_forced_up_to_the_shortest_token) {
+    CHECK_EQ(forced_prefix(&vocab, { 5, 6 }), "{\"");
+}
+
+int main() {
+    return run_tests();
+}
@@ -0,0 +1,59 @@
+#include <string>
+
+#include "stop_strings.h"
+#include "test_util.h"
+
+TEST(no_stop_strings_streams_everything) {
+    StopStringMatcher matcher({});
+    CHECK_EQ(std::string(matcher.push("hello ")), "hello ");
+    CHECK_EQ(std::string(matcher.push("world")), "world");
+    CHECK(!matcher.stopped());
+}
+
+TEST(empty_stop_strings_are_ignored) {
+    StopStringMatcher matcher({ "" });
+    CHECK_EQ(std::string(matcher.push("abc")), "abc");
+    CHECK(!matcher.stopped());
+}
+
+TEST(stop_string_split_across_pushes) {
+    StopStringMatcher matcher({ "\nObservation:" });
+    std::string out;
+    out += matcher.push("x = 5");
+    out += matcher.push("\nObs");           // Could become the stop string: held back
+    CHECK_EQ(out, "x = 5");
+    out += matcher.push("ervation: 42");
+    CHECK(matcher.stopped());
+    CHECK_EQ(out, "x = 5");
+    CHECK(matcher.push("more").empty());
+    CHECK(matcher.flush().empty());
+}
+
+TEST(held_text_is_released_when_it_diverges) {
+    StopStringMatcher matcher({ "<|im_end|>" });
+    std::string out;
+    out += matcher.push("a <|im");
+    CHECK_EQ(out, "a ");
+    out += matcher.push("age|>");
+    CHECK_EQ(out, "a <|image|>");
+    CHECK(!matcher.stopped());
+}
+
+TEST(earliest_match_wins) {
+    StopStringMatcher matcher({ "END", "STOP" });
+    CHECK_EQ(std::string(matcher.push("one STOP two END")), "one ");
+    CHECK(matcher.stopped());
+}
+
+TEST(flush_releases_the_held_tail) {
+    StopStringMatcher matcher({ "<|im_end|>" });
+    std::string out;
+    out += matcher.push("done <|im_");
+    out += matcher.flush();
+    CHECK_EQ(out, "done <|im_");
+    CHECK(!matcher.stopped());
+}
+
+int main() {
+    return run_tests();
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Minimal test harness for the host-built native tests
+ *
+ * TEST(name) registers a function; a failed CHECK prints its location and
+ * the test keeps going, so one run reports every failure. Each test file
+ * is its own executable whose main() returns run_tests().
+ */
+
+using TestFn = void (*)();
+
+inline std::vector<std::pair<const char *, TestFn>> &test_registry() {
+    static std::vector<std::pair<const char *, TestFn>> tests;
+    return tests;
+}
+
+inline int &test_failures() {
+    static int failures = 0;
+    return failures;
+}
+
+struct TestRegistrar {
+    TestRegistrar(const char *name, TestFn fn) {
+        test_registry().emplace_back(name, fn);
+    }
+};
+
+#define TEST(name) \
+    static void name(); \
+    static const TestRegistrar name##_registrar(#name, name); \
+    static void name()
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+            test_failures()++; \
+        } \
+    } while (0)
+
+#define CHECK_EQ(a, b) \
+    do { \
+        if (!((a) == (b))) { \
+            fprintf(stderr, "%s:%d: CHECK_EQ failed: %s == %s\n", __FILE__, __LINE__, #a, #b); \
+            test_failures()++; \
+        } \
+    } while (0)
+
+inline int run_tests() {
+    for (const auto &test : test_registry()) {
+        const int before = test_failures();
+        test.second();
+        printf("%s %s\n", test_failures() == before ? "PASS" : "FAIL", test.first);
+    }
+    printf("%d failure(s)\n", test_failures());
+    return test_failures() == 0 ? 0 : 1;
+}
@@ -0,0 +1,70 @@
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "test_util.h"
+#include "token_ring.h"
+
+static const std::atomic<bool> no_abort{false};
+
+TEST(wraps_around) {
+    TokenRing ring(8);
+    char out[16];
+    for (int round = 0; round < 5; round++) {
+        CHECK(ring.write("abcde", 5, no_abort));
+        CHECK_EQ(ring.size(), (size_t)5);
+        CHECK_EQ(ring.read_utf8(out, sizeof(out)), (size_t)5);
+        CHECK_EQ(std::string(out, 5), "abcde");
+    }
+    CHECK_EQ(ring.read_utf8(out, sizeof(out)), (size_t)0);
+}
+
+TEST(capacity_rounds_up_to_a_power_of_two) {
+    TokenRing ring(5);
+    CHECK(ring.write("01234567", 8, no_abort));    // Fits only if the ring holds 8
+    CHECK_EQ(ring.size(), (size_t)8);
+}
+
+TEST(keeps_code_points_whole) {
+    TokenRing ring(16);
+    char out[16];
+    CHECK(ring.write("a\xCF\x80", 3, no_abort));            // a π
+    CHECK_EQ(ring.read_utf8(out, 2), (size_t)1);            // Would cut π in half
+    CHECK_EQ(ring.read_utf8(out, sizeof(out)), (size_t)2);
+    CHECK_EQ(std::string(out, 2), "\xCF\x80");
+}
+
+TEST(holds_back_a_partly_written_code_point) {
+    TokenRing ring(16);
+    char out[16];
+    CHECK(ring.write("x\xE2\x88", 3, no_abort));            // √ missing its last byte
+    CHECK_EQ(ring.read_utf8(out, sizeof(out)), (size_t)1);
+    CHECK(ring.write("\x9A", 1, no_abort));
+    CHECK_EQ(ring.read_utf8(out, sizeof(out)), (size_t)3);
+    CHECK_EQ(std::string(out, 3), "\xE2\x88\x9A");
+}
+
+TEST(full_ring_waits_for_the_consumer) {
+    TokenRing ring(4);
+    const std::string text = "0123456789abcdef";
+    std::thread producer([&] { CHECK(ring.write(text.data(), text.size(), no_abort)); });
+
+    std::string received;
+    char out[4];
+    while (received.size() < text.size()) {
+        received.append(out, ring.read_utf8(out, sizeof(out)));
+    }
+    producer.join();
+    CHECK_EQ(received, text);
+}
+
+TEST(abort_stops_a_blocked_write) {
+    TokenRing ring(4);
+    const std::atomic<bool> abort{true};
+    CHECK(!ring.write("0123456789", 10, abort));     // Fills the ring, then gives up
+    CHECK_EQ(ring.size(), (size_t)4);
+}
+
+int main() {
+    return run_tests();
+}
@@ -0,0 +1,64 @@
+#include <string>
+
+#include "test_util.h"
+#include "utf8_stream.h"
+
+TEST(incomplete_tail) {
+    CHECK_EQ(utf8_incomplete_tail("abc", 3), (size_t)0);
+    CHECK_EQ(utf8_incomplete_tail("", 0), (size_t)0);
+    CHECK_EQ(utf8_incomplete_tail("\xCF\x80", 2), (size_t)0);         // π complete
+    CHECK_EQ(utf8_incomplete_tail("a\xCF", 2), (size_t)1);            // π lead byte only
+    CHECK_EQ(utf8_incomplete_tail("\xE2\x88", 2), (size_t)2);         // √ missing one byte
+    CHECK_EQ(utf8_incomplete_tail("\xF0\x9F\x98", 3), (size_t)3);     // 4-byte emoji
+    CHECK_EQ(utf8_incomplete_tail("\xF0\x9F\x98\x80", 4), (size_t)0);
+}
+
+TEST(incomplete_tail_ignores_malformed_bytes) {
+    CHECK_EQ(utf8_incomplete_tail("\x80\x80\x80\x80", 4), (size_t)0);  // No lead byte in reach
+    CHECK_EQ(utf8_incomplete_tail("\xCF\x80\x80", 3), (size_t)0);      // Too many continuations
+}
+
+TEST(detokenizer_joins_split_code_points) {
+    // π = CF 80 and √ = E2 88 9A, each split across tokens
+    const llama_vocab vocab{ { "x = ", "\xCF", "\x80", "\xE2", "\x88\x9A", "2" } };
+    Utf8Detokenizer detokenizer(&vocab);
+    std::string out;
+    out += detokenizer.push(0);
+    out += detokenizer.push(1);
+    CHECK_EQ(out, "x = ");
+    out += detokenizer.push(2);
+    out += detokenizer.push(3);
+    CHECK_EQ(out, "x = \xCF\x80");
+    out += detokenizer.push(4);
+    out += detokenizer.push(5);
+    CHECK_EQ(out, "x = \xCF\x80\xE2\x88\x9A" "2");
+    CHECK(detokenizer.flush().empty());
+}
+
+TEST(detokenizer_grows_its_buffer) {
+    const llama_vocab vocab{ { "\xE2", std::string(200, 'a') + "\x88\x9A" } };
+    Utf8Detokenizer detokenizer(&vocab);
+    CHECK(detokenizer.push(0).empty());
+    // Longer than the initial buffer, behind a held-back byte
+    CHECK_EQ(std::string(detokenizer.push(1)), "\xE2" + std::string(200, 'a') + "\x88\x9A");
+}
+
+TEST(detokenizer_flushes_an_unfinished_code_point) {
+    const llama_vocab vocab{ { "a\xE2\x88" } };
+    Utf8Detokenizer detokenizer(&vocab);
+    CHECK_EQ(std::string(detokenizer.push(0)), "a");
+    CHECK_EQ(std::string(detokenizer.flush()), "\xEF\xBF\xBD");
+    CHECK(detokenizer.flush().empty());
+}
+
+TEST(detokenizer_reset_drops_held_bytes) {
+    const llama_vocab vocab{ { "\xCF", "b" } };
+    Utf8Detokenizer detokenizer(&vocab);
+    CHECK(detokenizer.push(0).empty());
+    detokenizer.reset();
+    CHECK_EQ(std::string(detokenizer.push(1)), "b");
+}
+
+int main() {
+    return run_tests();
+}
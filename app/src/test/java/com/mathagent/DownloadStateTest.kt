@@ -0,0 +1,59 @@
+package com.mathagent
+
+import org.junit.Assert.assertEquals
+import org.junit.Assert.assertNull
+import org.junit.Test
+import java.util.BitSet
+
+class DownloadStateTest {
+
+    private val total = 3 * DownloadState.CHUNK_BYTES + 100     // Three full chunks and a short one
+    private val validator = "0123abcd"
+    private val header = DownloadState.header(total, validator)
+
+    private fun bits(vararg indices: Int) = BitSet().apply { indices.forEach { set(it) } }
+
+    @Test
+    fun chunkLayout() {
+        assertEquals(4, DownloadState.chunkCount(total))
+        assertEquals(1, DownloadState.chunkCount(DownloadState.CHUNK_BYTES))
+        assertEquals(DownloadState.CHUNK_BYTES, DownloadState.chunkLength(0, total))
+        assertEquals(100L, DownloadState.chunkLength(3, total))
+    }
+
+    @Test
+    fun parsesFinishedChunks() {
+        val lines = listOf(header, DownloadState.record(2), DownloadState.record(0))
+        assertEquals(bits(0, 2), DownloadState.parse(lines, total, validator, 4))
+    }
+
+    @Test
+    fun ignoresTornAndOutOfRangeLines() {
+        val lines = listOf(header, "1.", "7.", "-1.", "x.", "", "3")     // "3" was cut off mid-write
+        assertEquals(bits(1), DownloadState.parse(lines, total, validator, 4))
+    }
+
+    @Test
+    fun rejectsOtherContent() {
+        val lines = listOf(header, "0.")
+        assertNull(DownloadState.parse(lines, total + 1, validator, 4))
+        assertNull(DownloadState.parse(lines, total, "ffff", 4))
+        assertNull(DownloadState.parse(lines, total, null, 4))
+        assertNull(DownloadState.parse(emptyList(), total, validator, 4))
+    }
+
+    @Test
+    fun freshStateHasNoChunks() {
+        assertEquals(BitSet(), DownloadState.parse(listOf(header), total, validator, 4))
+    }
+
+    @Test
+    fun progressCountsRecordedChunks() {
+        assertEquals(0f, DownloadState.progress(listOf(header))!!, 0f)
+        val progress = DownloadState.progress(listOf(header, "0.", "1", "2."))!!
+        assertEquals(2f * DownloadState.CHUNK_BYTES / total, progress, 1e-6f)
+        assertEquals(1f, DownloadState.progress(listOf(header, "0.", "1.", "2.", "3."))!!, 0f)
+        assertNull(DownloadState.progress(listOf("garbage")))
+        assertNull(DownloadState.progress(emptyList()))
+    }
+}
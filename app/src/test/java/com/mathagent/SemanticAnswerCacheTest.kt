@@ -0,0 +1,157 @@
+package com.mathagent
+
+import kotlinx.coroutines.runBlocking
+import org.junit.Assert.assertEquals
+import org.junit.Assert.assertNotEquals
+import org.junit.Assert.assertNotNull
+import org.junit.Assert.assertNull
+import org.junit.Rule
+import org.junit.Test
+import org.junit.rules.TemporaryFolder
+import kotlin.math.sqrt
+
+class SemanticAnswerCacheTest {
+
+    @get:Rule
+    val folder = TemporaryFolder()
+
+    /**
+     * Embeds each question as a fixed 2-d unit vector at the given cosine from (1, 0)
+     */
+    private class FakeEmbedder : QuestionEmbedder {
+        val cosines = HashMap<String, Float>()
+
+        override var modelId: String? = "model-a"
+
+        override suspend fun embed(text: String): FloatArray? {
+            val cos = cosines[text] ?: 1f
+            return floatArrayOf(cos, sqrt(1f - cos * cos))
+        }
+    }
+
+    private val embedder = FakeEmbedder()
+    private val trace = listOf(ToolStep("solve_equation", "2*x + 5 = 15", true, "x = 5"))
+
+    private fun newCache() = SemanticAnswerCache(embedder, folder.root.resolve("answers.bin"))
+
+    private fun signature(question: String) = SemanticAnswerCache.mathSignature(question)
+
+    // --------------------------------------------------------------------------
+    // Math signature
+    // --------------------------------------------------------------------------
+
+    @Test
+    fun signatureIgnoresPhrasing() {
+        assertEquals("solve2x+5=15", signature("Solve 2x + 5 = 15"))
+        assertEquals(signature("Solve 2x + 5 = 15"), signature("how do I solve 2x+5=15"))
+        assertEquals(signature("Solve 2x + 5 = 15"), signature("Can you solve 2x + 5 = 15?"))
+    }
+
+    @Test
+    fun signatureKeepsWhatChangesTheAnswer() {
+        assertNotEquals(signature("Solve 2x + 5 = 15"), signature("Solve 2x + 5 = 17"))
+        assertNotEquals(signature("What is sin(30)?"), signature("What is cos(30)?"))
+        assertNotEquals(signature("Solve 2x + 5 = 15"), signature("Simplify 2x + 5 = 15"))
+        assertEquals("simplify2xy+x", signature("Simplify 2xy + x"))
+        assertNotEquals(signature("Simplify 2xy + x"), signature("Simplify 2x + x"))
+    }
+
+    @Test
+    fun signatureKeepsComparisonAndNegation() {
+        assertEquals("7greaterthan3", signature("Is 7 greater than 3?"))
+        assertNotEquals(signature("Is 7 greater than 3?"), signature("Is 7 less than 3?"))
+        assertNotEquals(signature("Is 7 prime?"), signature("Is 7 not prime?"))
+        assertNotEquals(signature("Is x = 2 a solution?"), signature("Is x = 2 not a solution?"))
+    }
+
+    @Test
+    fun signatureKeepsPropertyWords() {
+        assertEquals("7prime", signature("Is 7 prime?"))
+        assertNotEquals(signature("Is 7 prime?"), signature("Is 7 even?"))
+        assertNotEquals(signature("Is 7 even?"), signature("Is 7 odd?"))
+        assertEquals(signature("Is 7 prime?"), signature("Can you tell me if 7 is prime?"))
+    }
+
+    @Test
+    fun signatureKeepsSingleLetterVariables() {
+        assertEquals("solvea+1=2", signature("Solve a + 1 = 2"))
+        assertEquals(signature("What's sin(30)?"), signature("What is sin(30)?"))
+    }
+
+    // --------------------------------------------------------------------------
+    // Lookup
+    // --------------------------------------------------------------------------
+
+    @Test
+    fun hitsAtOrAboveThreshold() = runBlocking<Unit> {
+        val cache = newCache()
+        val miss = cache.lookup("Solve 2x + 5 = 15")
+        assertNull(miss.hit)
+        cache.store(miss, "x = 5", trace)
+
+        embedder.cosines["how do I solve 2x+5=15"] = 0.95f
+        val hit = cache.lookup("how do I solve 2x+5=15")
+        assertEquals(CachedAnswer("Solve 2x + 5 = 15", "x = 5", trace), hit.hit)
+        assertEquals(0.95f, hit.similarity, 1e-4f)
+    }
+
+    @Test
+    fun missesBelowThreshold() = runBlocking<Unit> {
+        val cache = newCache()
+        cache.store(cache.lookup("Solve 2x + 5 = 15"), "x = 5", trace)
+
+        embedder.cosines["Solve 2x + 5 = 15 please"] = 0.5f
+        val lookup = cache.lookup("Solve 2x + 5 = 15 please")
+        assertNull(lookup.hit)
+        assertEquals(0.5f, lookup.similarity, 1e-4f)
+        assertEquals(2L, cache.stats().lookups)
+        assertEquals(0L, cache.stats().hits)
+    }
+
+    @Test
+    fun differentSignatureNeverHits() = runBlocking<Unit> {
+        val cache = newCache()
+        cache.store(cache.lookup("Solve 2x + 5 = 15"), "x = 5", trace)
+        // Same vector, different numbers
+        assertNull(cache.lookup("Solve 2x + 5 = 17").hit)
+    }
+
+    @Test
+    fun disabledEmbeddingsAreNotCounted() = runBlocking<Unit> {
+        embedder.modelId = null
+        val cache = newCache()
+        val lookup = cache.lookup("Solve 2x + 5 = 15")
+        assertNull(lookup.hit)
+        cache.store(lookup, "x = 5", trace)
+        assertEquals(0L, cache.stats().lookups)
+        assertEquals(0, cache.stats().entries)
+    }
+
+    @Test
+    fun modelChangeDropsEntries() = runBlocking<Unit> {
+        val cache = newCache()
+        cache.store(cache.lookup("Solve 2x + 5 = 15"), "x = 5", trace)
+
+        embedder.modelId = "model-b"
+        assertNull(cache.lookup("Solve 2x + 5 = 15").hit)
+        assertEquals(0, cache.stats().entries)
+    }
+
+    @Test
+    fun entriesPersistAcrossInstances() = runBlocking<Unit> {
+        newCache().apply { store(lookup("Solve 2x + 5 = 15"), "x = 5", trace) }
+
+        val hit = newCache().lookup("Solve 2x + 5 = 15").hit
+        assertNotNull(hit)
+        assertEquals(trace, hit!!.toolTrace)
+    }
+
+    @Test
+    fun clearRemovesTheFile() = runBlocking<Unit> {
+        val cache = newCache()
+        cache.store(cache.lookup("Solve 2x + 5 = 15"), "x = 5", trace)
+        cache.clear()
+
+        assertNull(newCache().lookup("Solve 2x + 5 = 15").hit)
+    }
+}
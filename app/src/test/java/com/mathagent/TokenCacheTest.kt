@@ -0,0 +1,46 @@
+package com.mathagent
+
+import org.junit.Assert.assertArrayEquals
+import org.junit.Assert.assertEquals
+import org.junit.Test
+
+class TokenCacheTest {
+
+    private var calls = 0
+
+    private fun tokenize(vararg tokens: Int): () -> IntArray = {
+        calls++
+        tokens
+    }
+
+    @Test
+    fun repeatedTextIsTokenizedOnce() {
+        val cache = TokenCache(4)
+        assertArrayEquals(intArrayOf(1, 2), cache.getOrPut("x + 1", true, tokenize(1, 2)))
+        assertArrayEquals(intArrayOf(1, 2), cache.getOrPut("x + 1", true, tokenize(9)))
+        assertEquals(1, calls)
+    }
+
+    @Test
+    fun addSpecialIsPartOfTheKey() {
+        val cache = TokenCache(4)
+        cache.getOrPut("x", true, tokenize(0, 1))
+        assertArrayEquals(intArrayOf(1), cache.getOrPut("x", false, tokenize(1)))
+        assertEquals(2, calls)
+    }
+
+    @Test
+    fun evictsLeastRecentlyUsed() {
+        val cache = TokenCache(2)
+        cache.getOrPut("a", false, tokenize(1))
+        cache.getOrPut("b", false, tokenize(2))
+        cache.getOrPut("a", false, tokenize(1))     // "b" is now the oldest
+        cache.getOrPut("c", false, tokenize(3))
+        assertEquals(3, calls)
+
+        cache.getOrPut("a", false, tokenize(1))
+        assertEquals(3, calls)
+        cache.getOrPut("b", false, tokenize(2))
+        assertEquals(4, calls)
+    }
+}
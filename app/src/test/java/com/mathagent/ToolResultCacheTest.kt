@@ -0,0 +1,85 @@
+package com.mathagent
+
+import org.junit.Assert.assertEquals
+import org.junit.Assert.assertNotEquals
+import org.junit.Assert.assertNull
+import org.junit.Rule
+import org.junit.Test
+import org.junit.rules.TemporaryFolder
+
+class ToolResultCacheTest {
+
+    @get:Rule
+    val folder = TemporaryFolder()
+
+    private val result = SymPyResult(
+        success = true,
+        result = "x = 5",
+        explanation = "Solved",
+        steps = listOf("2x = 10", "x = 5"),
+        solutions = listOf("5")
+    )
+
+    private fun key(method: String, vararg args: Any?) = SymPyBridge.resultKey(method, args)
+
+    @Test
+    fun keyIgnoresSpacingAroundOperators() {
+        assertEquals(key("solve_equation", "2*x + 5 = 15", "x"), key("solve_equation", " 2*x+5=15 ", "x"))
+        assertEquals(key("simplify", "sin( x )  ^ 2"), key("simplify", "sin(x)^2"))
+    }
+
+    @Test
+    fun keyKeepsWhatChangesTheMeaning() {
+        assertNotEquals(key("solve_equation", "2*x + 5 = 15", "x"), key("solve_equation", "2*x + 5 = 17", "x"))
+        assertNotEquals(key("solve_equation", "x*y = 1", "x"), key("solve_equation", "x*y = 1", "y"))
+        assertNotEquals(key("simplify", "x"), key("expand", "x"))
+        // Arguments are separated, so they cannot run into each other
+        assertNotEquals(key("simplify", "ab", "c"), key("simplify", "a", "bc"))
+    }
+
+    @Test
+    fun memoryHitsAreCounted() {
+        val cache = ToolResultCache(4)
+        assertNull(cache.get("k"))
+        cache.put("k", result)
+        assertEquals(result, cache.get("k"))
+        assertEquals(ToolCacheStats(hits = 1, diskHits = 0, misses = 1), cache.stats())
+    }
+
+    @Test
+    fun diskTierSurvivesANewCache() {
+        val dir = folder.newFolder("results")
+        ToolResultCache(4).apply {
+            attachDisk(dir)
+            put("k", result)
+        }
+
+        val cache = ToolResultCache(4)
+        cache.attachDisk(dir)
+        assertEquals(result, cache.get("k"))        // From disk, promoted to memory
+        assertEquals(result, cache.get("k"))
+        assertEquals(ToolCacheStats(hits = 1, diskHits = 1, misses = 0), cache.stats())
+    }
+
+    @Test
+    fun evictedEntriesFallBackToDisk() {
+        val dir = folder.newFolder("results")
+        val cache = ToolResultCache(1)
+        cache.attachDisk(dir)
+        cache.put("a", result)
+        cache.put("b", result.copy(result = "x = 6"))
+        assertEquals(result, cache.get("a"))
+        assertEquals(1L, cache.stats().diskHits)
+    }
+
+    @Test
+    fun unreadableFileIsAMiss() {
+        val dir = folder.newFolder("results")
+        val cache = ToolResultCache(1)
+        cache.attachDisk(dir)
+        cache.put("a", result)
+        dir.listFiles()!!.forEach { it.writeText("{ not json") }
+        cache.put("b", result)                      // Pushes "a" out of memory
+        assertNull(cache.get("a"))
+    }
+}